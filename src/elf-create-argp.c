@@ -1,8 +1,27 @@
 #include "elf-create-argp.h"
+#include "fself.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+
+static const struct option long_options[] = {
+	{"stats", required_argument, NULL, 'S'},
+	{"batch", required_argument, NULL, 'b'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"server", required_argument, NULL, 'R'},
+	{"strip-debug", no_argument, NULL, 's'},
+	{"keep-debug", no_argument, NULL, 'k'},
+	{"debug-file", required_argument, NULL, 'g'},
+	{"cache", required_argument, NULL, 'c'},
+	{"no-cache", no_argument, NULL, 'C'},
+	{"content-nid", no_argument, NULL, 'N'},
+	{"fself", no_argument, NULL, 'F'},
+	{"safe", no_argument, NULL, 'P'},
+	{"authid", required_argument, NULL, 'A'},
+	{NULL, 0, NULL, 0}
+};
 
 int parse_arguments(int argc, char *argv[], elf_create_args *arguments)
 {
@@ -10,8 +29,14 @@ int parse_arguments(int argc, char *argv[], elf_create_args *arguments)
 
 	arguments->log_level = 0;
 	arguments->check_stub_count = 1;
+	arguments->cache = getenv(ELF_CREATE_CACHE_ENV);
+	if (arguments->cache && *arguments->cache == '\0')
+		arguments->cache = NULL;
+#ifdef STRIP_DEBUG_DEFAULT
+	arguments->strip_debug = 1;
+#endif
 
-	while ((c = getopt(argc, argv, "vne:")) != -1)
+	while ((c = getopt_long(argc, argv, "vne:b:j:", long_options, NULL)) != -1)
 	{
 		switch (c)
 		{
@@ -24,6 +49,45 @@ int parse_arguments(int argc, char *argv[], elf_create_args *arguments)
 		case 'n':
 			arguments->check_stub_count = 0;
 			break;
+		case 'S':
+			arguments->stats = optarg;
+			break;
+		case 'b':
+			arguments->batch = optarg;
+			break;
+		case 'j':
+			arguments->jobs = atoi(optarg);
+			break;
+		case 'R':
+			arguments->server = optarg;
+			break;
+		case 's':
+			arguments->strip_debug = 1;
+			break;
+		case 'k':
+			arguments->strip_debug = 0;
+			break;
+		case 'g':
+			arguments->debug_file = optarg;
+			break;
+		case 'c':
+			arguments->cache = optarg;
+			break;
+		case 'C':
+			arguments->cache = NULL;
+			break;
+		case 'N':
+			arguments->content_nid = 1;
+			break;
+		case 'F':
+			arguments->fself = 1;
+			break;
+		case 'P':
+			arguments->fself_safe = 1;
+			break;
+		case 'A':
+			arguments->fself_authid = optarg;
+			break;
 		case '?':
 			fprintf(stderr, "unknown option -%c\n", optopt);
 			return -1;
@@ -32,6 +96,49 @@ int parse_arguments(int argc, char *argv[], elf_create_args *arguments)
 		}
 	}
 
+	if ((arguments->fself_safe || arguments->fself_authid) && !arguments->fself)
+	{
+		printf("--safe and --authid only apply to --fself output\n");
+		return -1;
+	}
+
+	if (arguments->fself_authid)
+	{
+		char *end;
+		strtoull(arguments->fself_authid, &end, 0);
+		if (*arguments->fself_authid == '\0' || *end != '\0')
+		{
+			printf("invalid --authid '%s'\n", arguments->fself_authid);
+			return -1;
+		}
+	}
+
+	// A server takes its inputs from clients; any arguments are import databases to keep resident
+	if (arguments->server)
+	{
+		if (arguments->batch || arguments->exports || arguments->debug_file)
+		{
+			printf("--server cannot be combined with --batch, -e or --debug-file\n");
+			return -1;
+		}
+		arguments->extra_imports = &argv[optind];
+		arguments->extra_imports_count = argc - optind;
+		return 0;
+	}
+
+	// In batch mode the inputs and outputs come from the manifest; any arguments are extra imports
+	if (arguments->batch)
+	{
+		if (arguments->exports || arguments->debug_file)
+		{
+			printf("-e and --debug-file cannot be used with --batch; set \"exports\" and \"debug_file\" per manifest entry\n");
+			return -1;
+		}
+		arguments->extra_imports = &argv[optind];
+		arguments->extra_imports_count = argc - optind;
+		return 0;
+	}
+
 	if (argc - optind < 2)
 	{
 		printf("too few arguments\n");
@@ -49,3 +156,11 @@ int parse_arguments(int argc, char *argv[], elf_create_args *arguments)
 	
 	return 0;
 }
+
+uint64_t elf_create_fself_authid(const elf_create_args *arguments)
+{
+	if (arguments->fself_authid)
+		return strtoull(arguments->fself_authid, NULL, 0);
+
+	return arguments->fself_safe ? FSELF_AUTHID_SAFE : FSELF_AUTHID_DEFAULT;
+}
@@ -1,6 +1,11 @@
 #ifndef ELF_CREATE_ARGP_H
 #define ELF_CREATE_ARGP_H
 
+/* Environment variable naming the default --cache directory */
+#define ELF_CREATE_CACHE_ENV "VITA_ELF_CREATE_CACHE"
+
+#include <stdint.h>
+
 typedef struct elf_create_args
 {
 	int log_level;
@@ -10,9 +15,23 @@ typedef struct elf_create_args
 	int extra_imports_count;
 	char **extra_imports;
 	int check_stub_count;
+	const char *stats;
+	const char *batch;
+	int jobs;
+	const char *server;
+	int strip_debug;
+	const char *debug_file;
+	const char *cache;
+	int content_nid;
+	int fself;
+	int fself_safe;
+	const char *fself_authid;
 } elf_create_args;
 
 
 int parse_arguments(int argc, char *argv[], elf_create_args *arguments);
 
+/* The authid an fself output gets: --authid if given, else the --safe default */
+uint64_t elf_create_fself_authid(const elf_create_args *arguments);
+
 #endif // ELF_CREATE_ARGP_H
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <jansson.h>
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "elf-create-batch.h"
+
+typedef struct {
+	elf_create_job job;
+	int status;
+	elf_create_stats stats;
+} batch_item;
+
+typedef struct {
+	batch_item *items;
+	int num_items;
+	int next_item;
+	pthread_mutex_t lock;
+
+	vita_imports_t **imports;
+	int imports_count;
+	int collect_stats;
+} batch_queue;
+
+static int online_cpus(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+static const char *get_string(json_t *item, const char *key)
+{
+	json_t *value = json_object_get(item, key);
+	return json_is_string(value) ? json_string_value(value) : NULL;
+}
+
+static int load_manifest(json_t *root, batch_item **items, const elf_create_job *defaults)
+{
+	json_t *item;
+	batch_item *cur;
+	size_t i, count;
+
+	if (!json_is_array(root)) {
+		fprintf(stderr, "error: batch manifest must be an array of objects\n");
+		return -1;
+	}
+
+	count = json_array_size(root);
+	*items = calloc(count ? count : 1, sizeof(batch_item));
+	if (*items == NULL)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		item = json_array_get(root, i);
+		cur = *items + i;
+
+		cur->job = *defaults;
+		cur->job.input = get_string(item, "input");
+		cur->job.output = get_string(item, "output");
+		cur->job.exports = get_string(item, "exports");
+		cur->job.debug_file = get_string(item, "debug_file");
+
+		if (!json_is_object(item) || cur->job.input == NULL || cur->job.output == NULL) {
+			fprintf(stderr, "error: batch manifest entry %zu needs \"input\" and \"output\" strings\n", i);
+			free(*items);
+			return -1;
+		}
+	}
+
+	return count;
+}
+
+static void *batch_worker(void *arg)
+{
+	batch_queue *queue = arg;
+	batch_item *item;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next_item++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= queue->num_items)
+			break;
+
+		item = queue->items + i;
+		item->status = elf_create_convert(&item->job, queue->imports, queue->imports_count,
+				queue->collect_stats ? &item->stats : NULL);
+	}
+
+	return NULL;
+}
+
+static int write_report(const batch_queue *queue, const char *path)
+{
+	json_t *root, *items, *entry;
+	const batch_item *item;
+	int i, ret;
+
+	items = json_array();
+	for (i = 0, item = queue->items; i < queue->num_items; i++, item++) {
+		entry = json_pack("{ssss}",
+				"output", item->job.output,
+				"status", item->status == EXIT_SUCCESS ? "ok" : "failed");
+		json_object_set_new(entry, "stats", stats_to_json(&item->stats, item->job.input));
+		json_array_append_new(items, entry);
+	}
+
+	root = json_pack("{so}", "items", items);
+	ret = stats_dump_json(root, path);
+	json_decref(root);
+	return ret;
+}
+
+int elf_create_run_batch(const char *manifest, int num_threads, const elf_create_job *defaults,
+		vita_imports_t **imports, int imports_count, const char *stats_path)
+{
+	batch_queue queue = {0};
+	pthread_t *threads = NULL;
+	json_t *root;
+	json_error_t error;
+	int failed = 0;
+	int i, started;
+
+	if ((root = json_load_file(manifest, 0, &error)) == NULL) {
+		fprintf(stderr, "error: %s:%d: %s\n", manifest, error.line, error.text);
+		return -1;
+	}
+
+	if ((queue.num_items = load_manifest(root, &queue.items, defaults)) < 0) {
+		json_decref(root);
+		return -1;
+	}
+
+	queue.imports = imports;
+	queue.imports_count = imports_count;
+	queue.collect_stats = stats_path != NULL;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	if (num_threads <= 0)
+		num_threads = online_cpus();
+	if (num_threads > queue.num_items)
+		num_threads = queue.num_items;
+
+	/* The calling thread always works too, so a single job never spawns anything */
+	threads = calloc(num_threads ? num_threads : 1, sizeof(pthread_t));
+	for (started = 0; threads && started < num_threads - 1; started++) {
+		if (pthread_create(threads + started, NULL, batch_worker, &queue) != 0)
+			break;
+	}
+	batch_worker(&queue);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	/* With other jobs allocating at the same time the heap figures are noise */
+	if (started > 0) {
+		for (i = 0; i < queue.num_items; i++)
+			stats_clear_heap(&queue.items[i].stats);
+	}
+
+	for (i = 0; i < queue.num_items; i++) {
+		if (queue.items[i].status == EXIT_SUCCESS) {
+			printf("ok      %s -> %s\n", queue.items[i].job.input, queue.items[i].job.output);
+		} else {
+			printf("FAILED  %s\n", queue.items[i].job.input);
+			failed++;
+		}
+	}
+
+	if (stats_path && !write_report(&queue, stats_path))
+		failed++;
+
+	pthread_mutex_destroy(&queue.lock);
+	free(threads);
+	free(queue.items);
+	json_decref(root);
+
+	return failed;
+}
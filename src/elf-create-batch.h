@@ -0,0 +1,38 @@
+#ifndef ELF_CREATE_BATCH_H
+#define ELF_CREATE_BATCH_H
+
+#include <stdint.h>
+
+#include "vita-import.h"
+#include "elf-create-stats.h"
+
+/* One input ELF to convert */
+typedef struct {
+	const char *input;
+	const char *output;
+	const char *exports;		/* NULL to generate the default export list */
+	int check_stub_count;
+	int strip_debug;		/* Leave non-loadable sections out of the output */
+	const char *debug_file;		/* If set, the non-loadable sections are written here */
+	const char *cache_dir;		/* If set, module info is looked up in and stored to this cache */
+	const uint8_t *imports_digest;	/* elf_create_cache_digest_imports of the imports, for cache_dir */
+	int content_nid;		/* Derive the default module NID with sce_elf_content_nid */
+	int fself;			/* Write an fself (eboot.bin) rather than a velf */
+	uint64_t fself_authid;		/* appinfo authid for fself */
+} elf_create_job;
+
+/* Runs the whole vita-elf-create pipeline for one job against already loaded
+ * import databases.  Defined in vita-elf-create.c.  stats may be NULL. */
+int elf_create_convert(const elf_create_job *job, vita_imports_t **imports, int imports_count, elf_create_stats *stats);
+
+/* Converts every entry of a JSON manifest of the form
+ *   [ { "input": "a.elf", "output": "a.velf", "exports": "a.yml", "debug_file": "a.debug" }, ... ]
+ * on num_threads workers (0 = one per online CPU), then prints one status line
+ * per entry in manifest order.  If stats_path is set, a JSON report with the
+ * status and stats of every entry is written there.
+ * Settings not given per entry are taken from defaults.
+ * Returns the number of failed entries, or -1 if the manifest is unusable. */
+int elf_create_run_batch(const char *manifest, int num_threads, const elf_create_job *defaults,
+		vita_imports_t **imports, int imports_count, const char *stats_path);
+
+#endif // ELF_CREATE_BATCH_H
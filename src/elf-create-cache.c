@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "elf-create-cache.h"
+#include "sha256.h"
+
+#define CACHE_MAGIC "VECACHE1"
+#define NUM_SECTIONS (sizeof(sce_section_sizes_t) / sizeof(Elf32_Word))
+
+typedef struct {
+	char magic[8];
+	uint32_t sizes[NUM_SECTIONS];
+	uint32_t num_relas;
+} cache_header;
+
+typedef struct {
+	uint32_t type;
+	uint32_t offset;
+	int32_t addend;
+} cache_rela;
+
+static void hash_u32(SHA256_CTX *ctx, uint32_t value)
+{
+	uint8_t buf[4] = { value, value >> 8, value >> 16, value >> 24 };
+	sha256_update(ctx, buf, sizeof(buf));
+}
+
+/* Length-prefixed so that adjacent strings cannot run into each other */
+static void hash_str(SHA256_CTX *ctx, const char *s)
+{
+	if (s == NULL) {
+		hash_u32(ctx, 0xFFFFFFFF);
+		return;
+	}
+	hash_u32(ctx, strlen(s));
+	sha256_update(ctx, (uint8_t *)s, strlen(s));
+}
+
+void elf_create_cache_digest_db(const vita_imports_t *imp, uint8_t digest[ELF_CREATE_CACHE_DIGEST_LEN])
+{
+	SHA256_CTX ctx;
+	vita_imports_lib_t *lib;
+	vita_imports_module_t *mod;
+	int j, k, l;
+
+	sha256_init(&ctx);
+	hash_u32(&ctx, imp->n_libs);
+	for (j = 0; j < imp->n_libs; j++) {
+		if ((lib = imp->libs[j]) == NULL)
+			continue;
+		hash_str(&ctx, lib->name);
+		hash_u32(&ctx, lib->NID);
+		hash_u32(&ctx, lib->n_modules);
+		for (k = 0; k < lib->n_modules; k++) {
+			if ((mod = lib->modules[k]) == NULL)
+				continue;
+			hash_str(&ctx, mod->name);
+			hash_u32(&ctx, mod->NID);
+			hash_u32(&ctx, mod->is_kernel);
+			hash_u32(&ctx, mod->n_functions);
+			for (l = 0; l < mod->n_functions; l++) {
+				if (mod->functions[l] == NULL)
+					continue;
+				hash_str(&ctx, mod->functions[l]->name);
+				hash_u32(&ctx, mod->functions[l]->NID);
+			}
+			hash_u32(&ctx, mod->n_variables);
+			for (l = 0; l < mod->n_variables; l++) {
+				if (mod->variables[l] == NULL)
+					continue;
+				hash_str(&ctx, mod->variables[l]->name);
+				hash_u32(&ctx, mod->variables[l]->NID);
+			}
+		}
+	}
+	sha256_final(&ctx, digest);
+}
+
+void elf_create_cache_digest_dbs(const uint8_t *db_digests, int count, uint8_t digest[ELF_CREATE_CACHE_DIGEST_LEN])
+{
+	SHA256_CTX ctx;
+
+	sha256_init(&ctx);
+	hash_u32(&ctx, count);
+	sha256_update(&ctx, (uint8_t *)db_digests, (size_t)count * ELF_CREATE_CACHE_DIGEST_LEN);
+	sha256_final(&ctx, digest);
+}
+
+void elf_create_cache_digest_imports(vita_imports_t **imports, int imports_count, uint8_t digest[ELF_CREATE_CACHE_DIGEST_LEN])
+{
+	SHA256_CTX ctx;
+	uint8_t db_digest[ELF_CREATE_CACHE_DIGEST_LEN];
+	int i;
+
+	/* Same bytes as elf_create_cache_digest_dbs over each database's digest */
+	sha256_init(&ctx);
+	hash_u32(&ctx, imports_count);
+	for (i = 0; i < imports_count; i++) {
+		elf_create_cache_digest_db(imports[i], db_digest);
+		sha256_update(&ctx, db_digest, sizeof(db_digest));
+	}
+	sha256_final(&ctx, digest);
+}
+
+/* Hashes the value the module info will use for a symbol named in the
+ * export spec, found the same way sce-elf.c looks it up. */
+static void hash_symbol(SHA256_CTX *ctx, const vita_elf_t *ve, const char *name, int type)
+{
+	int i;
+
+	hash_str(ctx, name);
+	if (name == NULL)
+		return;
+
+	for (i = 0; i < ve->num_symbols; i++) {
+		if (ve->symtab[i].type == type && strcmp(ve->symtab[i].name, name) == 0) {
+			hash_u32(ctx, ve->symtab[i].value);
+			return;
+		}
+	}
+	hash_u32(ctx, 0xFFFFFFFF);
+}
+
+static void hash_stubs(SHA256_CTX *ctx, const vita_elf_stub_t *stubs, int num_stubs)
+{
+	int i;
+
+	hash_u32(ctx, num_stubs);
+	for (i = 0; i < num_stubs; i++) {
+		hash_u32(ctx, stubs[i].addr);
+		hash_u32(ctx, stubs[i].library_nid);
+		hash_u32(ctx, stubs[i].module_nid);
+		hash_u32(ctx, stubs[i].target_nid);
+	}
+}
+
+void elf_create_cache_make_key(const vita_elf_t *ve, const vita_export_t *exports,
+		const uint8_t imports_digest[ELF_CREATE_CACHE_DIGEST_LEN], elf_create_cache_key *key)
+{
+	SHA256_CTX ctx;
+	vita_library_export *lib;
+	size_t i, j;
+
+	sha256_init(&ctx);
+	hash_str(&ctx, CACHE_MAGIC);
+
+	hash_u32(&ctx, elf32_getehdr(ve->elf)->e_entry);
+	hash_u32(&ctx, ve->num_segments);
+	for (i = 0; i < ve->num_segments; i++) {
+		hash_u32(&ctx, ve->segments[i].type);
+		hash_u32(&ctx, ve->segments[i].vaddr);
+		hash_u32(&ctx, ve->segments[i].memsz);
+	}
+
+	hash_stubs(&ctx, ve->fstubs, ve->num_fstubs);
+	hash_stubs(&ctx, ve->vstubs, ve->num_vstubs);
+
+	sha256_update(&ctx, (uint8_t *)exports->name, sizeof(exports->name));
+	hash_u32(&ctx, exports->ver_major);
+	hash_u32(&ctx, exports->ver_minor);
+	hash_u32(&ctx, exports->attributes);
+	hash_u32(&ctx, exports->nid);
+	hash_symbol(&ctx, ve, exports->start, STT_FUNC);
+	hash_symbol(&ctx, ve, exports->stop, STT_FUNC);
+	hash_symbol(&ctx, ve, exports->exit, STT_FUNC);
+	hash_u32(&ctx, exports->module_n);
+	for (i = 0; i < exports->module_n; i++) {
+		lib = exports->modules[i];
+		hash_str(&ctx, lib->name);
+		hash_u32(&ctx, lib->syscall);
+		hash_u32(&ctx, lib->nid);
+		hash_u32(&ctx, lib->function_n);
+		for (j = 0; j < lib->function_n; j++) {
+			hash_u32(&ctx, lib->functions[j]->nid);
+			hash_symbol(&ctx, ve, lib->functions[j]->name, STT_FUNC);
+		}
+		hash_u32(&ctx, lib->variable_n);
+		for (j = 0; j < lib->variable_n; j++) {
+			hash_u32(&ctx, lib->variables[j]->nid);
+			hash_symbol(&ctx, ve, lib->variables[j]->name, STT_OBJECT);
+		}
+	}
+
+	sha256_update(&ctx, (uint8_t *)imports_digest, ELF_CREATE_CACHE_DIGEST_LEN);
+	sha256_final(&ctx, key->bytes);
+}
+
+static char *cache_path(const char *dir, const elf_create_cache_key *key)
+{
+	size_t len = strlen(dir);
+	char *path;
+	int i;
+
+	if ((path = malloc(len + 1 + 2 * sizeof(key->bytes) + sizeof(".modinfo"))) == NULL)
+		return NULL;
+
+	memcpy(path, dir, len);
+	path[len++] = '/';
+	for (i = 0; i < sizeof(key->bytes); i++, len += 2)
+		sprintf(path + len, "%02x", key->bytes[i]);
+	strcpy(path + len, ".modinfo");
+
+	return path;
+}
+
+int elf_create_cache_load(const char *dir, const elf_create_cache_key *key,
+		sce_section_sizes_t *sizes, void **encoded_modinfo, vita_elf_rela_table_t *rtable)
+{
+	cache_header header;
+	cache_rela raw;
+	vita_elf_rela_t *relas = NULL;
+	void *data = NULL;
+	size_t total_size = 0;
+	char *path;
+	FILE *fp = NULL;
+	int i;
+
+	if ((path = cache_path(dir, key)) == NULL)
+		return 0;
+	if ((fp = fopen(path, "rb")) == NULL)
+		goto miss;
+
+	if (fread(&header, sizeof(header), 1, fp) != 1
+			|| memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0)
+		goto miss;
+
+	for (i = 0; i < NUM_SECTIONS; i++) {
+		((Elf32_Word *)sizes)[i] = header.sizes[i];
+		total_size += header.sizes[i];
+	}
+
+	if ((data = malloc(total_size)) == NULL || fread(data, 1, total_size, fp) != total_size)
+		goto miss;
+
+	if ((relas = calloc(header.num_relas ? header.num_relas : 1, sizeof(*relas))) == NULL)
+		goto miss;
+	for (i = 0; i < header.num_relas; i++) {
+		if (fread(&raw, sizeof(raw), 1, fp) != 1)
+			goto miss;
+		relas[i].type = raw.type;
+		relas[i].offset = raw.offset;
+		relas[i].addend = raw.addend;
+	}
+
+	fclose(fp);
+	free(path);
+	*encoded_modinfo = data;
+	rtable->relas = relas;
+	rtable->num_relas = header.num_relas;
+	return 1;
+miss:
+	if (fp)
+		fclose(fp);
+	free(path);
+	free(data);
+	free(relas);
+	return 0;
+}
+
+int elf_create_cache_store(const char *dir, const elf_create_cache_key *key,
+		const sce_section_sizes_t *sizes, const void *encoded_modinfo, const vita_elf_rela_table_t *rtable)
+{
+	static volatile int tmp_counter;
+	cache_header header;
+	cache_rela raw;
+	size_t total_size = 0;
+	char *path, *tmp_path = NULL;
+	FILE *fp = NULL;
+	int i;
+
+	if ((path = cache_path(dir, key)) == NULL)
+		return 0;
+
+	/* Written under a unique name and renamed, so that concurrent builds
+	 * sharing the cache never see a partial entry */
+	if ((tmp_path = malloc(strlen(path) + 32)) == NULL)
+		goto failure;
+	sprintf(tmp_path, "%s.%ld.%d", path, (long)getpid(), __sync_fetch_and_add(&tmp_counter, 1));
+
+	if ((fp = fopen(tmp_path, "wb")) == NULL)
+		goto failure;
+
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	for (i = 0; i < NUM_SECTIONS; i++) {
+		header.sizes[i] = ((const Elf32_Word *)sizes)[i];
+		total_size += header.sizes[i];
+	}
+	header.num_relas = rtable->num_relas;
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1
+			|| fwrite(encoded_modinfo, 1, total_size, fp) != total_size)
+		goto failure;
+
+	for (i = 0; i < rtable->num_relas; i++) {
+		raw.type = rtable->relas[i].type;
+		raw.offset = rtable->relas[i].offset;
+		raw.addend = rtable->relas[i].addend;
+		if (fwrite(&raw, sizeof(raw), 1, fp) != 1)
+			goto failure;
+	}
+
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto failure;
+	}
+	fp = NULL;
+
+	if (rename(tmp_path, path) != 0)
+		goto failure;
+
+	free(tmp_path);
+	free(path);
+	return 1;
+failure:
+	fprintf(stderr, "warning: could not write cache entry %s: %s\n", path, strerror(errno));
+	if (fp)
+		fclose(fp);
+	if (tmp_path)
+		remove(tmp_path);
+	free(tmp_path);
+	free(path);
+	return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef ELF_CREATE_CACHE_H
+#define ELF_CREATE_CACHE_H
+
+#include <stdint.h>
+
+#include "vita-elf.h"
+#include "vita-export.h"
+#include "vita-import.h"
+#include "sce-elf.h"
+
+/* Content-addressed cache of the module info stage of vita-elf-create.
+ *
+ * The encoded module info (and the relocations it needs) only depends on the
+ * stubs, the export spec and the symbols it names, the segment layout and the
+ * import databases.  The key covers exactly those, so a rebuild that leaves
+ * them alone skips stub resolution and module info creation and encoding;
+ * relocation encoding and layout are always redone. */
+
+#define ELF_CREATE_CACHE_DIGEST_LEN 32	/* SHA-256 */
+
+typedef struct {
+	uint8_t bytes[ELF_CREATE_CACHE_DIGEST_LEN];
+} elf_create_cache_key;
+
+/* Digest of one import database in declaration order.  vita_imports_build_index
+ * reorders the tables, so take it before building the index. */
+void elf_create_cache_digest_db(const vita_imports_t *imp, uint8_t digest[ELF_CREATE_CACHE_DIGEST_LEN]);
+
+/* Digest of count databases from their elf_create_cache_digest_db digests,
+ * stored one after the other in db_digests */
+void elf_create_cache_digest_dbs(const uint8_t *db_digests, int count, uint8_t digest[ELF_CREATE_CACHE_DIGEST_LEN]);
+
+/* The same digest as elf_create_cache_digest_dbs, for databases without an index */
+void elf_create_cache_digest_imports(vita_imports_t **imports, int imports_count, uint8_t digest[ELF_CREATE_CACHE_DIGEST_LEN]);
+
+void elf_create_cache_make_key(const vita_elf_t *ve, const vita_export_t *exports,
+		const uint8_t imports_digest[ELF_CREATE_CACHE_DIGEST_LEN], elf_create_cache_key *key);
+
+/* Returns 1 and fills in sizes, *encoded_modinfo and rtable on a hit, 0 on a miss */
+int elf_create_cache_load(const char *dir, const elf_create_cache_key *key,
+		sce_section_sizes_t *sizes, void **encoded_modinfo, vita_elf_rela_table_t *rtable);
+
+/* Failing to store is not an error for the conversion; returns 0 and warns */
+int elf_create_cache_store(const char *dir, const elf_create_cache_key *key,
+		const sce_section_sizes_t *sizes, const void *encoded_modinfo, const vita_elf_rela_table_t *rtable);
+
+#endif // ELF_CREATE_CACHE_H
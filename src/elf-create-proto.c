@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "elf-create-proto.h"
+
+/* Fixed strings sent after the working directory; empty strings stand for NULL */
+enum {
+	PROTO_CWD,
+	PROTO_INPUT,
+	PROTO_OUTPUT,
+	PROTO_EXPORTS,
+	PROTO_STATS,
+	PROTO_LOG_LEVEL,
+	PROTO_CHECK_STUB_COUNT,
+	PROTO_STRIP_DEBUG,
+	PROTO_DEBUG_FILE,
+	PROTO_CACHE,
+	PROTO_CONTENT_NID,
+	PROTO_FSELF,
+	PROTO_FSELF_SAFE,
+	PROTO_FSELF_AUTHID,
+	PROTO_NUM_FIXED
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 0;
+		p += ret;
+		len -= ret;
+	}
+
+	return 1;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 0;
+		p += ret;
+		len -= ret;
+	}
+
+	return 1;
+}
+
+static int write_string(int sock, const char *s)
+{
+	size_t size = s ? strlen(s) : 0;
+	uint32_t len = size;
+
+	if (size > ELF_CREATE_PROTO_MAX_STRING_LEN) {
+		fprintf(stderr, "error: argument too long for the server: %.64s...\n", s);
+		return 0;
+	}
+
+	return write_all(sock, &len, sizeof(len)) && write_all(sock, s, len);
+}
+
+int elf_create_send_request(int sock, const char *cwd, const elf_create_args *args)
+{
+	elf_create_proto_header header;
+	struct msghdr msg = {0};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	char number[16];
+	int i;
+
+	if (args->extra_imports_count > ELF_CREATE_PROTO_MAX_EXTRA_IMPORTS) {
+		fprintf(stderr, "error: at most %d extra import databases can be sent to the server\n",
+				ELF_CREATE_PROTO_MAX_EXTRA_IMPORTS);
+		return 0;
+	}
+
+	header.magic = ELF_CREATE_PROTO_MAGIC;
+	header.num_strings = PROTO_NUM_FIXED + args->extra_imports_count;
+
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	memset(&control, 0, sizeof(control));
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sock, &msg, 0) != sizeof(header))
+		return 0;
+
+	if (!write_string(sock, cwd)
+			|| !write_string(sock, args->input)
+			|| !write_string(sock, args->output)
+			|| !write_string(sock, args->exports)
+			|| !write_string(sock, args->stats))
+		return 0;
+
+	snprintf(number, sizeof(number), "%d", args->log_level);
+	if (!write_string(sock, number))
+		return 0;
+	snprintf(number, sizeof(number), "%d", args->check_stub_count);
+	if (!write_string(sock, number))
+		return 0;
+	snprintf(number, sizeof(number), "%d", args->strip_debug);
+	if (!write_string(sock, number) || !write_string(sock, args->debug_file)
+			|| !write_string(sock, args->cache))
+		return 0;
+	snprintf(number, sizeof(number), "%d", args->content_nid);
+	if (!write_string(sock, number))
+		return 0;
+	snprintf(number, sizeof(number), "%d", args->fself);
+	if (!write_string(sock, number))
+		return 0;
+	snprintf(number, sizeof(number), "%d", args->fself_safe);
+	if (!write_string(sock, number) || !write_string(sock, args->fself_authid))
+		return 0;
+
+	for (i = 0; i < args->extra_imports_count; i++) {
+		if (!write_string(sock, args->extra_imports[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+static const char *nonempty(const char *s)
+{
+	return *s ? s : NULL;
+}
+
+int elf_create_recv_request(int sock, elf_create_request *req)
+{
+	elf_create_proto_header header;
+	struct msghdr msg = {0};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	uint32_t len;
+	int fds[2];
+	int i;
+
+	memset(req, 0, sizeof(*req));
+	req->out_fd = -1;
+	req->err_fd = -1;
+
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if (recvmsg(sock, &msg, 0) != sizeof(header))
+		return 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+				&& cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+			req->out_fd = fds[0];
+			req->err_fd = fds[1];
+		}
+	}
+
+	if (header.magic != ELF_CREATE_PROTO_MAGIC || header.num_strings < PROTO_NUM_FIXED
+			|| header.num_strings > PROTO_NUM_FIXED + ELF_CREATE_PROTO_MAX_EXTRA_IMPORTS
+			|| req->out_fd < 0)
+		goto failure;
+
+	req->strings = calloc(header.num_strings, sizeof(char *));
+	if (req->strings == NULL)
+		goto failure;
+	req->num_strings = header.num_strings;
+
+	for (i = 0; i < req->num_strings; i++) {
+		if (!read_all(sock, &len, sizeof(len)))
+			goto failure;
+		if (len > ELF_CREATE_PROTO_MAX_STRING_LEN)
+			goto failure;
+		if ((req->strings[i] = malloc((size_t)len + 1)) == NULL)
+			goto failure;
+		if (!read_all(sock, req->strings[i], len))
+			goto failure;
+		req->strings[i][len] = '\0';
+	}
+
+	req->cwd = req->strings[PROTO_CWD];
+	req->args.input = nonempty(req->strings[PROTO_INPUT]);
+	req->args.output = nonempty(req->strings[PROTO_OUTPUT]);
+	req->args.exports = nonempty(req->strings[PROTO_EXPORTS]);
+	req->args.stats = nonempty(req->strings[PROTO_STATS]);
+	req->args.log_level = atoi(req->strings[PROTO_LOG_LEVEL]);
+	req->args.check_stub_count = atoi(req->strings[PROTO_CHECK_STUB_COUNT]);
+	req->args.strip_debug = atoi(req->strings[PROTO_STRIP_DEBUG]);
+	req->args.debug_file = nonempty(req->strings[PROTO_DEBUG_FILE]);
+	req->args.cache = nonempty(req->strings[PROTO_CACHE]);
+	req->args.content_nid = atoi(req->strings[PROTO_CONTENT_NID]);
+	req->args.fself = atoi(req->strings[PROTO_FSELF]);
+	req->args.fself_safe = atoi(req->strings[PROTO_FSELF_SAFE]);
+	req->args.fself_authid = nonempty(req->strings[PROTO_FSELF_AUTHID]);
+	req->args.extra_imports = req->strings + PROTO_NUM_FIXED;
+	req->args.extra_imports_count = req->num_strings - PROTO_NUM_FIXED;
+
+	return 1;
+failure:
+	elf_create_request_free(req);
+	return 0;
+}
+
+void elf_create_request_free(elf_create_request *req)
+{
+	int i;
+
+	for (i = 0; i < req->num_strings; i++)
+		free(req->strings[i]);
+	free(req->strings);
+	if (req->out_fd >= 0)
+		close(req->out_fd);
+	if (req->err_fd >= 0)
+		close(req->err_fd);
+	memset(req, 0, sizeof(*req));
+	req->out_fd = -1;
+	req->err_fd = -1;
+}
+
+int elf_create_send_status(int sock, int status)
+{
+	int32_t value = status;
+
+	return write_all(sock, &value, sizeof(value));
+}
+
+int elf_create_recv_status(int sock, int *status)
+{
+	int32_t value;
+
+	if (!read_all(sock, &value, sizeof(value)))
+		return 0;
+
+	*status = value;
+	return 1;
+}
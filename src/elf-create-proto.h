@@ -0,0 +1,48 @@
+#ifndef ELF_CREATE_PROTO_H
+#define ELF_CREATE_PROTO_H
+
+#include <stdint.h>
+
+#include "elf-create-argp.h"
+
+/* Wire format between vita-elf-create-client and vita-elf-create --server.
+ *
+ * The client sends an elf_create_proto_header carrying its stdout and stderr
+ * as SCM_RIGHTS, followed by num_strings length-prefixed strings: the client
+ * working directory, then the parsed arguments (in the PROTO_* order of
+ * elf-create-proto.c), then any extra import databases.  The server replies
+ * with a single int32_t exit status once the output is written. */
+
+#define ELF_CREATE_PROTO_MAGIC 0x56454335 /* "VEC5" */
+
+/* Environment variable naming the server socket, used by the client */
+#define ELF_CREATE_SOCKET_ENV "VITA_ELF_CREATE_SOCKET"
+
+/* Limits the server holds clients to; anything beyond them is refused
+ * before it is allocated */
+#define ELF_CREATE_PROTO_MAX_STRING_LEN		(1024 * 1024)
+#define ELF_CREATE_PROTO_MAX_EXTRA_IMPORTS	64
+
+typedef struct {
+	uint32_t magic;
+	uint32_t num_strings;
+} elf_create_proto_header;
+
+typedef struct {
+	char *cwd;
+	elf_create_args args;
+	int out_fd;
+	int err_fd;
+
+	char **strings;		/* Storage backing cwd and args */
+	int num_strings;
+} elf_create_request;
+
+int elf_create_send_request(int sock, const char *cwd, const elf_create_args *args);
+int elf_create_recv_request(int sock, elf_create_request *req);
+void elf_create_request_free(elf_create_request *req);
+
+int elf_create_send_status(int sock, int status);
+int elf_create_recv_status(int sock, int *status);
+
+#endif // ELF_CREATE_PROTO_H
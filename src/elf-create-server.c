@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "elf-create-server.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "elf-create-batch.h"
+#include "elf-create-cache.h"
+#include "elf-create-proto.h"
+#include "elf-create-stats.h"
+#include "vita-import.h"
+
+extern int g_log;
+
+#define VERBOSE 1
+
+#define TRACEF(lvl, ...) \
+	do { if (g_log >= lvl) printf(__VA_ARGS__); } while (0)
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+char **get_default_import_paths(int *default_count);
+
+/* One import database kept in memory between requests */
+typedef struct {
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	vita_imports_t *imports;
+	uint8_t digest[ELF_CREATE_CACHE_DIGEST_LEN];	/* Taken before the index reorders it */
+} resident_db;
+
+typedef struct {
+	resident_db *dbs;
+	int num_dbs;
+	int max_dbs;
+} resident_cache;
+
+/* Returns the database at path, (re)loading it if it is new or has changed
+ * on disk since it was last loaded, and copies its digest to digest unless
+ * that is NULL.  path must be absolute. */
+static vita_imports_t *cache_get(resident_cache *cache, const char *path, uint8_t *digest)
+{
+	resident_db *db = NULL;
+	vita_imports_t *imports;
+	uint8_t loaded_digest[ELF_CREATE_CACHE_DIGEST_LEN];
+	struct stat st;
+	int i;
+
+	for (i = 0; i < cache->num_dbs; i++) {
+		if (strcmp(cache->dbs[i].path, path) == 0) {
+			db = &cache->dbs[i];
+			break;
+		}
+	}
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	/* st_mtime alone would miss a rewrite within the same second */
+	if (db && db->mtime.tv_sec == st.st_mtim.tv_sec && db->mtime.tv_nsec == st.st_mtim.tv_nsec
+			&& db->size == st.st_size) {
+		if (digest)
+			memcpy(digest, db->digest, ELF_CREATE_CACHE_DIGEST_LEN);
+		return db->imports;
+	}
+
+	if ((imports = vita_imports_load(path, g_log >= 2)) == NULL)
+		return NULL;
+	elf_create_cache_digest_db(imports, loaded_digest);
+	vita_imports_build_index(imports);
+
+	if (db) {
+		TRACEF(VERBOSE, "reloaded %s\n", path);
+		vita_imports_free(db->imports);
+	} else {
+		if (cache->num_dbs == cache->max_dbs) {
+			int max_dbs = cache->max_dbs ? cache->max_dbs * 2 : 8;
+			resident_db *dbs = realloc(cache->dbs, max_dbs * sizeof(*dbs));
+			if (dbs == NULL) {
+				vita_imports_free(imports);
+				return NULL;
+			}
+			cache->dbs = dbs;
+			cache->max_dbs = max_dbs;
+		}
+		db = &cache->dbs[cache->num_dbs++];
+		db->path = strdup(path);
+	}
+
+	db->mtime = st.st_mtim;
+	db->size = st.st_size;
+	db->imports = imports;
+	memcpy(db->digest, loaded_digest, ELF_CREATE_CACHE_DIGEST_LEN);
+	if (digest)
+		memcpy(digest, loaded_digest, ELF_CREATE_CACHE_DIGEST_LEN);
+	return imports;
+}
+
+/* Collects the databases for one request: the defaults followed by extra,
+ * resolved against the current directory.  Unless imports_digest is NULL,
+ * also sets it to what elf_create_cache_digest_imports would give for them
+ * before their index was built, as the command line computes it. */
+static vita_imports_t **gather_imports(resident_cache *cache, char **defaults, int num_defaults,
+		char **extra, int num_extra, int *imports_count, uint8_t *imports_digest)
+{
+	vita_imports_t **imports;
+	uint8_t *digests = NULL;
+	char path[PATH_MAX];
+	int i;
+
+	imports = calloc(num_defaults + num_extra + 1, sizeof(*imports));
+	if (imports == NULL)
+		return NULL;
+
+	if (imports_digest && (digests = malloc((num_defaults + num_extra + 1) * ELF_CREATE_CACHE_DIGEST_LEN)) == NULL)
+		goto failure;
+
+	for (i = 0; i < num_defaults; i++) {
+		if ((imports[i] = cache_get(cache, defaults[i],
+				digests ? digests + i * ELF_CREATE_CACHE_DIGEST_LEN : NULL)) == NULL)
+			goto failure;
+	}
+
+	for (i = 0; i < num_extra; i++) {
+		if (realpath(extra[i], path) == NULL) {
+			fprintf(stderr, "%s: %s\n", extra[i], strerror(errno));
+			goto failure;
+		}
+		if ((imports[num_defaults + i] = cache_get(cache, path,
+				digests ? digests + (num_defaults + i) * ELF_CREATE_CACHE_DIGEST_LEN : NULL)) == NULL)
+			goto failure;
+	}
+
+	*imports_count = num_defaults + num_extra;
+	if (digests) {
+		elf_create_cache_digest_dbs(digests, *imports_count, imports_digest);
+		free(digests);
+	}
+	return imports;
+failure:
+	free(digests);
+	free(imports);
+	return NULL;
+}
+
+/* Runs one request with stdout/stderr pointing at the client's and the
+ * working directory set to the client's.  Returns the exit status. */
+static int handle_request(resident_cache *cache, char **defaults, int num_defaults,
+		elf_create_request *req, int server_cwd)
+{
+	vita_imports_t **imports = NULL;
+	int imports_count;
+	elf_create_stats stats = {};
+	elf_create_job job = {};
+	uint8_t imports_digest[ELF_CREATE_CACHE_DIGEST_LEN];
+	int saved_out = -1, saved_err = -1;
+	int status = EXIT_FAILURE;
+
+	fflush(stdout);
+	fflush(stderr);
+	if ((saved_out = dup(STDOUT_FILENO)) < 0 || (saved_err = dup(STDERR_FILENO)) < 0)
+		goto done;
+	if (dup2(req->out_fd, STDOUT_FILENO) < 0 || dup2(req->err_fd, STDERR_FILENO) < 0)
+		goto restore;
+
+	if (chdir(req->cwd) < 0) {
+		fprintf(stderr, "%s: %s\n", req->cwd, strerror(errno));
+		goto restore;
+	}
+
+	g_log = req->args.log_level;
+
+	if (req->args.input == NULL || req->args.output == NULL) {
+		fprintf(stderr, "too few arguments\n");
+		goto restore;
+	}
+
+	stats_phase_begin(&stats);
+	imports = gather_imports(cache, defaults, num_defaults,
+			req->args.extra_imports, req->args.extra_imports_count, &imports_count,
+			req->args.cache ? imports_digest : NULL);
+	stats_phase_end(&stats, STATS_LOAD);
+	if (imports == NULL)
+		goto restore;
+
+	job.input = req->args.input;
+	job.output = req->args.output;
+	job.exports = req->args.exports;
+	job.check_stub_count = req->args.check_stub_count;
+	job.strip_debug = req->args.strip_debug;
+	job.debug_file = req->args.debug_file;
+	job.cache_dir = req->args.cache;
+	job.content_nid = req->args.content_nid;
+	job.fself = req->args.fself;
+	job.fself_authid = elf_create_fself_authid(&req->args);
+	if (job.cache_dir)
+		job.imports_digest = imports_digest;
+
+	status = elf_create_convert(&job, imports, imports_count, req->args.stats ? &stats : NULL);
+
+	if (req->args.stats && !stats_write_json(&stats, req->args.input, req->args.stats))
+		status = EXIT_FAILURE;
+
+restore:
+	fflush(stdout);
+	fflush(stderr);
+	if (fchdir(server_cwd) < 0)
+		perror("fchdir");
+	dup2(saved_out, STDOUT_FILENO);
+	dup2(saved_err, STDERR_FILENO);
+done:
+	if (saved_out >= 0)
+		close(saved_out);
+	if (saved_err >= 0)
+		close(saved_err);
+	free(imports);
+	return status;
+}
+
+/* Removes a socket left behind by a server that is gone.  Anything else at
+ * path, including the socket of a server still listening, is left alone
+ * and bind will fail on it. */
+static void remove_stale_socket(const struct sockaddr_un *addr)
+{
+	struct stat st;
+	int sock;
+
+	if (lstat(addr->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+		return;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return;
+	if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == 0)
+		fprintf(stderr, "%s: a server is already running\n", addr->sun_path);
+	else if (errno == ECONNREFUSED)
+		unlink(addr->sun_path);
+	close(sock);
+}
+
+int elf_create_serve(const char *socket_path, const elf_create_args *args)
+{
+	resident_cache cache = {};
+	struct sockaddr_un addr = {};
+	elf_create_request req;
+	vita_imports_t **imports = NULL;
+	char **defaults = NULL;
+	int num_defaults = 0;
+	int imports_count;
+	int server_cwd = -1;
+	int sock = -1;
+	int bound = 0;
+	int client;
+	int status;
+	int i;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", socket_path);
+		return EXIT_FAILURE;
+	}
+
+	if ((server_cwd = open(".", O_RDONLY)) < 0) {
+		perror("open");
+		goto failure;
+	}
+
+	if (!(defaults = get_default_import_paths(&num_defaults)))
+		goto failure;
+
+	// Requests run in the client's directory, so pin the defaults down now
+	for (i = 0; i < num_defaults; i++) {
+		char path[PATH_MAX];
+		if (realpath(defaults[i], path) == NULL) {
+			perror(defaults[i]);
+			goto failure;
+		}
+		free(defaults[i]);
+		defaults[i] = strdup(path);
+	}
+
+	// Preload everything this server was started with so the first request is fast too
+	if (!(imports = gather_imports(&cache, defaults, num_defaults,
+			args->extra_imports, args->extra_imports_count, &imports_count, NULL)))
+		goto failure;
+	free(imports);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		goto failure;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	remove_stale_socket(&addr);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(socket_path);
+		goto failure;
+	}
+	bound = 1;
+
+	if (listen(sock, 16) < 0) {
+		perror(socket_path);
+		goto failure;
+	}
+
+	// A client going away mid-request must not take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("serving on %s with %d import database(s)\n", socket_path, cache.num_dbs);
+	fflush(stdout);
+
+	for (;;) {
+		if ((client = accept(sock, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			goto failure;
+		}
+
+		if (elf_create_recv_request(client, &req)) {
+			status = handle_request(&cache, defaults, num_defaults, &req, server_cwd);
+			elf_create_send_status(client, status);
+			elf_create_request_free(&req);
+		}
+
+		close(client);
+	}
+
+failure:
+	if (sock >= 0)
+		close(sock);
+	if (bound)
+		unlink(socket_path);
+	if (server_cwd >= 0)
+		close(server_cwd);
+	for (i = 0; i < num_defaults; i++)
+		free(defaults[i]);
+	free(defaults);
+	for (i = 0; i < cache.num_dbs; i++) {
+		free(cache.dbs[i].path);
+		vita_imports_free(cache.dbs[i].imports);
+	}
+	free(cache.dbs);
+	return EXIT_FAILURE;
+}
+
+#else
+
+int elf_create_serve(const char *socket_path, const elf_create_args *args)
+{
+	fprintf(stderr, "--server is not supported on this platform\n");
+	return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef ELF_CREATE_SERVER_H
+#define ELF_CREATE_SERVER_H
+
+#include "elf-create-argp.h"
+
+/* Serves conversion requests from vita-elf-create-client on a local socket
+ * until killed.  The default import databases and args->extra_imports are
+ * loaded up front and kept resident; every database is reloaded when its
+ * file changes on disk.  Returns only on setup failure. */
+int elf_create_serve(const char *socket_path, const elf_create_args *args);
+
+#endif // ELF_CREATE_SERVER_H
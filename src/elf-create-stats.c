@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
+
+#include "elf-defs.h"
+#include "elf-create-stats.h"
+
+static const char *phase_names[STATS_NUM_PHASES] = {
+	"load",
+	"import_lookup",
+	"modinfo_create",
+	"modinfo_encode",
+	"reloc_discard",
+	"shift_copy",
+	"reloc_encode",
+	"elf_update",
+};
+
+static double now_ms(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart * 1000.0 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static long long heap_in_use(void)
+{
+#ifdef HAVE_MALLINFO2
+	struct mallinfo2 mi = mallinfo2();
+	return (long long)(mi.uordblks + mi.hblkhd);
+#else
+	return -1;
+#endif
+}
+
+void stats_phase_begin(elf_create_stats *stats)
+{
+	if (stats == NULL)
+		return;
+
+	stats->heap_start = heap_in_use();
+	stats->phase_start = now_ms();
+}
+
+void stats_phase_end(elf_create_stats *stats, elf_create_phase phase)
+{
+	long long heap;
+
+	if (stats == NULL)
+		return;
+
+	stats->wall_ms[phase] += now_ms() - stats->phase_start;
+	heap = heap_in_use();
+	if (heap < 0 || stats->heap_start < 0)
+		stats->heap_bytes[phase] = -1;
+	else
+		stats->heap_bytes[phase] += heap - stats->heap_start;
+}
+
+void stats_clear_heap(elf_create_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < STATS_NUM_PHASES; i++)
+		stats->heap_bytes[i] = -1;
+}
+
+json_t *stats_to_json(const elf_create_stats *stats, const char *input)
+{
+	json_t *root, *phases, *phase, *by_type;
+	double total_ms = 0;
+	int total_relas = 0;
+	int i;
+
+	phases = json_object();
+	for (i = 0; i < STATS_NUM_PHASES; i++) {
+		phase = json_pack("{sf}", "wall_ms", stats->wall_ms[i]);
+		if (stats->heap_bytes[i] >= 0)
+			json_object_set_new(phase, "heap_bytes", json_integer(stats->heap_bytes[i]));
+		json_object_set_new(phases, phase_names[i], phase);
+		total_ms += stats->wall_ms[i];
+	}
+
+	by_type = json_object();
+	for (i = 0; i < sizeof(stats->relas.by_type) / sizeof(stats->relas.by_type[0]); i++) {
+		if (stats->relas.by_type[i] == 0)
+			continue;
+		json_object_set_new(by_type, elf_decode_r_type(i), json_integer(stats->relas.by_type[i]));
+		total_relas += stats->relas.by_type[i];
+	}
+
+	root = json_pack("{sssfsbsos{sisi}s{sisisisisiso}}",
+			"input", input,
+			"total_ms", total_ms,
+			"cache_hit", stats->cache_hit,
+			"phases", phases,
+			"stubs",
+				"functions", stats->num_fstubs,
+				"variables", stats->num_vstubs,
+			"relocations",
+				"total", total_relas,
+				"short", stats->relas.num_short,
+				"long", stats->relas.num_long,
+				"discarded", stats->num_discarded_relas,
+				"abs_fixups", stats->num_abs_fixups,
+				"by_type", by_type);
+
+	return root;
+}
+
+int stats_dump_json(json_t *root, const char *path)
+{
+	FILE *fp;
+	int ret = 0;
+
+	if (strcmp(path, "-") == 0) {
+		ret = json_dumpf(root, stdout, JSON_INDENT(4)) == 0;
+		putchar('\n');
+	} else if ((fp = fopen(path, "w")) != NULL) {
+		ret = json_dumpf(root, fp, JSON_INDENT(4)) == 0;
+		fclose(fp);
+	} else {
+		fprintf(stderr, "could not open '%s' for writing\n", path);
+	}
+
+	return ret;
+}
+
+int stats_write_json(const elf_create_stats *stats, const char *input, const char *path)
+{
+	json_t *root;
+	int ret;
+
+	if (stats == NULL)
+		return 1;
+
+	if ((root = stats_to_json(stats, input)) == NULL)
+		return 0;
+
+	ret = stats_dump_json(root, path);
+	json_decref(root);
+	return ret;
+}
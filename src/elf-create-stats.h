@@ -0,0 +1,50 @@
+#ifndef ELF_CREATE_STATS_H
+#define ELF_CREATE_STATS_H
+
+#include <jansson.h>
+
+#include "sce-elf.h"
+
+/* Phases of a vita-elf-create run, in pipeline order */
+typedef enum {
+	STATS_LOAD,		/* ELF, export spec and import databases */
+	STATS_IMPORT_LOOKUP,	/* Resolve stubs against the import databases */
+	STATS_MODINFO_CREATE,
+	STATS_MODINFO_ENCODE,
+	STATS_RELOC_DISCARD,	/* Copy to output, ABS fixups, invalid reloc discard */
+	STATS_SHIFT_COPY,	/* Write module info sections and rewrite stubs */
+	STATS_RELOC_ENCODE,
+	STATS_ELF_UPDATE,	/* elf_update and header patch */
+	STATS_NUM_PHASES
+} elf_create_phase;
+
+typedef struct {
+	double wall_ms[STATS_NUM_PHASES];
+	/* Growth of the heap in use, -1 when unavailable.  The heap is the
+	 * whole process's, so this only means anything while no other
+	 * conversion runs alongside; see stats_clear_heap. */
+	long long heap_bytes[STATS_NUM_PHASES];
+
+	double phase_start;
+	long long heap_start;
+
+	int num_fstubs;
+	int num_vstubs;
+	int num_discarded_relas;
+	int num_abs_fixups;
+	int cache_hit;		/* Module info came from the conversion cache */
+	sce_elf_rela_stats_t relas;
+} elf_create_stats;
+
+/* The phase functions accept a NULL stats pointer and do nothing in that case */
+void stats_phase_begin(elf_create_stats *stats);
+void stats_phase_end(elf_create_stats *stats, elf_create_phase phase);
+/* Marks heap_bytes unavailable, for conversions that shared the heap */
+void stats_clear_heap(elf_create_stats *stats);
+
+json_t *stats_to_json(const elf_create_stats *stats, const char *input);
+/* Writes root to path, or to stdout if path is "-" */
+int stats_dump_json(json_t *root, const char *path);
+int stats_write_json(const elf_create_stats *stats, const char *input, const char *path);
+
+#endif // ELF_CREATE_STATS_H
@@ -1,19 +1,94 @@
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <libelf.h>
 #include <gelf.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 #include "fail-utils.h"
 #include "elf-utils.h"
 
 
-int elf_utils_copy(Elf *dest, Elf *source)
+static int is_stripped_scn(const GElf_Shdr *shdr, size_t scndx, size_t shstrndx)
+{
+	if (scndx == 0 || scndx == shstrndx)
+		return 0;
+	if (shdr->sh_flags & SHF_ALLOC)
+		return 0;
+	if (shdr->sh_type >= SHT_LOOS && shdr->sh_type <= SHT_HIOS)
+		return 0;
+	return 1;
+}
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((GElf_Off)(a) - 1))
+
+/* Packs the kept non-loadable sections and the section header table right
+ * after the loadable contents, closing the holes left by stripped sections. */
+static int compact_stripped(Elf *dest)
+{
+	GElf_Ehdr ehdr;
+	Elf_Scn *scn;
+	GElf_Shdr shdr;
+	size_t segment_count, segndx;
+	GElf_Phdr phdr;
+	GElf_Off end = 0;
+
+	ELF_ASSERT(gelf_getehdr(dest, &ehdr));
+	end = ehdr.e_phoff + ehdr.e_phnum * ehdr.e_phentsize;
+
+	ELF_ASSERT((elf_getphdrnum(dest, &segment_count), segment_count > 0));
+	for (segndx = 0; segndx < segment_count; segndx++) {
+		ELF_ASSERT(gelf_getphdr(dest, segndx, &phdr));
+		if (phdr.p_offset + phdr.p_filesz > end)
+			end = phdr.p_offset + phdr.p_filesz;
+	}
+
+	scn = NULL;
+	while ((scn = elf_nextscn(dest, scn)) != NULL) {
+		ELF_ASSERT(gelf_getshdr(scn, &shdr));
+		if ((shdr.sh_flags & SHF_ALLOC) && shdr.sh_type != SHT_NOBITS
+				&& shdr.sh_offset + shdr.sh_size > end)
+			end = shdr.sh_offset + shdr.sh_size;
+	}
+
+	scn = NULL;
+	while ((scn = elf_nextscn(dest, scn)) != NULL) {
+		ELF_ASSERT(gelf_getshdr(scn, &shdr));
+		if ((shdr.sh_flags & SHF_ALLOC) || shdr.sh_type == SHT_NULL)
+			continue;
+		end = ALIGN_UP(end, shdr.sh_addralign ? shdr.sh_addralign : 1);
+		shdr.sh_offset = end;
+		ELF_ASSERT(gelf_update_shdr(scn, &shdr));
+		if (shdr.sh_type != SHT_NOBITS)
+			end += shdr.sh_size;
+	}
+
+	ehdr.e_shoff = ALIGN_UP(end, 4);
+	ELF_ASSERT(gelf_update_ehdr(dest, &ehdr));
+
+	return 1;
+failure:
+	return 0;
+}
+
+int elf_utils_copy(Elf *dest, Elf *source, int flags)
 {
 	GElf_Ehdr ehdr;
 	Elf_Scn *dst_scn, *src_scn;
 	GElf_Shdr shdr;
 	Elf_Data *dst_data, *src_data;
 	size_t segment_count, segndx, new_segndx;
+	size_t shstrndx;
 	GElf_Phdr phdr;
 
 	ELF_ASSERT(elf_flagelf(dest, ELF_C_SET, ELF_F_LAYOUT));
@@ -21,11 +96,24 @@ int elf_utils_copy(Elf *dest, Elf *source)
 	ELF_ASSERT(gelf_getehdr(source, &ehdr));
 	ELF_ASSERT(gelf_newehdr(dest, gelf_getclass(source)));
 	ELF_ASSERT(gelf_update_ehdr(dest, &ehdr));
+	ELF_ASSERT(elf_getshdrstrndx(source, &shstrndx) == 0);
 
 	src_scn = NULL;
 	while ((src_scn = elf_nextscn(source, src_scn)) != NULL) {
 		ELF_ASSERT(gelf_getshdr(src_scn, &shdr));
 		ELF_ASSERT(dst_scn = elf_newscn(dest));
+
+		/* Stripped sections stay behind as inactive headers so that section
+		 * indices taken from the source remain valid in dest. */
+		if ((flags & ELF_UTILS_COPY_STRIP) && is_stripped_scn(&shdr, elf_ndxscn(src_scn), shstrndx)) {
+			GElf_Word name = shdr.sh_name;
+			memset(&shdr, 0, sizeof(shdr));
+			shdr.sh_name = name;
+			shdr.sh_type = SHT_NULL;
+			ELF_ASSERT(gelf_update_shdr(dst_scn, &shdr));
+			continue;
+		}
+
 		ELF_ASSERT(gelf_update_shdr(dst_scn, &shdr));
 
 		src_data = NULL;
@@ -57,34 +145,270 @@ int elf_utils_copy(Elf *dest, Elf *source)
 			new_segndx++;
 		}
 	}
-		
+
+	if (flags & ELF_UTILS_COPY_STRIP)
+		return compact_stripped(dest);
+
 	return 1;
 failure:
 	return 0;
 }
 
-Elf *elf_utils_copy_to_file(const char *filename, Elf *source, FILE **file)
+static int output_open(elf_utils_output *out, const char *filename)
 {
-	Elf *dest = NULL;
+	static volatile int tmp_counter;
+	size_t len = strlen(filename);
 
-	*file = fopen(filename, "wb");
-	if (*file == NULL)
-		FAIL("Could not open %s for writing", filename);
+	memset(out, 0, sizeof(*out));
+	out->fd = -1;
+
+	ASSERT(out->path = strdup(filename));
+	ASSERT(out->tmp_path = malloc(len + 32));
+	sprintf(out->tmp_path, "%s.%ld.%d.tmp", filename, (long)getpid(), __sync_fetch_and_add(&tmp_counter, 1));
+
+	out->fd = open(out->tmp_path, O_RDWR | O_CREAT | O_EXCL | O_BINARY, 0666);
+	if (out->fd < 0)
+		FAIL("Could not open %s for writing", out->tmp_path);
+
+	return 1;
+failure:
+	free(out->path);
+	free(out->tmp_path);
+	out->path = out->tmp_path = NULL;
+	return 0;
+}
+
+Elf *elf_utils_copy_to_output(const char *filename, Elf *source, elf_utils_output *out, int flags)
+{
+	Elf *dest = NULL;
 
+	if (!output_open(out, filename))
+		return NULL;
 
 	ELF_ASSERT(elf_version(EV_CURRENT) != EV_NONE);
-	ELF_ASSERT(dest = elf_begin(fileno(*file), ELF_C_WRITE, NULL));
+	ELF_ASSERT(dest = elf_begin(out->fd, ELF_C_WRITE, NULL));
 
-	if (!elf_utils_copy(dest, source))
+	if (!elf_utils_copy(dest, source, flags))
 		goto failure;
 
 	return dest;
 failure:
 	if (dest != NULL)
 		elf_end(dest);
+	elf_utils_output_discard(out);
 	return NULL;
 }
 
+static int xlate_to_image(elf_utils_output *out, size_t offset, void *buf, size_t size, Elf_Type type, unsigned encoding)
+{
+	Elf_Data src = {0}, dst = {0};
+
+	ASSERT(offset + size <= out->size);
+
+	src.d_buf = buf;
+	src.d_size = size;
+	src.d_type = type;
+	src.d_version = EV_CURRENT;
+	dst.d_buf = out->image + offset;
+	dst.d_size = size;
+	dst.d_version = EV_CURRENT;
+	ELF_ASSERT(elf32_xlatetof(&dst, &src, encoding));
+
+	return 1;
+failure:
+	return 0;
+}
+
+int elf_utils_output_map(Elf *e, elf_utils_output *out)
+{
+	Elf32_Ehdr *ehdr;
+	Elf32_Phdr *phdrs;
+	Elf32_Shdr *shdr;
+	Elf_Scn *scn;
+	Elf_Data *data;
+	off_t size;
+	size_t shnum, scndx;
+	unsigned encoding;
+	char *map;
+
+	/* ELF_C_NULL fills in the header counts and returns the file size without writing */
+	ELF_ASSERT((size = elf_update(e, ELF_C_NULL)) >= 0);
+	ELF_ASSERT(ehdr = elf32_getehdr(e));
+	ELF_ASSERT(elf_getshdrnum(e, &shnum) == 0);
+	encoding = ehdr->e_ident[EI_DATA];
+
+	if (ehdr->e_shoff + shnum * sizeof(Elf32_Shdr) > size)
+		size = ehdr->e_shoff + shnum * sizeof(Elf32_Shdr);
+	out->size = size;
+
+#ifndef _WIN32
+	SYS_ASSERT(ftruncate(out->fd, out->prefix + size));
+	map = mmap(NULL, out->prefix + size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+	if (map == MAP_FAILED)
+		FAIL("Could not map %s", out->tmp_path);
+#else
+	ASSERT(map = calloc(1, out->prefix + size));
+#endif
+	out->image = map + out->prefix;
+
+	if (!xlate_to_image(out, 0, ehdr, sizeof(Elf32_Ehdr), ELF_T_EHDR, encoding))
+		goto failure;
+
+	if (ehdr->e_phnum > 0) {
+		ELF_ASSERT(phdrs = elf32_getphdr(e));
+		if (!xlate_to_image(out, ehdr->e_phoff, phdrs, ehdr->e_phnum * sizeof(Elf32_Phdr), ELF_T_PHDR, encoding))
+			goto failure;
+	}
+
+	for (scndx = 0; scndx < shnum; scndx++) {
+		ELF_ASSERT(scn = elf_getscn(e, scndx));
+		ELF_ASSERT(shdr = elf32_getshdr(scn));
+
+		if (!xlate_to_image(out, ehdr->e_shoff + scndx * sizeof(Elf32_Shdr), shdr, sizeof(Elf32_Shdr), ELF_T_SHDR, encoding))
+			goto failure;
+
+		if (shdr->sh_type == SHT_NULL || shdr->sh_type == SHT_NOBITS)
+			continue;
+
+		data = NULL;
+		while ((data = elf_getdata(scn, data)) != NULL) {
+			if (data->d_buf == NULL || data->d_size == 0)
+				continue;
+			if (!xlate_to_image(out, shdr->sh_offset + data->d_off, data->d_buf, data->d_size, data->d_type, encoding))
+				goto failure;
+		}
+	}
+
+	return 1;
+failure:
+	return 0;
+}
+
+int elf_utils_output_commit(elf_utils_output *out)
+{
+	char *map = out->image ? (char *)out->image - out->prefix : NULL;
+#ifndef _WIN32
+	if (map)
+		SYS_ASSERT(munmap(map, out->prefix + out->size));
+	out->image = NULL;
+#else
+	size_t written = 0;
+	ssize_t ret;
+
+	while (written < out->prefix + out->size) {
+		ret = write(out->fd, map + written, out->prefix + out->size - written);
+		if (ret <= 0)
+			FAIL("Could not write %s", out->tmp_path);
+		written += ret;
+	}
+	free(map);
+	out->image = NULL;
+#endif
+
+	SYS_ASSERT(close(out->fd));
+	out->fd = -1;
+
+#ifndef _WIN32
+	if (rename(out->tmp_path, out->path) != 0)
+		FAIL("Could not rename %s to %s", out->tmp_path, out->path);
+#else
+	if (!MoveFileExA(out->tmp_path, out->path, MOVEFILE_REPLACE_EXISTING))
+		FAILX("Could not rename %s to %s", out->tmp_path, out->path);
+#endif
+
+	free(out->tmp_path);
+	out->tmp_path = NULL;
+	free(out->path);
+	out->path = NULL;
+
+	return 1;
+failure:
+	return 0;
+}
+
+void elf_utils_output_discard(elf_utils_output *out)
+{
+	if (out->image) {
+#ifndef _WIN32
+		munmap((char *)out->image - out->prefix, out->prefix + out->size);
+#else
+		free((char *)out->image - out->prefix);
+#endif
+		out->image = NULL;
+	}
+	if (out->fd >= 0)
+		close(out->fd);
+	out->fd = -1;
+	if (out->tmp_path)
+		unlink(out->tmp_path);
+	free(out->tmp_path);
+	out->tmp_path = NULL;
+	free(out->path);
+	out->path = NULL;
+}
+
+int elf_utils_write_debug_file(const char *filename, Elf *source)
+{
+	FILE *file = NULL;
+	Elf *dest = NULL;
+	GElf_Ehdr ehdr;
+	Elf_Scn *dst_scn, *src_scn;
+	GElf_Shdr shdr;
+	Elf_Data *dst_data, *src_data;
+	GElf_Off offset;
+	int ret = 0;
+
+	file = fopen(filename, "wb");
+	if (file == NULL)
+		FAIL("Could not open %s for writing", filename);
+
+	ELF_ASSERT(elf_version(EV_CURRENT) != EV_NONE);
+	ELF_ASSERT(dest = elf_begin(fileno(file), ELF_C_WRITE, NULL));
+	ELF_ASSERT(elf_flagelf(dest, ELF_C_SET, ELF_F_LAYOUT));
+
+	ELF_ASSERT(gelf_getehdr(source, &ehdr));
+	ELF_ASSERT(gelf_newehdr(dest, gelf_getclass(source)));
+
+	/* No program headers: the file only carries symbols and debug info */
+	offset = ehdr.e_ehsize;
+	src_scn = NULL;
+	while ((src_scn = elf_nextscn(source, src_scn)) != NULL) {
+		ELF_ASSERT(gelf_getshdr(src_scn, &shdr));
+		ELF_ASSERT(dst_scn = elf_newscn(dest));
+
+		if (shdr.sh_flags & SHF_ALLOC)
+			shdr.sh_type = SHT_NOBITS;
+
+		offset = ALIGN_UP(offset, shdr.sh_addralign ? shdr.sh_addralign : 1);
+		shdr.sh_offset = offset;
+		ELF_ASSERT(gelf_update_shdr(dst_scn, &shdr));
+
+		if (shdr.sh_type == SHT_NOBITS)
+			continue;
+		offset += shdr.sh_size;
+
+		src_data = NULL;
+		while ((src_data = elf_getdata(src_scn, src_data)) != NULL) {
+			ELF_ASSERT(dst_data = elf_newdata(dst_scn));
+			memcpy(dst_data, src_data, sizeof(Elf_Data));
+		}
+	}
+
+	ehdr.e_phoff = 0;
+	ehdr.e_phnum = 0;
+	ehdr.e_shoff = ALIGN_UP(offset, 4);
+	ELF_ASSERT(gelf_update_ehdr(dest, &ehdr));
+
+	ELF_ASSERT(elf_update(dest, ELF_C_WRITE) >= 0);
+	ret = 1;
+failure:
+	if (dest != NULL)
+		elf_end(dest);
+	if (file != NULL)
+		fclose(file);
+	return ret;
+}
+
 int elf_utils_duplicate_scn_contents(Elf *e, int scndx)
 {
 	Elf_Scn *scn;
@@ -133,116 +457,147 @@ failure:
 	return 0;
 }
 
-int elf_utils_shift_contents(Elf *e, int start_offset, int shift_amount)
-{
-	GElf_Ehdr ehdr;
+typedef enum {
+	TXN_SHIFT,	/* Move everything at or after start by amount */
+	TXN_NAME,	/* Append a name to shstrtab for the new section scndx */
+	TXN_PLACE,	/* Give scndx amount bytes of room at the section header table */
+} txn_op_type;
+
+typedef struct {
+	txn_op_type type;
+	size_t scndx;
+	GElf_Off start;
+	GElf_Off amount;
+} txn_op;
+
+/* Section header as replayed by elf_utils_txn_commit */
+typedef struct {
 	Elf_Scn *scn;
 	GElf_Shdr shdr;
-	size_t segment_count = 0, segndx;
-	GElf_Phdr phdr;
-	int bottom_section_offset = 0;
-	GElf_Xword sh_size;
+	GElf_Off orig_offset;
+	GElf_Xword orig_size;
+	int live;	/* Seen by shifts; new sections only after their TXN_NAME */
+	int placed;	/* Offset and size are assigned by a TXN_PLACE */
+} txn_scn;
 
-	ELF_ASSERT(gelf_getehdr(e, &ehdr));
-	if (ehdr.e_shoff >= start_offset) {
-		ehdr.e_shoff += shift_amount;
-		ELF_ASSERT(gelf_update_ehdr(e, &ehdr));
-	}
-
-	scn = NULL;
-	while ((scn = elf_nextscn(e, scn)) != NULL) {
-		ELF_ASSERT(gelf_getshdr(scn, &shdr));
-		if (shdr.sh_offset >= start_offset) {
-			shdr.sh_offset += shift_amount;
-			ELF_ASSERT(gelf_update_shdr(scn, &shdr));
-		}
-		sh_size = (shdr.sh_type == SHT_NOBITS) ? 0 : shdr.sh_size;
-		if (shdr.sh_offset + sh_size > bottom_section_offset) {
-			bottom_section_offset = shdr.sh_offset + sh_size;
-		}
-	}
+typedef struct {
+	GElf_Ehdr ehdr;
+	txn_scn *scns;
+	size_t num_scns;
+	GElf_Phdr *phdrs;
+	size_t num_phdrs;
+} txn_layout;
 
-	if (bottom_section_offset > ehdr.e_shoff) {
-		ELF_ASSERT(gelf_getehdr(e, &ehdr));
-		ehdr.e_shoff = bottom_section_offset;
-		ELF_ASSERT(gelf_update_ehdr(e, &ehdr));
+static void replay_shift(txn_layout *layout, GElf_Off start_offset, GElf_Off shift_amount)
+{
+	GElf_Off bottom_section_offset = 0;
+	GElf_Xword sh_size;
+	GElf_Shdr *shdr;
+	size_t i;
+
+	if (layout->ehdr.e_shoff >= start_offset)
+		layout->ehdr.e_shoff += shift_amount;
+
+	for (i = 1; i < layout->num_scns; i++) {
+		if (!layout->scns[i].live)
+			continue;
+		shdr = &layout->scns[i].shdr;
+		if (shdr->sh_offset >= start_offset)
+			shdr->sh_offset += shift_amount;
+		sh_size = (shdr->sh_type == SHT_NOBITS) ? 0 : shdr->sh_size;
+		if (shdr->sh_offset + sh_size > bottom_section_offset)
+			bottom_section_offset = shdr->sh_offset + sh_size;
 	}
 
-	/* A bug in libelf means that getphdrnum will report failure in a new file.
-	 * However, it will still set segment_count, so we'll use it. */
-	ELF_ASSERT((elf_getphdrnum(e, &segment_count), segment_count > 0));
+	if (bottom_section_offset > layout->ehdr.e_shoff)
+		layout->ehdr.e_shoff = bottom_section_offset;
 
-	for (segndx = 0; segndx < segment_count; segndx++) {
-		ELF_ASSERT(gelf_getphdr(e, segndx, &phdr));
-		if (phdr.p_offset >= start_offset) {
-			phdr.p_offset += shift_amount;
-			ELF_ASSERT(gelf_update_phdr(e, segndx, &phdr));
-		}
+	for (i = 0; i < layout->num_phdrs; i++) {
+		if (layout->phdrs[i].p_offset >= start_offset)
+			layout->phdrs[i].p_offset += shift_amount;
 	}
-		
-	return 1;
-failure:
-	return 0;
 }
 
-Elf_Scn *elf_utils_new_scn_with_name(Elf *e, const char *scn_name)
+int elf_utils_txn_begin(elf_utils_txn *txn, Elf *e)
 {
+	size_t shstrndx;
 	Elf_Scn *scn;
-	GElf_Shdr shdr;
-	size_t shstrndx, index, namelen;
 	Elf_Data *shstrdata;
-	void *ptr;
 
-	ELF_ASSERT(elf_getshdrstrndx(e, &shstrndx) == 0);
+	memset(txn, 0, sizeof(*txn));
+	txn->e = e;
 
+	ELF_ASSERT(elf_getshdrstrndx(e, &shstrndx) == 0);
 	ELF_ASSERT(scn = elf_getscn(e, shstrndx));
 	ELF_ASSERT(shstrdata = elf_getdata(scn, NULL));
+	txn->shstr_size = shstrdata->d_size;
+
+	ASSERT(varray_init(&txn->ops, sizeof(txn_op), 16));
+
+	return 1;
+failure:
+	return 0;
+}
+
+int elf_utils_txn_shift(elf_utils_txn *txn, int start_offset, int shift_amount)
+{
+	txn_op op = { TXN_SHIFT, 0, start_offset, shift_amount };
+
+	ASSERT(varray_push(&txn->ops, &op));
+
+	return 1;
+failure:
+	return 0;
+}
+
+Elf_Scn *elf_utils_txn_new_scn_with_name(elf_utils_txn *txn, const char *scn_name)
+{
+	Elf_Scn *scn;
+	GElf_Shdr shdr;
+	size_t namelen;
+	char *names;
+	txn_op op = { TXN_NAME };
 
 	namelen = strlen(scn_name) + 1;
-	ELF_ASSERT(gelf_getshdr(scn, &shdr));
-	if (!elf_utils_shift_contents(e, shdr.sh_offset + shdr.sh_size, namelen))
-		goto failure;
-	ASSERT(ptr = realloc(shstrdata->d_buf, shstrdata->d_size + namelen));
-	index = shstrdata->d_size;
-	strcpy(ptr+index, scn_name);
-	shstrdata->d_buf = ptr;
-	shstrdata->d_size += namelen;
-	shdr.sh_size += namelen;
-	ELF_ASSERT(gelf_update_shdr(scn, &shdr));
+	ASSERT(names = realloc(txn->names, txn->names_len + namelen));
+	memcpy(names + txn->names_len, scn_name, namelen);
+	txn->names = names;
+	txn->names_len += namelen;
 
-	ELF_ASSERT(scn = elf_newscn(e));
+	ELF_ASSERT(scn = elf_newscn(txn->e));
 	ELF_ASSERT(gelf_getshdr(scn, &shdr));
-	shdr.sh_name = index;
+	shdr.sh_name = txn->shstr_size;
 	ELF_ASSERT(gelf_update_shdr(scn, &shdr));
-	
+	txn->shstr_size += namelen;
+
+	op.scndx = elf_ndxscn(scn);
+	op.amount = namelen;
+	ASSERT(varray_push(&txn->ops, &op));
+
 	return scn;
 failure:
 	return NULL;
 }
 
-Elf_Scn *elf_utils_new_scn_with_data(Elf *e, const char *scn_name, void *buf, int len)
+Elf_Scn *elf_utils_txn_new_scn_with_data(elf_utils_txn *txn, const char *scn_name, void *buf, int len)
 {
 	Elf_Scn *scn;
-	GElf_Ehdr ehdr;
 	GElf_Shdr shdr;
 	Elf_Data *data;
-	int offset;
+	txn_op op = { TXN_PLACE };
 
-	scn = elf_utils_new_scn_with_name(e, scn_name);
+	scn = elf_utils_txn_new_scn_with_name(txn, scn_name);
 	if (scn == NULL)
 		goto failure;
 
-	ELF_ASSERT(gelf_getehdr(e, &ehdr));
-	offset = ehdr.e_shoff;
-	if (!elf_utils_shift_contents(e, offset, len + 0x10))
-		goto failure;
-
 	ELF_ASSERT(gelf_getshdr(scn, &shdr));
-	shdr.sh_offset = (offset + 0x10) & ~0xF;
-	shdr.sh_size = len;
 	shdr.sh_addralign = 1;
 	ELF_ASSERT(gelf_update_shdr(scn, &shdr));
 
+	op.scndx = elf_ndxscn(scn);
+	op.amount = len;
+	ASSERT(varray_push(&txn->ops, &op));
+
 	ELF_ASSERT(data = elf_newdata(scn));
 	data->d_buf = buf;
 	data->d_type = ELF_T_BYTE;
@@ -255,3 +610,162 @@ Elf_Scn *elf_utils_new_scn_with_data(Elf *e, const char *scn_name, void *buf, in
 failure:
 	return NULL;
 }
+
+int elf_utils_txn_commit(elf_utils_txn *txn)
+{
+	Elf *e = txn->e;
+	txn_layout layout = {};
+	txn_scn *tscn, *shstr;
+	txn_op *op;
+	GElf_Off offset;
+	GElf_Off *orig_p_offsets = NULL;
+	Elf_Scn *scn;
+	Elf_Data *shstrdata;
+	size_t shstrndx;
+	void *ptr;
+	int ret = 0;
+	int i;
+
+	if (txn->ops.count == 0)
+		goto done;
+
+	ELF_ASSERT(gelf_getehdr(e, &layout.ehdr));
+	ELF_ASSERT(elf_getshdrnum(e, &layout.num_scns) == 0);
+	ELF_ASSERT(elf_getshdrstrndx(e, &shstrndx) == 0);
+
+	ASSERT(layout.scns = calloc(layout.num_scns, sizeof(txn_scn)));
+	scn = NULL;
+	while ((scn = elf_nextscn(e, scn)) != NULL) {
+		tscn = &layout.scns[elf_ndxscn(scn)];
+		tscn->scn = scn;
+		ELF_ASSERT(gelf_getshdr(scn, &tscn->shdr));
+		tscn->orig_offset = tscn->shdr.sh_offset;
+		tscn->orig_size = tscn->shdr.sh_size;
+		tscn->live = 1;
+	}
+
+	/* A bug in libelf means that getphdrnum will report failure in a new file.
+	 * However, it will still set segment_count, so we'll use it. */
+	ELF_ASSERT((elf_getphdrnum(e, &layout.num_phdrs), layout.num_phdrs > 0));
+	ASSERT(layout.phdrs = calloc(layout.num_phdrs, sizeof(GElf_Phdr)));
+	ASSERT(orig_p_offsets = calloc(layout.num_phdrs, sizeof(GElf_Off)));
+	for (i = 0; i < layout.num_phdrs; i++) {
+		ELF_ASSERT(gelf_getphdr(e, i, &layout.phdrs[i]));
+		orig_p_offsets[i] = layout.phdrs[i].p_offset;
+	}
+
+	for (i = 0; i < txn->ops.count; i++) {
+		op = VARRAY_ELEMENT(&txn->ops, i);
+		ASSERT(op->scndx < layout.num_scns);
+		if (op->type == TXN_NAME)
+			layout.scns[op->scndx].live = 0;
+		else if (op->type == TXN_PLACE)
+			layout.scns[op->scndx].placed = 1;
+	}
+
+	shstr = &layout.scns[shstrndx];
+	for (i = 0; i < txn->ops.count; i++) {
+		op = VARRAY_ELEMENT(&txn->ops, i);
+		tscn = &layout.scns[op->scndx];
+		switch (op->type) {
+		case TXN_SHIFT:
+			replay_shift(&layout, op->start, op->amount);
+			break;
+		case TXN_NAME:
+			replay_shift(&layout, shstr->shdr.sh_offset + shstr->shdr.sh_size, op->amount);
+			shstr->shdr.sh_size += op->amount;
+			tscn->live = 1;
+			if (tscn->placed) {
+				tscn->shdr.sh_offset = 0;
+				tscn->shdr.sh_size = 0;
+			}
+			break;
+		case TXN_PLACE:
+			offset = layout.ehdr.e_shoff;
+			replay_shift(&layout, offset, op->amount + 0x10);
+			tscn->shdr.sh_offset = (offset + 0x10) & ~0xF;
+			tscn->shdr.sh_size = op->amount;
+			break;
+		}
+	}
+
+	if (txn->names_len) {
+		ELF_ASSERT(shstrdata = elf_getdata(shstr->scn, NULL));
+		ASSERT(ptr = realloc(shstrdata->d_buf, shstrdata->d_size + txn->names_len));
+		memcpy(ptr + shstrdata->d_size, txn->names, txn->names_len);
+		shstrdata->d_buf = ptr;
+		shstrdata->d_size += txn->names_len;
+	}
+
+	ELF_ASSERT(gelf_update_ehdr(e, &layout.ehdr));
+
+	for (i = 1; i < layout.num_scns; i++) {
+		tscn = &layout.scns[i];
+		if (tscn->scn && (tscn->shdr.sh_offset != tscn->orig_offset
+					|| tscn->shdr.sh_size != tscn->orig_size))
+			ELF_ASSERT(gelf_update_shdr(tscn->scn, &tscn->shdr));
+	}
+
+	for (i = 0; i < layout.num_phdrs; i++) {
+		if (layout.phdrs[i].p_offset != orig_p_offsets[i])
+			ELF_ASSERT(gelf_update_phdr(e, i, &layout.phdrs[i]));
+	}
+
+done:
+	ret = 1;
+failure:
+	free(layout.scns);
+	free(layout.phdrs);
+	free(orig_p_offsets);
+	elf_utils_txn_abort(txn);
+	return ret;
+}
+
+void elf_utils_txn_abort(elf_utils_txn *txn)
+{
+	varray_destroy(&txn->ops);
+	free(txn->names);
+	txn->names = NULL;
+	txn->names_len = 0;
+}
+
+int elf_utils_shift_contents(Elf *e, int start_offset, int shift_amount)
+{
+	elf_utils_txn txn;
+
+	if (!elf_utils_txn_begin(&txn, e))
+		return 0;
+	if (!elf_utils_txn_shift(&txn, start_offset, shift_amount)) {
+		elf_utils_txn_abort(&txn);
+		return 0;
+	}
+	return elf_utils_txn_commit(&txn);
+}
+
+Elf_Scn *elf_utils_new_scn_with_name(Elf *e, const char *scn_name)
+{
+	elf_utils_txn txn;
+	Elf_Scn *scn;
+
+	if (!elf_utils_txn_begin(&txn, e))
+		return NULL;
+	if ((scn = elf_utils_txn_new_scn_with_name(&txn, scn_name)) == NULL) {
+		elf_utils_txn_abort(&txn);
+		return NULL;
+	}
+	return elf_utils_txn_commit(&txn) ? scn : NULL;
+}
+
+Elf_Scn *elf_utils_new_scn_with_data(Elf *e, const char *scn_name, void *buf, int len)
+{
+	elf_utils_txn txn;
+	Elf_Scn *scn;
+
+	if (!elf_utils_txn_begin(&txn, e))
+		return NULL;
+	if ((scn = elf_utils_txn_new_scn_with_data(&txn, scn_name, buf, len)) == NULL) {
+		elf_utils_txn_abort(&txn);
+		return NULL;
+	}
+	return elf_utils_txn_commit(&txn) ? scn : NULL;
+}
@@ -4,9 +4,43 @@
 #include <stdio.h>
 #include <libelf.h>
 
-int elf_utils_copy(Elf *dest, Elf *source);
+#include "varray.h"
 
-Elf *elf_utils_copy_to_file(const char *filename, Elf *source, FILE **file);
+/* Flags for elf_utils_copy */
+#define ELF_UTILS_COPY_STRIP	1	/* Keep only loadable sections, .shstrtab and OS-specific ones */
+
+int elf_utils_copy(Elf *dest, Elf *source, int flags);
+
+/* An output file that is built in a temporary file next to it and renamed
+ * into place by elf_utils_output_commit, so that it only ever appears
+ * complete.  On platforms with mmap the image is a mapping of that file.
+ * prefix may be set before elf_utils_output_map to reserve zeroed bytes in
+ * front of the ELF image, which then starts at that file offset. */
+typedef struct {
+	char *path;
+	char *tmp_path;
+	int fd;
+	void *image;
+	size_t size;
+	size_t prefix;
+} elf_utils_output;
+
+/* elf_utils_copy into a new ELF whose output is out */
+Elf *elf_utils_copy_to_output(const char *filename, Elf *source, elf_utils_output *out, int flags);
+
+/* Computes the final layout of e, sizes the output to match and serializes
+ * every header and section into out->image, where it can still be patched. */
+int elf_utils_output_map(Elf *e, elf_utils_output *out);
+
+int elf_utils_output_commit(elf_utils_output *out);
+
+/* Removes the temporary file; safe to call after a commit or on a zeroed out */
+void elf_utils_output_discard(elf_utils_output *out);
+
+/* Writes the sections ELF_UTILS_COPY_STRIP drops to filename, in the manner of
+ * objcopy --only-keep-debug: every section header is kept with its address,
+ * but loadable sections carry no data. */
+int elf_utils_write_debug_file(const char *filename, Elf *source);
 
 int elf_utils_duplicate_scn_contents(Elf *e, int scndx);
 int elf_utils_duplicate_shstrtab(Elf *e);
@@ -18,4 +52,30 @@ Elf_Scn *elf_utils_new_scn_with_name(Elf *e, const char *scn_name);
 
 Elf_Scn *elf_utils_new_scn_with_data(Elf *e, const char *scn_name, void *buf, int len);
 
+/* Batches layout changes so that adding several sections costs one pass over
+ * the headers instead of one per section.  Between _begin and _commit:
+ *  - shifts and new section names are only queued; offsets read back through
+ *    libelf are still those from before _begin,
+ *  - offsets written to a section created by the transaction are taken to be
+ *    in the layout as it stands at its creation, exactly as if the non-batched
+ *    call had been made at that point,
+ *  - the data of sections created with _new_scn_with_data has no offset yet.
+ * _commit replays the queued operations in order, so the result is identical
+ * to making the same calls without a transaction.  _commit and _abort both
+ * release the transaction. */
+typedef struct {
+	Elf *e;
+	varray ops;
+	char *names;		/* Section names to append to shstrtab */
+	size_t names_len;
+	size_t shstr_size;	/* Size shstrtab will have once names is appended */
+} elf_utils_txn;
+
+int elf_utils_txn_begin(elf_utils_txn *txn, Elf *e);
+int elf_utils_txn_shift(elf_utils_txn *txn, int start_offset, int shift_amount);
+Elf_Scn *elf_utils_txn_new_scn_with_name(elf_utils_txn *txn, const char *scn_name);
+Elf_Scn *elf_utils_txn_new_scn_with_data(elf_utils_txn *txn, const char *scn_name, void *buf, int len);
+int elf_utils_txn_commit(elf_utils_txn *txn);
+void elf_utils_txn_abort(elf_utils_txn *txn);
+
 #endif
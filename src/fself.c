@@ -0,0 +1,146 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "self.h"
+#include "fself.h"
+
+int fself_fixup_phdrs(void *phdrs, int phnum) {
+	e_phdr *phdr = phdrs;
+	int changed = 0;
+
+	for (int i = 0; i < phnum; ++i) {
+		if (phdr[i].p_align > 0x1000) {
+			phdr[i].p_align = 0x1000;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+int fself_build_header(void *header, const void *ehdr_in, const void *phdrs,
+		const fself_segment *segments, uint64_t elf_filesize, uint64_t body_len, uint64_t authid) {
+	const ELF_header *ehdr = ehdr_in;
+	char *out = header;
+	size_t pos = 0;
+
+	if (sizeof(SCE_header) + sizeof(SCE_appinfo) + sizeof(ELF_header)
+			+ (sizeof(e_phdr) + sizeof(segment_info)) * ehdr->e_phnum + sizeof(SCE_version)
+			+ sizeof(SCE_controlinfo_5) + sizeof(SCE_controlinfo_6) + sizeof(SCE_controlinfo_7) > HEADER_LEN)
+		return 0;
+
+	memset(header, 0, HEADER_LEN);
+
+	SCE_header hdr = { 0 };
+	hdr.magic = 0x454353; // "SCE\0"
+	hdr.version = 3;
+	hdr.sdk_type = 0xC0;
+	hdr.header_type = 1;
+	hdr.metadata_offset = 0x600; // ???
+	hdr.header_len = HEADER_LEN;
+	hdr.elf_filesize = elf_filesize;
+	// self_filesize
+	hdr.self_offset = 4;
+	hdr.appinfo_offset = 0x80;
+	hdr.elf_offset = sizeof(SCE_header) + sizeof(SCE_appinfo);
+	hdr.phdr_offset = hdr.elf_offset + sizeof(ELF_header);
+	// hdr.shdr_offset = ;
+	hdr.section_info_offset = hdr.phdr_offset + sizeof(e_phdr) * ehdr->e_phnum;
+	hdr.sceversion_offset = hdr.section_info_offset + sizeof(segment_info) * ehdr->e_phnum;
+	hdr.controlinfo_offset = hdr.sceversion_offset + sizeof(SCE_version);
+	hdr.controlinfo_size = sizeof(SCE_controlinfo_5) + sizeof(SCE_controlinfo_6) + sizeof(SCE_controlinfo_7);
+	hdr.self_filesize = hdr.section_info_offset + sizeof(segment_info) * ehdr->e_phnum + body_len;
+
+	// SCE_header should be ok
+
+	SCE_appinfo appinfo = { 0 };
+	appinfo.authid = authid;
+	appinfo.vendor_id = 0;
+	appinfo.self_type = 8;
+	appinfo.version = 0x1000000000000;
+	appinfo.padding = 0;
+
+	SCE_version ver = { 0 };
+	ver.unk1 = 1;
+	ver.unk2 = 0;
+	ver.unk3 = 16;
+	ver.unk4 = 0;
+
+	SCE_controlinfo_5 control_5 = { 0 };
+	control_5.common.type = 5;
+	control_5.common.size = sizeof(control_5);
+	control_5.common.unk = 1;
+	SCE_controlinfo_6 control_6 = { 0 };
+	control_6.common.type = 6;
+	control_6.common.size = sizeof(control_6);
+	control_6.common.unk = 1;
+	control_6.unk1 = 1;
+	SCE_controlinfo_7 control_7 = { 0 };
+	control_7.common.type = 7;
+	control_7.common.size = sizeof(control_7);
+
+	ELF_header myhdr = { 0 };
+	memcpy(myhdr.e_ident, "\177ELF\1\1\1", 8);
+	myhdr.e_type = ehdr->e_type;
+	myhdr.e_machine = 0x28;
+	myhdr.e_version = 1;
+	myhdr.e_entry = ehdr->e_entry;
+	myhdr.e_phoff = 0x34;
+	myhdr.e_flags = 0x05000000U;
+	myhdr.e_ehsize = 0x34;
+	myhdr.e_phentsize = 0x20;
+	myhdr.e_phnum = ehdr->e_phnum;
+
+#define APPEND(ptr, len) do { memcpy(out + pos, ptr, len); pos += len; } while (0)
+	APPEND(&hdr, sizeof(hdr));
+	APPEND(&appinfo, sizeof(appinfo));
+	APPEND(&myhdr, sizeof(myhdr));
+	// copy elf phdr in same format
+	APPEND(phdrs, sizeof(e_phdr) * ehdr->e_phnum);
+
+	// convert elf phdr info to segment info that sony loader expects
+	for (int i = 0; i < ehdr->e_phnum; ++i) {
+		segment_info sinfo = { 0 };
+		sinfo.offset = segments[i].offset;
+		sinfo.length = segments[i].length;
+		sinfo.compression = segments[i].compressed ? 2 : 1;
+		sinfo.encryption = 2;
+		APPEND(&sinfo, sizeof(sinfo));
+	}
+
+	APPEND(&ver, sizeof(ver));
+	APPEND(&control_5, sizeof(control_5));
+	APPEND(&control_6, sizeof(control_6));
+	APPEND(&control_7, sizeof(control_7));
+#undef APPEND
+
+	return 1;
+}
+
+int fself_build_header_for_image(void *header, void *image, size_t size, uint64_t authid) {
+	ELF_header ehdr = { 0 };
+	fself_segment *segments;
+	e_phdr *phdrs;
+	int ret;
+
+	if (size < 0x34)
+		return 0;
+	memcpy(&ehdr, image, 0x34);
+	if (ehdr.e_phentsize != sizeof(e_phdr) || ehdr.e_phoff + sizeof(e_phdr) * ehdr.e_phnum > size)
+		return 0;
+
+	phdrs = (e_phdr *)((char *)image + ehdr.e_phoff);
+	fself_fixup_phdrs(phdrs, ehdr.e_phnum);
+
+	segments = calloc(ehdr.e_phnum ? ehdr.e_phnum : 1, sizeof(fself_segment));
+	if (!segments)
+		return 0;
+	for (int i = 0; i < ehdr.e_phnum; ++i) {
+		segments[i].offset = HEADER_LEN + phdrs[i].p_offset;
+		segments[i].length = phdrs[i].p_filesz;
+	}
+
+	ret = fself_build_header(header, &ehdr, phdrs, segments, size, size, authid);
+	free(segments);
+	return ret;
+}
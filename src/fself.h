@@ -0,0 +1,33 @@
+#ifndef FSELF_H
+#define FSELF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FSELF_HEADER_LEN	0x1000			/* The ELF follows at this offset */
+#define FSELF_AUTHID_DEFAULT	0x2F00000000000001ULL
+#define FSELF_AUTHID_SAFE	0x2F00000000000002ULL	/* No access to restricted APIs */
+
+/* Where a program header's data is stored, as an offset into the fself */
+typedef struct {
+	uint64_t offset;
+	uint64_t length;
+	int compressed;		/* zlib stream rather than the raw bytes */
+} fself_segment;
+
+/* Clamps p_align of phnum 32-bit program headers to what the loader accepts.
+ * Returns nonzero if any of them changed.  TODO: fix in toolchain */
+int fself_fixup_phdrs(void *phdrs, int phnum);
+
+/* Fills the FSELF_HEADER_LEN bytes at header: SCE header, appinfo, a copy of
+ * the ELF and program headers, segment info, version and control info.
+ * ehdr and phdrs are laid out as in the file; body_len is the size of what
+ * follows the header.  Returns 0 if the program headers do not fit. */
+int fself_build_header(void *header, const void *ehdr, const void *phdrs,
+		const fself_segment *segments, uint64_t elf_filesize, uint64_t body_len, uint64_t authid);
+
+/* fself_build_header for an ELF image of size bytes that is stored as-is
+ * after the header.  The program header fixup is applied to image too. */
+int fself_build_header_for_image(void *header, void *image, size_t size, uint64_t authid);
+
+#endif
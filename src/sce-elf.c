@@ -13,6 +13,7 @@
 #include "fail-utils.h"
 #include "varray.h"
 #include "endian-utils.h"
+#include "sha256.h"
 
 const uint32_t sce_elf_stub_func[3] = {
 	0xe3e00000,	/* mvn r0, #0 */
@@ -663,6 +664,7 @@ int sce_elf_write_module_info(
 	GElf_Phdr phdr;
 	Elf_Scn *scn;
 	Elf_Data *data;
+	elf_utils_txn txn = {};
 	sce_section_sizes_t section_addrs = {0};
 	int total_size = 0;
 	Elf32_Addr segment_base, start_vaddr;
@@ -695,7 +697,9 @@ int sce_elf_write_module_info(
 	cur_pos = 0;
 
 	total_size += 0x10 - (total_size & 0xF);
-	if (!elf_utils_shift_contents(dest, start_foffset, total_size))
+
+	/* The room for the sections and their names is made in a single pass at the end */
+	if (!elf_utils_txn_begin(&txn, dest) || !elf_utils_txn_shift(&txn, start_foffset, total_size))
 		FAILX("Unable to relocate ELF sections");
 
 	/* Extend in our copy of phdrs so that vita_elf_vaddr_to_segndx can match it */
@@ -715,7 +719,7 @@ int sce_elf_write_module_info(
 		if (scn_size == 0)
 			continue;
 
-		scn = elf_utils_new_scn_with_name(dest, section_names[i]);
+		ASSERT(scn = elf_utils_txn_new_scn_with_name(&txn, section_names[i]));
 		ELF_ASSERT(gelf_getshdr(scn, &shdr));
 		shdr.sh_type = SHT_PROGBITS;
 		shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
@@ -736,8 +740,12 @@ int sce_elf_write_module_info(
 		cur_pos += scn_size;
 	}
 
+	if (!elf_utils_txn_commit(&txn))
+		FAILX("Unable to relocate ELF sections");
+
 	return 1;
 failure:
+	elf_utils_txn_abort(&txn);
 	return 0;
 }
 
@@ -796,42 +804,293 @@ static int encode_sce_rel(SCE_Rel *rel)
 	}
 }
 
+/* Loadable segment extents sorted by vaddr.  Relocation targets are looked up
+ * through a cursor that stays on the last matched segment, so a walk over
+ * offset-sorted relocations only does a binary search when it crosses into
+ * another segment. */
+typedef struct {
+	Elf32_Addr start;
+	Elf32_Addr end;
+	int segndx;
+} segment_bound;
+
+typedef struct {
+	segment_bound *bounds;
+	int count;
+} segment_map;
+
+static int _bound_sort(const void *el1, const void *el2)
+{
+	const segment_bound *b1 = el1, *b2 = el2;
+	if (b1->start > b2->start)
+		return 1;
+	else if (b1->start < b2->start)
+		return -1;
+	return b1->segndx - b2->segndx;
+}
+
+static int segment_map_init(segment_map *map, const vita_elf_t *ve)
+{
+	const vita_elf_segment_info_t *seg;
+	int i;
+
+	map->count = 0;
+	map->bounds = calloc(ve->num_segments + 1, sizeof(segment_bound));
+	ASSERT(map->bounds != NULL);
+
+	for (i = 0, seg = ve->segments; i < ve->num_segments; i++, seg++) {
+		/* Same rule as vita_elf_vaddr_to_segndx: EXIDX duplicates data already in another segment */
+		if (seg->type == SHT_ARM_EXIDX || seg->memsz == 0)
+			continue;
+		map->bounds[map->count].start = seg->vaddr;
+		map->bounds[map->count].end = seg->vaddr + seg->memsz;
+		map->bounds[map->count].segndx = i;
+		map->count++;
+	}
+
+	qsort(map->bounds, map->count, sizeof(segment_bound), _bound_sort);
+
+	return 1;
+failure:
+	return 0;
+}
+
+/* Returns the segment index containing vaddr, or -1.  *cursor caches the last hit. */
+static int segment_map_lookup(const segment_map *map, const segment_bound **cursor, Elf32_Addr vaddr)
+{
+	const segment_bound *bound = *cursor;
+	int lo, hi, mid;
+
+	if (bound != NULL && vaddr >= bound->start && vaddr < bound->end)
+		return bound->segndx;
+
+	/* Find the last segment starting at or below vaddr */
+	lo = 0;
+	hi = map->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (map->bounds[mid].start <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return -1;
+
+	bound = map->bounds + lo - 1;
+	if (vaddr >= bound->end)
+		return -1;
+
+	*cursor = bound;
+	return bound->segndx;
+}
+
+static int _rela_sort(const void *el1, const void *el2)
+{
+	const vita_elf_rela_t *rela1 = el1, *rela2 = el2;
+	if (rela1->offset > rela2->offset)
+		return 1;
+	else if (rela1->offset < rela2->offset)
+		return -1;
+	return 0;
+}
+
+static void sort_rela_table(vita_elf_rela_table_t *rtable)
+{
+	int i;
+
+	/* Linker output is almost always sorted already; only pay for qsort when it isn't */
+	for (i = 1; i < rtable->num_relas; i++) {
+		if (rtable->relas[i].offset < rtable->relas[i - 1].offset)
+			break;
+	}
+	if (i < rtable->num_relas)
+		qsort(rtable->relas, rtable->num_relas, sizeof(vita_elf_rela_t), _rela_sort);
+}
+
+#define THUMB_SHUFFLE(x) ((((x) & 0xFFFF0000) >> 16) | (((x) & 0xFFFF) << 16))
+/* Inverse of decode_rel_target in vita-elf.c, for the relocation types whose
+ * result does not depend on where the module is loaded */
+static int encode_abs_rel_target(uint32_t *insn, int type, uint32_t value)
+{
+	uint32_t data;
+
+	switch (type) {
+		case R_ARM_ABS32:
+		case R_ARM_TARGET1:
+			*insn = value;
+			return 1;
+		case R_ARM_MOVT_ABS:
+			value >>= 16;
+			/* fallthrough */
+		case R_ARM_MOVW_ABS_NC:
+			value &= 0xFFFF;
+			*insn = (*insn & 0xFFF0F000) | ((value & 0xF000) << 4) | (value & 0xFFF);
+			return 1;
+		case R_ARM_THM_MOVT_ABS:
+			value >>= 16;
+			/* fallthrough */
+		case R_ARM_THM_MOVW_ABS_NC:
+			value &= 0xFFFF;
+			data = THUMB_SHUFFLE(*insn) & ~((0xF << 16) | (0x1 << 26) | (0x7 << 12) | 0xFF);
+			data |= (((value >> 12) & 0xF) << 16)
+				| (((value >> 11) & 0x1) << 26)
+				| (((value >> 8) & 0x7) << 12)
+				| (value & 0xFF);
+			*insn = THUMB_SHUFFLE(data);
+			return 1;
+	}
+
+	return 0;
+}
+#undef THUMB_SHUFFLE
+
+/* Writes value into the word at vaddr in section scndx as type encodes it */
+static int patch_scn_word(Elf *dest, int scndx, Elf32_Addr vaddr, int type, uint32_t value)
+{
+	Elf_Scn *scn;
+	GElf_Shdr shdr;
+	Elf_Data *data;
+	uint32_t insn;
+	Elf32_Addr data_vaddr;
+
+	ELF_ASSERT(scn = elf_getscn(dest, scndx));
+	ELF_ASSERT(gelf_getshdr(scn, &shdr));
+	if (shdr.sh_type == SHT_NOBITS)
+		FAILX("Relocation at %06x targets a NOBITS section", vaddr);
+
+	data = NULL;
+	while ((data = elf_getdata(scn, data)) != NULL) {
+		data_vaddr = shdr.sh_addr + data->d_off;
+		if (vaddr < data_vaddr || vaddr + sizeof(insn) > data_vaddr + data->d_size)
+			continue;
+
+		/* Use memcpy for unaligned relocation. */
+		memcpy(&insn, data->d_buf + (vaddr - data_vaddr), sizeof(insn));
+		insn = le32toh(insn);
+		if (!encode_abs_rel_target(&insn, type, value))
+			FAILX("Cannot statically resolve relocation type %s", elf_decode_r_type(type));
+		insn = htole32(insn);
+		memcpy(data->d_buf + (vaddr - data_vaddr), &insn, sizeof(insn));
+		return 1;
+	}
+
+	FAILX("Relocation at %06x lies outside of section %d", vaddr, scndx);
+failure:
+	return 0;
+}
+
+/* SCE relocations cannot express a target that is not inside a segment, so
+ * relocations against SHN_ABS symbols are resolved here by writing S + A into
+ * the output sections, and each patched site is returned in fixups.  For REL
+ * input the site already holds S + A, since load_rel_table takes the addend
+ * from it; for RELA input the addend comes from the relocation and the site
+ * usually holds 0.  Only the absolute relocation types are resolved.  A
+ * PC-relative reference to an absolute address depends on the load address,
+ * and an SHN_COMMON symbol has no address in a linked executable; both keep
+ * their link-time value, as they did before.  Must run before
+ * sce_elf_discard_invalid_relocs, which drops all of these relocations. */
+int sce_elf_resolve_abs_relocs(
+		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable, sce_elf_fixup_table_t *fixups)
+{
+	const vita_elf_rela_table_t *curtable;
+	const vita_elf_rela_t *vrela;
+	sce_elf_fixup_t *fixup;
+	Elf_Scn *scn;
+	GElf_Shdr shdr;
+	varray va;
+	uint32_t value, unused;
+	int i;
+
+	ASSERT(varray_init(&va, sizeof(sce_elf_fixup_t), 16));
+
+	for (curtable = rtable; curtable; curtable = curtable->next) {
+		/* Debug sections are not loaded, and --strip-debug leaves them empty */
+		ELF_ASSERT(scn = elf_getscn(ve->elf, curtable->target_ndx));
+		ELF_ASSERT(gelf_getshdr(scn, &shdr));
+		if (!(shdr.sh_flags & SHF_ALLOC))
+			continue;
+
+		for (i = 0, vrela = curtable->relas; i < curtable->num_relas; i++, vrela++) {
+			if (vrela->type == R_ARM_NONE || vrela->symbol == NULL)
+				continue;
+			if (vrela->symbol->shndx != SHN_ABS)
+				continue;
+			if (vita_elf_vaddr_to_segndx(ve, vrela->offset) == -1)
+				continue;
+
+			value = vrela->symbol->value + vrela->addend;
+			if (!encode_abs_rel_target(&unused, vrela->type, value))
+				continue;
+
+			if (!patch_scn_word(dest, curtable->target_ndx, vrela->offset, vrela->type, value))
+				goto failure;
+
+			ASSERT(fixup = varray_push(&va, NULL));
+			fixup->offset = vrela->offset;
+			fixup->type = vrela->type;
+			fixup->symbol = vrela->symbol;
+			fixup->value = value;
+		}
+	}
+
+	fixups->num_fixups = va.count;
+	fixups->fixups = varray_extract_array(&va);
+
+	return 1;
+failure:
+	varray_destroy(&va);
+	return 0;
+}
+
 /* We have to check all relocs. If any of the point to a space in ELF that is not contained in any segment,
  * we should discard this reloc. This should be done before we extend the code segment with modinfo, because otherwise
- * the invalid addresses may become valid */
+ * the invalid addresses may become valid.
+ * Each table is sorted by target offset and compacted, so that sce_elf_write_rela_sections only sees relocations
+ * it will encode and can walk the segments linearly. */
 int sce_elf_discard_invalid_relocs(const vita_elf_t *ve, vita_elf_rela_table_t *rtable) {
 	vita_elf_rela_table_t *curtable;
 	vita_elf_rela_t *vrela;
-	int i, datseg;
+	segment_map map = {0};
+	const segment_bound *cursor = NULL;
+	int i, kept;
+
+	if (!segment_map_init(&map, ve))
+		goto failure;
+
 	for (curtable = rtable; curtable; curtable = curtable->next) {
-		for (i = 0, vrela = curtable->relas; i < curtable->num_relas; i++, vrela++) {
-			if (vrela->type == R_ARM_NONE || (vrela->symbol && vrela->symbol->shndx == 0)) {
-				vrela->type = R_ARM_NONE;
+		sort_rela_table(curtable);
+
+		for (i = 0, kept = 0, vrela = curtable->relas; i < curtable->num_relas; i++, vrela++) {
+			if (vrela->type == R_ARM_NONE || (vrela->symbol && vrela->symbol->shndx == 0))
 				continue;
-			}
-			/* We skip relocations that are not real relocations 
-			 * In all current tested output, we have that the unrelocated value is correct. 
-			 * However, there is nothing that says this has to be the case. SCE RELS 
-			 * does not support ABS value relocations anymore, so there's not much 
-			 * we can do. */
-			// TODO: Consider a better solution for this.
-			if (vrela->symbol && (vrela->symbol->shndx == SHN_ABS || vrela->symbol->shndx == SHN_COMMON)) {
-				vrela->type = R_ARM_NONE;
+			/* SCE RELS does not support ABS value relocations anymore.
+			 * sce_elf_resolve_abs_relocs has already written their values into the output. */
+			if (vrela->symbol && (vrela->symbol->shndx == SHN_ABS || vrela->symbol->shndx == SHN_COMMON))
 				continue;
-			}
-			datseg = vita_elf_vaddr_to_segndx(ve, vrela->offset);
 			/* We can get -1 here for some debugging-related relocations.
 			 * These are done against debug sections that aren't mapped to any segment.
 			 * Just ignore these */
-			if (datseg == -1)
-				vrela->type = R_ARM_NONE;
+			if (segment_map_lookup(&map, &cursor, vrela->offset) == -1)
+				continue;
+
+			if (kept != i)
+				curtable->relas[kept] = *vrela;
+			kept++;
 		}
+
+		curtable->num_relas = kept;
 	}
+
+	free(map.bounds);
 	return 1;
+failure:
+	free(map.bounds);
+	return 0;
 }
 
 int sce_elf_write_rela_sections(
-		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable)
+		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable, sce_elf_rela_stats_t *stats)
 {
 	int total_relas = 0;
 	const vita_elf_rela_table_t *curtable;
@@ -841,8 +1100,10 @@ int sce_elf_write_rela_sections(
 	int relsz;
 	int i;
 	Elf32_Addr symvaddr;
-	Elf32_Word symseg, symoff;
-	Elf32_Word datseg, datoff;
+	int symseg, datseg;
+	Elf32_Word symoff, datoff;
+	segment_map map = {0};
+	const segment_bound *datcursor, *symcursor;
 	int (*sce_rel_func)(SCE_Rel *, int, int, int, int, int);
 
 	Elf_Scn *scn;
@@ -855,24 +1116,34 @@ int sce_elf_write_rela_sections(
 
 	ASSERT(encoded_relas = calloc(total_relas, 12));
 
+	/* Built after sce_elf_write_module_info so the extended segment covers the modinfo relocations */
+	if (!segment_map_init(&map, ve))
+		goto failure;
+
 	// sce_rel_func = sce_rel_short;
 	sce_rel_func = sce_rel_long;
 
 encode_relas:
 	curpos = encoded_relas;
+	datcursor = NULL;
+	symcursor = NULL;
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
 
 	for (curtable = rtable; curtable; curtable = curtable->next) {
 		for (i = 0, vrela = curtable->relas; i < curtable->num_relas; i++, vrela++) {
 			if (vrela->type == R_ARM_NONE)
 				continue;
-			datseg = vita_elf_vaddr_to_segndx(ve, vrela->offset);
+			datseg = segment_map_lookup(&map, &datcursor, vrela->offset);
+			if (datseg == -1)
+				continue;
 			datoff = vita_elf_vaddr_to_segoffset(ve, vrela->offset, datseg);
 			if (vrela->symbol) {
 				symvaddr = vrela->symbol->value + vrela->addend;
 			} else {
 				symvaddr = vrela->addend;
 			}
-			symseg = vita_elf_vaddr_to_segndx(ve, vrela->symbol ? vrela->symbol->value : vrela->addend);
+			symseg = segment_map_lookup(&map, &symcursor, vrela->symbol ? vrela->symbol->value : vrela->addend);
 			if (symseg == -1)
 				continue;
 			symoff = vita_elf_vaddr_to_segoffset(ve, symvaddr, symseg);
@@ -883,9 +1154,19 @@ encode_relas:
 			relsz = encode_sce_rel(&rel);
 			memcpy(curpos, &rel, relsz);
 			curpos += relsz;
+			if (stats) {
+				if (relsz == 8)
+					stats->num_short++;
+				else
+					stats->num_long++;
+				stats->by_type[vrela->type]++;
+			}
 		}
 	}
 
+	free(map.bounds);
+	map.bounds = NULL;
+
 	scn = elf_utils_new_scn_with_data(dest, ".sce.rel", encoded_relas, curpos - encoded_relas);
 	if (scn == NULL)
 		goto failure;
@@ -915,6 +1196,7 @@ encode_relas:
 	return 1;
 
 failure:
+	free(map.bounds);
 	free(encoded_relas);
 	return 0;
 }
@@ -970,16 +1252,123 @@ failure:
 	return 0;
 }
 
-int sce_elf_set_headers(FILE *destfile, const vita_elf_t *ve)
+int sce_elf_set_headers(void *image, const vita_elf_t *ve)
+{
+	uint16_t e_type = htole16(ET_SCE_RELEXEC);
+
+	/* Patched in the serialized image since libelf has no notion of this type */
+	memcpy(image + offsetof(Elf32_Ehdr, e_type), &e_type, sizeof(e_type));
+
+	return 1;
+}
+
+static void nid_hash_u32(SHA256_CTX *ctx, uint32_t value)
+{
+	uint8_t buf[4] = { value, value >> 8, value >> 16, value >> 24 };
+	sha256_update(ctx, buf, sizeof(buf));
+}
+
+static void nid_hash_str(SHA256_CTX *ctx, const char *s)
+{
+	if (s == NULL) {
+		nid_hash_u32(ctx, 0xFFFFFFFF);
+		return;
+	}
+	nid_hash_u32(ctx, strlen(s));
+	sha256_update(ctx, (uint8_t *)s, strlen(s));
+}
+
+static void nid_hash_stubs(SHA256_CTX *ctx, const vita_elf_stub_t *stubs, int num_stubs)
 {
-	Elf32_Ehdr ehdr;
+	int i;
+
+	nid_hash_u32(ctx, num_stubs);
+	for (i = 0; i < num_stubs; i++) {
+		nid_hash_u32(ctx, stubs[i].addr);
+		nid_hash_u32(ctx, stubs[i].library_nid);
+		nid_hash_u32(ctx, stubs[i].module_nid);
+		nid_hash_u32(ctx, stubs[i].target_nid);
+	}
+}
 
-	ehdr.e_type = htole16(ET_SCE_RELEXEC);
+static void nid_hash_symbols(SHA256_CTX *ctx, vita_export_symbol **symbols, size_t count)
+{
+	size_t i;
 
-	SYS_ASSERT(fseek(destfile, offsetof(Elf32_Ehdr, e_type), SEEK_SET));
-	SYS_ASSERT(fwrite(&ehdr.e_type, sizeof(ehdr.e_type), 1, destfile));
+	nid_hash_u32(ctx, count);
+	for (i = 0; i < count; i++) {
+		nid_hash_str(ctx, symbols[i]->name);
+		nid_hash_u32(ctx, symbols[i]->nid);
+	}
+}
 
+int sce_elf_content_nid(const vita_elf_t *ve, const vita_export_t *exports, uint32_t *nid)
+{
+	SHA256_CTX ctx;
+	GElf_Phdr phdr;
+	vita_library_export *lib;
+	uint8_t hash[32];
+	uint8_t *hash_ptr = hash;
+	size_t hash_len = sizeof(hash);
+	uint8_t *buf = NULL;
+	size_t segment_count, segndx, i, len;
+	Elf32_Word done;
+
+	ASSERT((buf = malloc(0x10000)) != NULL);
+
+	sha256_init(&ctx);
+	nid_hash_u32(&ctx, elf32_getehdr(ve->elf)->e_entry);
+
+	/* Segment contents are streamed from the file rather than mapped in whole */
+	ELF_ASSERT(elf_getphdrnum(ve->elf, &segment_count) == 0);
+	for (segndx = 0; segndx < segment_count; segndx++) {
+		ELF_ASSERT(gelf_getphdr(ve->elf, segndx, &phdr));
+		if (phdr.p_type != PT_LOAD)
+			continue;
+
+		nid_hash_u32(&ctx, phdr.p_vaddr);
+		nid_hash_u32(&ctx, phdr.p_memsz);
+		nid_hash_u32(&ctx, phdr.p_filesz);
+		nid_hash_u32(&ctx, phdr.p_flags);
+
+		SYS_ASSERT(fseek(ve->file, phdr.p_offset, SEEK_SET));
+		for (done = 0; done < phdr.p_filesz; done += len) {
+			len = phdr.p_filesz - done;
+			if (len > 0x10000)
+				len = 0x10000;
+			ASSERT(fread(buf, 1, len, ve->file) == len);
+			sha256_update(&ctx, buf, len);
+		}
+	}
+
+	nid_hash_stubs(&ctx, ve->fstubs, ve->num_fstubs);
+	nid_hash_stubs(&ctx, ve->vstubs, ve->num_vstubs);
+
+	sha256_update(&ctx, (uint8_t *)exports->name, sizeof(exports->name));
+	nid_hash_u32(&ctx, exports->ver_major);
+	nid_hash_u32(&ctx, exports->ver_minor);
+	nid_hash_u32(&ctx, exports->attributes);
+	nid_hash_str(&ctx, exports->start);
+	nid_hash_str(&ctx, exports->stop);
+	nid_hash_str(&ctx, exports->exit);
+	nid_hash_u32(&ctx, exports->module_n);
+	for (i = 0; i < exports->module_n; i++) {
+		lib = exports->modules[i];
+		nid_hash_str(&ctx, lib->name);
+		nid_hash_u32(&ctx, lib->syscall);
+		nid_hash_u32(&ctx, lib->nid);
+		nid_hash_symbols(&ctx, lib->functions, lib->function_n);
+		nid_hash_symbols(&ctx, lib->variables, lib->variable_n);
+	}
+
+	sha256_final(&ctx, hash);
+	free(buf);
+
+	/* Folded the same way as the whole-file NID */
+	*nid = sha256_32_vector(1, &hash_ptr, &hash_len);
 	return 1;
+
 failure:
+	free(buf);
 	return 0;
 }
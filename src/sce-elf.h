@@ -2,6 +2,7 @@
 #define SCE_ELF_H
 
 #include "vita-elf.h"
+#include "vita-export.h"
 
 /* SCE-specific definitions for e_type: */
 #define ET_SCE_EXEC		0xFE00		/* SCE Executable file */
@@ -81,6 +82,26 @@ typedef struct {
 	Elf32_Word sceVStub_rodata;		/* The imported function NID arrays */
 } sce_section_sizes_t;
 
+/* A relocation against an SHN_ABS symbol, resolved at conversion time */
+typedef struct {
+	Elf32_Addr offset;			/* Patched site */
+	uint8_t type;				/* Original relocation type */
+	const vita_elf_symbol_t *symbol;
+	Elf32_Word value;			/* S + A, as written */
+} sce_elf_fixup_t;
+
+typedef struct {
+	sce_elf_fixup_t *fixups;
+	int num_fixups;
+} sce_elf_fixup_table_t;
+
+/* Optional counters filled in by sce_elf_write_rela_sections */
+typedef struct {
+	int num_short;
+	int num_long;
+	int by_type[256];			/* Encoded relocations, indexed by R_ARM_* type */
+} sce_elf_rela_stats_t;
+
 sce_module_info_t *sce_elf_module_info_create(vita_elf_t *ve, vita_export_t *exports);
 
 int sce_elf_module_info_get_size(sce_module_info_t *module_info, sce_section_sizes_t *sizes);
@@ -94,15 +115,23 @@ void *sce_elf_module_info_encode(
 int sce_elf_write_module_info(
 		Elf *dest, const vita_elf_t *ve, const sce_section_sizes_t *sizes, void *module_info);
 
+int sce_elf_resolve_abs_relocs(
+		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable, sce_elf_fixup_table_t *fixups);
+
 int sce_elf_discard_invalid_relocs(const vita_elf_t *ve, vita_elf_rela_table_t *rtable);
 
 int sce_elf_write_rela_sections(
-		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable);
+		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable, sce_elf_rela_stats_t *stats);
 
 int sce_elf_rewrite_stubs(Elf *dest, const vita_elf_t *ve);
 
-int sce_elf_set_headers(FILE *outfile, const vita_elf_t *ve);
+int sce_elf_set_headers(void *image, const vita_elf_t *ve);
+
+/* Derives a module NID from what ends up in the loaded module: the loadable
+ * segments, the import stubs and the export spec (apart from its own NID).
+ * Unlike hashing the whole file, it does not change with debug info. */
+int sce_elf_content_nid(const vita_elf_t *ve, const vita_export_t *exports, uint32_t *nid);
 
-const uint32_t sce_elf_stub_func[3];
+extern const uint32_t sce_elf_stub_func[3];
 
 #endif
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sfo.h"
+
+#define SFO_MAGIC	0x46535000
+#define SFO_VERSION	0x00000101
+
+#define SFO_HEADER_LEN	20
+#define SFO_ENTRY_LEN	16
+
+typedef struct {
+	char *key;
+	int type;
+	uint32_t value;		/* SFO_TYPE_INT: the value; SFO_TYPE_STR: bytes reserved, 0 to fit */
+	char *data;
+} sfo_entry;
+
+struct sfo {
+	sfo_entry *entries;
+	int count;
+	int allocation;
+
+	int *index;		/* Open-addressed by key: entry index + 1, 0 if free */
+	int index_size;		/* Power of two, at least twice count */
+};
+
+static const struct {
+	const char *key;
+	int type;
+	uint32_t value;
+	const char *data;
+} sfo_defaults[] = {
+	{ "APP_VER", SFO_TYPE_STR, 0, "00.00" },
+	{ "ATTRIBUTE", SFO_TYPE_INT, 0x8000, NULL },
+	{ "ATTRIBUTE2", SFO_TYPE_INT, 0, NULL },
+	{ "ATTRIBUTE_MINOR", SFO_TYPE_INT, 0x10, NULL },
+	{ "BOOT_FILE", SFO_TYPE_STR, 32, "" },
+	{ "CATEGORY", SFO_TYPE_STR, 0, "gd" },
+	{ "CONTENT_ID", SFO_TYPE_STR, 48, "" },
+	{ "EBOOT_APP_MEMSIZE", SFO_TYPE_INT, 0, NULL },
+	{ "EBOOT_ATTRIBUTE", SFO_TYPE_INT, 0, NULL },
+	{ "EBOOT_PHY_MEMSIZE", SFO_TYPE_INT, 0, NULL },
+	{ "LAREA_TYPE", SFO_TYPE_INT, 0, NULL },
+	{ "NP_COMMUNICATION_ID", SFO_TYPE_STR, 16, "" },
+	{ "PARENTAL_LEVEL", SFO_TYPE_INT, 0, NULL },
+	{ "PSP2_DISP_VER", SFO_TYPE_STR, 0, "00.000" },
+	{ "PSP2_SYSTEM_VER", SFO_TYPE_INT, 0, NULL },
+	{ "STITLE", SFO_TYPE_STR, 52, "Homebrew" },
+	{ "TITLE", SFO_TYPE_STR, 0x80, "Homebrew" },
+	{ "TITLE_ID", SFO_TYPE_STR, 0, "ABCD99999" },
+	{ "VERSION", SFO_TYPE_STR, 0, "00.00" },
+};
+
+static uint32_t key_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*key)
+		hash = (hash ^ (unsigned char)*key++) * 16777619u;
+
+	return hash;
+}
+
+/* Returns the index slot holding key, or the free slot where it would go */
+static int *index_slot(const sfo_t *sfo, const char *key)
+{
+	int mask = sfo->index_size - 1;
+	int i = key_hash(key) & mask;
+
+	while (sfo->index[i] && strcmp(sfo->entries[sfo->index[i] - 1].key, key) != 0)
+		i = (i + 1) & mask;
+
+	return &sfo->index[i];
+}
+
+static int index_rebuild(sfo_t *sfo, int size)
+{
+	int *index = calloc(size, sizeof(int));
+	int i;
+
+	if (!index)
+		return 0;
+
+	free(sfo->index);
+	sfo->index = index;
+	sfo->index_size = size;
+
+	for (i = 0; i < sfo->count; i++)
+		*index_slot(sfo, sfo->entries[i].key) = i + 1;
+
+	return 1;
+}
+
+sfo_t *sfo_new(int defaults)
+{
+	sfo_t *sfo = calloc(1, sizeof(sfo_t));
+	sfo_entry *entry;
+	int i, count = sizeof(sfo_defaults) / sizeof(sfo_defaults[0]);
+
+	if (!sfo)
+		return NULL;
+
+	if (!index_rebuild(sfo, 64))
+		goto failure;
+
+	if (!defaults)
+		return sfo;
+
+	if ((sfo->entries = calloc(count, sizeof(sfo_entry))) == NULL)
+		goto failure;
+	sfo->allocation = count;
+
+	for (i = 0; i < count; i++) {
+		entry = &sfo->entries[i];
+		entry->type = sfo_defaults[i].type;
+		entry->value = sfo_defaults[i].value;
+		if ((entry->key = strdup(sfo_defaults[i].key)) == NULL)
+			goto failure;
+		if (sfo_defaults[i].data && (entry->data = strdup(sfo_defaults[i].data)) == NULL)
+			goto failure;
+		sfo->count++;
+		*index_slot(sfo, entry->key) = i + 1;
+	}
+
+	return sfo;
+failure:
+	sfo_free(sfo);
+	return NULL;
+}
+
+sfo_t *sfo_copy(const sfo_t *sfo)
+{
+	sfo_t *copy = calloc(1, sizeof(sfo_t));
+	sfo_entry *entry;
+	int i;
+
+	if (!copy)
+		return NULL;
+
+	if ((copy->entries = calloc(sfo->allocation ? sfo->allocation : 1, sizeof(sfo_entry))) == NULL)
+		goto failure;
+	copy->allocation = sfo->allocation;
+
+	for (i = 0; i < sfo->count; i++) {
+		entry = &copy->entries[i];
+		*entry = sfo->entries[i];
+		entry->key = NULL;
+		entry->data = NULL;
+		copy->count++;
+		if ((entry->key = strdup(sfo->entries[i].key)) == NULL)
+			goto failure;
+		if (sfo->entries[i].data && (entry->data = strdup(sfo->entries[i].data)) == NULL)
+			goto failure;
+	}
+
+	if ((copy->index = malloc(sfo->index_size * sizeof(int))) == NULL)
+		goto failure;
+	memcpy(copy->index, sfo->index, sfo->index_size * sizeof(int));
+	copy->index_size = sfo->index_size;
+
+	return copy;
+failure:
+	sfo_free(copy);
+	return NULL;
+}
+
+void sfo_free(sfo_t *sfo)
+{
+	int i;
+
+	if (!sfo)
+		return;
+
+	for (i = 0; i < sfo->count; i++) {
+		free(sfo->entries[i].key);
+		free(sfo->entries[i].data);
+	}
+
+	free(sfo->entries);
+	free(sfo->index);
+	free(sfo);
+}
+
+/* Returns the entry for key, added with no value if it is new */
+static sfo_entry *sfo_lookup(sfo_t *sfo, const char *key)
+{
+	sfo_entry *entries, *entry;
+	int *slot;
+
+	slot = index_slot(sfo, key);
+	if (*slot)
+		return &sfo->entries[*slot - 1];
+
+	if (sfo->count == sfo->allocation) {
+		entries = realloc(sfo->entries, (sfo->allocation ? sfo->allocation * 2 : 32) * sizeof(sfo_entry));
+		if (!entries)
+			return NULL;
+		sfo->entries = entries;
+		sfo->allocation = sfo->allocation ? sfo->allocation * 2 : 32;
+	}
+
+	entry = &sfo->entries[sfo->count];
+	memset(entry, 0, sizeof(*entry));
+	if ((entry->key = strdup(key)) == NULL)
+		return NULL;
+	sfo->count++;
+
+	if (sfo->count * 2 > sfo->index_size) {
+		if (!index_rebuild(sfo, sfo->index_size * 2)) {
+			free(entry->key);
+			sfo->count--;
+			return NULL;
+		}
+	} else {
+		*slot = sfo->count;
+	}
+
+	return entry;
+}
+
+int sfo_set_string(sfo_t *sfo, const char *key, const char *value)
+{
+	sfo_entry *entry = sfo_lookup(sfo, key);
+	char *data;
+
+	if (!entry || (data = strdup(value)) == NULL)
+		return 0;
+
+	if (entry->type != SFO_TYPE_STR) {
+		entry->type = SFO_TYPE_STR;
+		entry->value = 0;
+	}
+
+	free(entry->data);
+	entry->data = data;
+	return 1;
+}
+
+int sfo_set_int(sfo_t *sfo, const char *key, uint32_t value)
+{
+	sfo_entry *entry = sfo_lookup(sfo, key);
+
+	if (!entry)
+		return 0;
+
+	free(entry->data);
+	entry->data = NULL;
+	entry->type = SFO_TYPE_INT;
+	entry->value = value;
+	return 1;
+}
+
+int sfo_set_title(sfo_t *sfo, const char *title)
+{
+	return sfo_set_string(sfo, "TITLE", title) && sfo_set_string(sfo, "STITLE", title);
+}
+
+int sfo_set_assignment(sfo_t *sfo, const char *assignment, int type)
+{
+	const char *equals = strchr(assignment, '=');
+	char *key;
+	int ok;
+
+	if (equals == NULL) {
+		fprintf(stderr, "Invalid option (no =)\n");
+		return 0;
+	}
+
+	if ((key = malloc(equals - assignment + 1)) == NULL)
+		return 0;
+	memcpy(key, assignment, equals - assignment);
+	key[equals - assignment] = '\0';
+
+	if (type == SFO_TYPE_INT)
+		ok = sfo_set_int(sfo, key, strtoul(equals + 1, NULL, 0));
+	else
+		ok = sfo_set_string(sfo, key, equals + 1);
+
+	free(key);
+	return ok;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+/* Space an entry takes in the data table; *valsize gets how much is used */
+static uint32_t entry_totalsize(const sfo_entry *entry, uint32_t *valsize)
+{
+	*valsize = entry->data ? strlen(entry->data) + 1 : 0;
+
+	if (entry->type == SFO_TYPE_INT) {
+		*valsize = 4;
+		return 4;
+	}
+
+	return entry->value ? entry->value : (*valsize + 3) & ~3;
+}
+
+int sfo_build(const sfo_t *sfo, void **data, size_t *size)
+{
+	const sfo_entry *entry;
+	uint8_t *buf, *e, *k, *d;
+	uint32_t valsize, totalsize;
+	size_t keys_len = 0, data_len = 0, keyofs;
+	int i;
+
+	for (i = 0; i < sfo->count; i++) {
+		keys_len += strlen(sfo->entries[i].key) + 1;
+		data_len += entry_totalsize(&sfo->entries[i], &valsize);
+	}
+
+	/* Key offsets are 16 bits wide */
+	if (keys_len > 0xFFFF) {
+		fprintf(stderr, "Too many keys for a param.sfo\n");
+		return 0;
+	}
+
+	keyofs = SFO_HEADER_LEN + sfo->count * SFO_ENTRY_LEN;
+	keys_len = (keys_len + 3) & ~3;
+	*size = keyofs + keys_len + data_len;
+
+	if ((buf = calloc(1, *size)) == NULL)
+		return 0;
+
+	put32(buf + 0, SFO_MAGIC);
+	put32(buf + 4, SFO_VERSION);
+	put32(buf + 8, keyofs);
+	put32(buf + 12, keyofs + keys_len);
+	put32(buf + 16, sfo->count);
+
+	e = buf + SFO_HEADER_LEN;
+	k = buf + keyofs;
+	d = k + keys_len;
+	for (i = 0; i < sfo->count; i++, e += SFO_ENTRY_LEN) {
+		entry = &sfo->entries[i];
+		totalsize = entry_totalsize(entry, &valsize);
+		if (valsize > totalsize)
+			valsize = totalsize;	/* Cut to the space reserved, still terminated */
+
+		put16(e + 0, k - (buf + keyofs));
+		e[2] = 4;
+		e[3] = entry->type;
+		put32(e + 4, valsize);
+		put32(e + 8, totalsize);
+		put32(e + 12, d - (buf + keyofs + keys_len));
+
+		strcpy((char *)k, entry->key);
+		k += strlen(entry->key) + 1;
+
+		if (entry->type == SFO_TYPE_INT)
+			put32(d, entry->value);
+		else if (valsize)
+			memcpy(d, entry->data, valsize - 1);
+		d += totalsize;
+	}
+
+	*data = buf;
+	return 1;
+}
+
+int sfo_write(const sfo_t *sfo, const char *path)
+{
+	void *data;
+	size_t size;
+	FILE *fp;
+	int ok;
+
+	if (!sfo_build(sfo, &data, &size)) {
+		fprintf(stderr, "Cannot build %s\n", path);
+		return 0;
+	}
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open filename %s: %s\n", path, strerror(errno));
+		free(data);
+		return 0;
+	}
+
+	ok = fwrite(data, size, 1, fp) == 1;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok)
+		fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+
+	free(data);
+	return ok;
+}
@@ -0,0 +1,44 @@
+#ifndef SFO_H
+#define SFO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SFO_TYPE_BIN	0
+#define SFO_TYPE_STR	2
+#define SFO_TYPE_INT	4
+
+/* A param.sfo being put together: keys in the order they were first set,
+ * indexed by name */
+typedef struct sfo sfo_t;
+
+/* Returns a new sfo, holding the keys every homebrew needs if defaults is
+ * set, or NULL if out of memory */
+sfo_t *sfo_new(int defaults);
+
+/* Returns an independent copy of sfo, to derive variants from a base */
+sfo_t *sfo_copy(const sfo_t *sfo);
+
+void sfo_free(sfo_t *sfo);
+
+/* Sets key to a string or integer, adding it after the others if it is new.
+ * A string key that already exists keeps the space reserved for it.
+ * Return 0 if out of memory. */
+int sfo_set_string(sfo_t *sfo, const char *key, const char *value);
+int sfo_set_int(sfo_t *sfo, const char *key, uint32_t value);
+
+/* Sets both TITLE and STITLE */
+int sfo_set_title(sfo_t *sfo, const char *title);
+
+/* Applies NAME=VALUE as a SFO_TYPE_STR or SFO_TYPE_INT key, the latter in
+ * any base strtoul accepts.  Returns 0 and prints why if it is malformed. */
+int sfo_set_assignment(sfo_t *sfo, const char *assignment, int type);
+
+/* Lays sfo out in a malloc'd buffer.  Returns 0 if out of memory or if the
+ * keys do not fit the format. */
+int sfo_build(const sfo_t *sfo, void **data, size_t *size);
+
+/* sfo_build to a file; returns 0 and prints why on failure */
+int sfo_write(const sfo_t *sfo, const char *path);
+
+#endif
@@ -1,8 +1,39 @@
 #include "sha256.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__) && !defined(__clang__)
+#define SHA256_ARM 1
+#define SHA256_ARM_TARGET __attribute__((target("+crypto")))
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define SHA256_ARM 1
+#define SHA256_ARM_TARGET
+#endif
+
+#if SHA256_ARM
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
 
 #define READ_BUFFER	(1*1024*1024)
+#define MAP_CHUNK	(1024*1024*1024)	/* sha256_update takes a 32-bit length */
 
 uint32_t k[64] = {
    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
@@ -17,46 +48,199 @@ uint32_t k[64] = {
 
 
 
-void sha256_transform(SHA256_CTX *ctx, uint8_t data[])
-{  
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const uint8_t *data, size_t nblocks);
+
+static void sha256_blocks_generic(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
    uint32_t a,b,c,d,e,f,g,h,i,j,t1,t2,m[64];
-      
-   for (i=0,j=0; i < 16; ++i, j += 4)
-      m[i] = (data[j] << 24) | (data[j+1] << 16) | (data[j+2] << 8) | (data[j+3]);
-   for ( ; i < 64; ++i)
-      m[i] = SIG1(m[i-2]) + m[i-7] + SIG0(m[i-15]) + m[i-16];
-
-   a = ctx->state[0];
-   b = ctx->state[1];
-   c = ctx->state[2];
-   d = ctx->state[3];
-   e = ctx->state[4];
-   f = ctx->state[5];
-   g = ctx->state[6];
-   h = ctx->state[7];
-   
-   for (i = 0; i < 64; ++i) {
-      t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-      t2 = EP0(a) + MAJ(a,b,c);
-      h = g;
-      g = f;
-      f = e;
-      e = d + t1;
-      d = c;
-      c = b;
-      b = a;
-      a = t1 + t2;
+
+   for ( ; nblocks > 0; --nblocks, data += 64) {
+      for (i=0,j=0; i < 16; ++i, j += 4)
+         m[i] = (data[j] << 24) | (data[j+1] << 16) | (data[j+2] << 8) | (data[j+3]);
+      for ( ; i < 64; ++i)
+         m[i] = SIG1(m[i-2]) + m[i-7] + SIG0(m[i-15]) + m[i-16];
+
+      a = state[0];
+      b = state[1];
+      c = state[2];
+      d = state[3];
+      e = state[4];
+      f = state[5];
+      g = state[6];
+      h = state[7];
+
+      for (i = 0; i < 64; ++i) {
+         t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
+         t2 = EP0(a) + MAJ(a,b,c);
+         h = g;
+         g = f;
+         f = e;
+         e = d + t1;
+         d = c;
+         c = b;
+         b = a;
+         a = t1 + t2;
+      }
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+      state[5] += f;
+      state[6] += g;
+      state[7] += h;
    }
-   
-   ctx->state[0] += a;
-   ctx->state[1] += b;
-   ctx->state[2] += c;
-   ctx->state[3] += d;
-   ctx->state[4] += e;
-   ctx->state[5] += f;
-   ctx->state[6] += g;
-   ctx->state[7] += h;
-}  
+}
+
+#if SHA256_X86
+/* Intel SHA extensions; two rounds per sha256rnds2, state kept as ABEF/CDGH */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+   const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+   __m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+   int g;
+
+   tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+   state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+   tmp = _mm_shuffle_epi32(tmp, 0xB1);
+   state1 = _mm_shuffle_epi32(state1, 0x1B);
+   state0 = _mm_alignr_epi8(tmp, state1, 8);
+   state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+   for ( ; nblocks > 0; --nblocks, data += 64) {
+      abef = state0;
+      cdgh = state1;
+
+      for (g = 0; g < 4; g++)
+         w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * g)), mask);
+
+      for (g = 0; g < 16; g++) {
+         msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i *)&k[4 * g]));
+         state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+         if (g >= 3 && g < 15) {
+            tmp = _mm_alignr_epi8(w[g & 3], w[(g - 1) & 3], 4);
+            w[(g + 1) & 3] = _mm_add_epi32(w[(g + 1) & 3], tmp);
+            w[(g + 1) & 3] = _mm_sha256msg2_epu32(w[(g + 1) & 3], w[g & 3]);
+         }
+         msg = _mm_shuffle_epi32(msg, 0x0E);
+         state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+         if (g >= 1 && g < 13)
+            w[(g - 1) & 3] = _mm_sha256msg1_epu32(w[(g - 1) & 3], w[g & 3]);
+      }
+
+      state0 = _mm_add_epi32(state0, abef);
+      state1 = _mm_add_epi32(state1, cdgh);
+   }
+
+   tmp = _mm_shuffle_epi32(state0, 0x1B);
+   state1 = _mm_shuffle_epi32(state1, 0xB1);
+   state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+   state1 = _mm_alignr_epi8(state1, tmp, 8);
+   _mm_storeu_si128((__m128i *)&state[0], state0);
+   _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static int cpu_has_shani(void)
+{
+   unsigned int eax, ebx, ecx, edx;
+
+   if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+      return 0;
+   if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))   /* SSSE3, SSE4.1 */
+      return 0;
+   if (__get_cpuid_max(0, NULL) < 7)
+      return 0;
+   __cpuid_count(7, 0, eax, ebx, ecx, edx);
+   return (ebx >> 29) & 1;                         /* SHA */
+}
+#endif
+
+#if SHA256_ARM
+/* ARMv8 cryptography extensions; four rounds per sha256h/sha256h2 pair */
+SHA256_ARM_TARGET
+static void sha256_blocks_armv8(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+   uint32x4_t state0, state1, abcd, efgh, tmp0, tmp1, w[4];
+   int g;
+
+   state0 = vld1q_u32(&state[0]);
+   state1 = vld1q_u32(&state[4]);
+
+   for ( ; nblocks > 0; --nblocks, data += 64) {
+      abcd = state0;
+      efgh = state1;
+
+      for (g = 0; g < 4; g++)
+         w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * g)));
+
+      for (g = 0; g < 16; g++) {
+         tmp0 = vaddq_u32(w[g & 3], vld1q_u32(&k[4 * g]));
+         if (g < 12)
+            w[g & 3] = vsha256su1q_u32(vsha256su0q_u32(w[g & 3], w[(g + 1) & 3]),
+                  w[(g + 2) & 3], w[(g + 3) & 3]);
+         tmp1 = state0;
+         state0 = vsha256hq_u32(state0, state1, tmp0);
+         state1 = vsha256h2q_u32(state1, tmp1, tmp0);
+      }
+
+      state0 = vaddq_u32(state0, abcd);
+      state1 = vaddq_u32(state1, efgh);
+   }
+
+   vst1q_u32(&state[0], state0);
+   vst1q_u32(&state[4], state1);
+}
+
+static int cpu_has_armv8_sha2(void)
+{
+#if defined(__linux__) && defined(HWCAP_SHA2)
+   return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+   return 1;   /* The target guarantees the extension */
+#else
+   return 0;   /* No way to ask, and cores such as the Cortex-A72 lack it */
+#endif
+}
+#endif
+
+#ifdef __GNUC__
+#define LOAD_RELAXED(var)		__atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define STORE_RELAXED(var, value)	__atomic_store_n(&(var), (value), __ATOMIC_RELAXED)
+#else
+#define LOAD_RELAXED(var)		(var)
+#define STORE_RELAXED(var, value)	((var) = (value))
+#endif
+
+static sha256_blocks_fn sha256_blocks;
+
+static sha256_blocks_fn sha256_select_blocks(void)
+{
+   sha256_blocks_fn fn = LOAD_RELAXED(sha256_blocks);
+
+   if (fn)
+      return fn;
+
+   fn = sha256_blocks_generic;
+#if SHA256_X86
+   if (cpu_has_shani())
+      fn = sha256_blocks_shani;
+#endif
+#if SHA256_ARM
+   if (cpu_has_armv8_sha2())
+      fn = sha256_blocks_armv8;
+#endif
+   /* Every thread computes the same value, so which store wins does not
+    * matter; the atomics only keep concurrent first calls well defined */
+   STORE_RELAXED(sha256_blocks, fn);
+   return fn;
+}
+
+void sha256_transform(SHA256_CTX *ctx, uint8_t data[])
+{
+   sha256_select_blocks()(ctx->state, data, 1);
+}
 
 void sha256_init(SHA256_CTX *ctx)
 {  
@@ -75,17 +259,38 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, uint8_t data[], uint32_t len)
 {  
-   uint32_t i;
-   
-   for (i=0; i < len; ++i) { 
-      ctx->data[ctx->datalen] = data[i]; 
-      ctx->datalen++; 
-      if (ctx->datalen == 64) { 
-         sha256_transform(ctx,ctx->data);
-         DBL_INT_ADD(ctx->bitlen[0],ctx->bitlen[1],512); 
-         ctx->datalen = 0; 
-      }  
-   }  
+   sha256_blocks_fn blocks = sha256_select_blocks();
+   uint32_t fill, nblocks, i;
+
+   // Top up a partially filled block first
+   if (ctx->datalen > 0) {
+      fill = 64 - ctx->datalen;
+      if (fill > len)
+         fill = len;
+      memcpy(ctx->data + ctx->datalen, data, fill);
+      ctx->datalen += fill;
+      data += fill;
+      len -= fill;
+      if (ctx->datalen < 64)
+         return;
+      blocks(ctx->state, ctx->data, 1);
+      DBL_INT_ADD(ctx->bitlen[0],ctx->bitlen[1],512);
+      ctx->datalen = 0;
+   }
+
+   // Whole blocks straight from the input
+   nblocks = len / 64;
+   if (nblocks > 0) {
+      blocks(ctx->state, data, nblocks);
+      for (i = 0; i < nblocks; i++) {
+         DBL_INT_ADD(ctx->bitlen[0],ctx->bitlen[1],512);
+      }
+      data += nblocks * 64;
+      len -= nblocks * 64;
+   }
+
+   memcpy(ctx->data, data, len);
+   ctx->datalen = len;
 }  
 
 void sha256_final(SHA256_CTX *ctx, uint8_t hash[])
@@ -253,25 +458,73 @@ uint32_t sha256_32_vector(size_t num_elem, uint8_t *addr[],  size_t *len)
 	return (hash[0] << 24) | (hash[1] << 16) | (hash[2] << 8) | hash[3];
 }
 
-int sha256_file(const char *file, uint8_t *mac)
+static int sha256_file_read(FILE *fp, SHA256_CTX *ctx)
 {
 	size_t read = 0;
-	SHA256_CTX ctx;
-	FILE *fp = fopen(file, "rb");
-	
-	if (!fp)
-		return -1;
-	
 	uint8_t *data = malloc(READ_BUFFER);
-	
-	sha256_init(&ctx);
-	
+
+	if (!data)
+		return -1;
+
 	while ((read = fread(data, 1, READ_BUFFER, fp)) > 0) {
-		sha256_update(&ctx, data, read);
+		sha256_update(ctx, data, read);
 	}
-	
-    sha256_final(&ctx, mac);
+
 	free(data);
+	return ferror(fp) ? -1 : 0;
+}
+
+int sha256_file(const char *file, uint8_t *mac)
+{
+	SHA256_CTX ctx;
+	FILE *fp;
+	int ret;
+
+	sha256_init(&ctx);
+
+#ifndef _WIN32
+	// Map the whole file when possible, which saves copying it through a buffer
+	struct stat st;
+	uint8_t *map;
+	size_t off, len;
+	int fd = open(file, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			for (off = 0; off < (size_t)st.st_size; off += len) {
+				len = st.st_size - off;
+				if (len > MAP_CHUNK)
+					len = MAP_CHUNK;
+				sha256_update(&ctx, map + off, len);
+			}
+			munmap(map, st.st_size);
+			close(fd);
+			sha256_final(&ctx, mac);
+			return 0;
+		}
+	}
+
+	fp = fdopen(fd, "rb");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+#else
+	fp = fopen(file, "rb");
+	if (!fp)
+		return -1;
+#endif
+
+	ret = sha256_file_read(fp, &ctx);
 	fclose(fp);
+	if (ret < 0)
+		return -1;
+
+	sha256_final(&ctx, mac);
 	return 0;
 }
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stub-archive.h"
+
+#define EM_ARM			40
+#define EF_ARM_EABI_VER5	0x05000000
+
+#define SHT_PROGBITS		1
+#define SHT_SYMTAB		2
+#define SHT_STRTAB		3
+#define SHT_ARM_ATTRIBUTES	0x70000003
+
+#define SHF_WRITE		0x1
+#define SHF_ALLOC		0x2
+#define SHF_EXECINSTR		0x4
+
+#define STB_LOCAL		0
+#define STB_GLOBAL		1
+#define STT_NOTYPE		0
+#define STT_OBJECT		1
+#define STT_FUNC		2
+
+#define EHDR_LEN		52
+#define SHDR_LEN		40
+#define SYM_LEN			16
+
+/* Sections of a stub object, in the order they come in the file */
+enum {
+	SEC_NULL,
+	SEC_STUB,
+	SEC_ATTRIBUTES,
+	SEC_SYMTAB,
+	SEC_STRTAB,
+	SEC_SHSTRTAB,
+	SEC_COUNT
+};
+
+#define STUB_OFFSET		0x40
+#define STUB_LEN		16
+#define ATTRIBUTES_OFFSET	(STUB_OFFSET + STUB_LEN)
+#define SYMTAB_OFFSET		0x70
+#define SYMTAB_LEN		(3 * SYM_LEN)
+#define STRTAB_OFFSET		(SYMTAB_OFFSET + SYMTAB_LEN)
+
+#define AR_MAGIC		"!<arch>\n"
+#define AR_HEADER_LEN		60
+
+/* What .arch armv7a leaves in .ARM.attributes */
+static const uint8_t attributes[] = {
+	'A', 0x1c, 0, 0, 0, 'a', 'e', 'a', 'b', 'i', 0,
+	0x01, 0x12, 0, 0, 0,
+	0x05, '7', '-', 'A', 0,		/* Tag_CPU_name */
+	0x06, 0x0a,			/* Tag_CPU_arch: v7 */
+	0x07, 'A',			/* Tag_CPU_arch_profile: Application */
+	0x08, 0x01,			/* Tag_ARM_ISA_use */
+	0x09, 0x02,			/* Tag_THUMB_ISA_use: Thumb-2 */
+};
+
+/* Both stub sections have names of the same length, so the offsets hold */
+static const char shstrtab_fstubs[] = "\0.vitalink.fstubs\0.ARM.attributes\0.symtab\0.strtab\0.shstrtab";
+static const char shstrtab_vstubs[] = "\0.vitalink.vstubs\0.ARM.attributes\0.symtab\0.strtab\0.shstrtab";
+
+#define SHSTRTAB_LEN		sizeof(shstrtab_fstubs)
+#define SHSTR_STUB		1
+#define SHSTR_ATTRIBUTES	18
+#define SHSTR_SYMTAB		34
+#define SHSTR_STRTAB		42
+#define SHSTR_SHSTRTAB		50
+
+typedef struct {
+	char *name;
+	char *symbol;		/* Same allocation as name */
+	int is_variable;
+	uint32_t nids[3];
+} stub_member;
+
+struct stub_archive {
+	stub_member *members;
+	int count;
+	int allocation;
+};
+
+stub_archive_t *stub_archive_new(void)
+{
+	return calloc(1, sizeof(stub_archive_t));
+}
+
+void stub_archive_free(stub_archive_t *ar)
+{
+	int i;
+
+	if (!ar)
+		return;
+
+	for (i = 0; i < ar->count; i++)
+		free(ar->members[i].name);
+
+	free(ar->members);
+	free(ar);
+}
+
+int stub_archive_add(stub_archive_t *ar, const char *name, const char *symbol, int is_variable,
+		uint32_t library_nid, uint32_t module_nid, uint32_t target_nid)
+{
+	stub_member *members, *member;
+	size_t name_len = strlen(name) + 1, symbol_len = strlen(symbol) + 1;
+
+	if (ar->count == ar->allocation) {
+		members = realloc(ar->members, (ar->allocation ? ar->allocation * 2 : 64) * sizeof(stub_member));
+		if (!members)
+			return 0;
+		ar->members = members;
+		ar->allocation = ar->allocation ? ar->allocation * 2 : 64;
+	}
+
+	member = &ar->members[ar->count];
+	if ((member->name = malloc(name_len + symbol_len)) == NULL)
+		return 0;
+	member->symbol = member->name + name_len;
+	memcpy(member->name, name, name_len);
+	memcpy(member->symbol, symbol, symbol_len);
+	member->is_variable = is_variable;
+	member->nids[0] = library_nid;
+	member->nids[1] = module_nid;
+	member->nids[2] = target_nid;
+	ar->count++;
+
+	return 1;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put32be(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static size_t shstrtab_offset(const stub_member *member)
+{
+	return STRTAB_OFFSET + 4 + strlen(member->symbol) + 1;
+}
+
+static size_t shdr_offset(const stub_member *member)
+{
+	return (shstrtab_offset(member) + SHSTRTAB_LEN + 3) & ~3;
+}
+
+static size_t object_size(const stub_member *member)
+{
+	return shdr_offset(member) + SEC_COUNT * SHDR_LEN;
+}
+
+static void put_shdr(uint8_t *p, uint32_t name, uint32_t type, uint32_t flags, uint32_t offset,
+		uint32_t size, uint32_t link, uint32_t info, uint32_t align, uint32_t entsize)
+{
+	put32(p + 0, name);
+	put32(p + 4, type);
+	put32(p + 8, flags);
+	put32(p + 12, 0);	/* sh_addr */
+	put32(p + 16, offset);
+	put32(p + 20, size);
+	put32(p + 24, link);
+	put32(p + 28, info);
+	put32(p + 32, align);
+	put32(p + 36, entsize);
+}
+
+static void put_sym(uint8_t *p, uint32_t name, int bind, int type, uint16_t shndx)
+{
+	put32(p + 0, name);
+	put32(p + 4, 0);	/* st_value */
+	put32(p + 8, 0);	/* st_size */
+	p[12] = (bind << 4) | type;
+	p[13] = 0;
+	put16(p + 14, shndx);
+}
+
+/* Lays out the object for member in buf, object_size(member) bytes */
+static void build_object(const stub_member *member, uint8_t *buf)
+{
+	size_t symbol_len = strlen(member->symbol) + 1;
+	size_t strtab_len = 4 + symbol_len;
+	size_t shstr_offset = shstrtab_offset(member), sh_offset = shdr_offset(member);
+	uint8_t *shdr = buf + sh_offset;
+	uint8_t *stub = buf + STUB_OFFSET;
+
+	memset(buf, 0, object_size(member));
+
+	memcpy(buf, "\177ELF", 4);
+	buf[4] = 1;	/* ELFCLASS32 */
+	buf[5] = 1;	/* ELFDATA2LSB */
+	buf[6] = 1;	/* EV_CURRENT */
+	put16(buf + 16, 1);	/* ET_REL */
+	put16(buf + 18, EM_ARM);
+	put32(buf + 20, 1);
+	put32(buf + 32, sh_offset);
+	put32(buf + 36, EF_ARM_EABI_VER5);
+	put16(buf + 40, EHDR_LEN);
+	put16(buf + 46, SHDR_LEN);
+	put16(buf + 48, SEC_COUNT);
+	put16(buf + 50, SEC_SHSTRTAB);
+
+	put32(stub + 0, member->nids[0]);
+	put32(stub + 4, member->nids[1]);
+	put32(stub + 8, member->nids[2]);
+	if (!member->is_variable)
+		put32(stub + 12, 0xe320f000);	/* The assembler pads code with nop */
+
+	memcpy(buf + ATTRIBUTES_OFFSET, attributes, sizeof(attributes));
+
+	/* The local $d marks the stub as data for disassemblers */
+	put_sym(buf + SYMTAB_OFFSET + SYM_LEN, 1, STB_LOCAL, STT_NOTYPE, SEC_STUB);
+	put_sym(buf + SYMTAB_OFFSET + 2 * SYM_LEN, 4, STB_GLOBAL,
+		member->is_variable ? STT_OBJECT : STT_FUNC, SEC_STUB);
+
+	memcpy(buf + STRTAB_OFFSET + 1, "$d", 3);
+	memcpy(buf + STRTAB_OFFSET + 4, member->symbol, symbol_len);
+
+	memcpy(buf + shstr_offset, member->is_variable ? shstrtab_vstubs : shstrtab_fstubs, SHSTRTAB_LEN);
+
+	put_shdr(shdr + SEC_STUB * SHDR_LEN, SHSTR_STUB, SHT_PROGBITS,
+		member->is_variable ? SHF_ALLOC | SHF_WRITE : SHF_ALLOC | SHF_EXECINSTR,
+		STUB_OFFSET, STUB_LEN, 0, 0, 16, 0);
+	put_shdr(shdr + SEC_ATTRIBUTES * SHDR_LEN, SHSTR_ATTRIBUTES, SHT_ARM_ATTRIBUTES, 0,
+		ATTRIBUTES_OFFSET, sizeof(attributes), 0, 0, 1, 0);
+	put_shdr(shdr + SEC_SYMTAB * SHDR_LEN, SHSTR_SYMTAB, SHT_SYMTAB, 0,
+		SYMTAB_OFFSET, SYMTAB_LEN, SEC_STRTAB, 2, 4, SYM_LEN);
+	put_shdr(shdr + SEC_STRTAB * SHDR_LEN, SHSTR_STRTAB, SHT_STRTAB, 0,
+		STRTAB_OFFSET, strtab_len, 0, 0, 1, 0);
+	put_shdr(shdr + SEC_SHSTRTAB * SHDR_LEN, SHSTR_SHSTRTAB, SHT_STRTAB, 0,
+		shstr_offset, SHSTRTAB_LEN, 0, 0, 1, 0);
+}
+
+/* A member header; name is padded with spaces as it is */
+static void put_header(uint8_t *p, const char *name, size_t size)
+{
+	char header[128];
+
+	snprintf(header, sizeof(header), "%-16s%-12d%-6d%-6d%-8o%-10lu`\n",
+		name, 0, 0, 0, 0644, (unsigned long)size);
+	memcpy(p, header, AR_HEADER_LEN);
+}
+
+static size_t even(size_t size)
+{
+	return (size + 1) & ~(size_t)1;
+}
+
+/* Names of 16 characters or more, the terminating '/' included, go into
+ * the "//" member and headers refer to them by offset */
+static int is_long_name(const char *name)
+{
+	return strlen(name) + 1 > 16;
+}
+
+int stub_archive_build(const stub_archive_t *ar, void **data, size_t *size)
+{
+	uint8_t *buf, *index, *p;
+	char header_name[17];
+	size_t index_len, names_len = 0, names_ofs = 0, offset, len, total;
+	int i;
+
+	/* The index is a count, the offset of each symbol's member header, then
+	 * the symbol names; each member here defines exactly one symbol */
+	index_len = 4 + 4 * (size_t)ar->count;
+	for (i = 0; i < ar->count; i++) {
+		index_len += strlen(ar->members[i].symbol) + 1;
+		if (is_long_name(ar->members[i].name))
+			names_len += strlen(ar->members[i].name) + 2;
+	}
+
+	offset = strlen(AR_MAGIC) + AR_HEADER_LEN + even(index_len);
+	if (names_len)
+		offset += AR_HEADER_LEN + even(names_len);
+
+	total = offset;
+	for (i = 0; i < ar->count; i++)
+		total += AR_HEADER_LEN + even(object_size(&ar->members[i]));
+
+	if (total > 0xFFFFFFFF) {
+		fprintf(stderr, "Too large for an archive index\n");
+		return 0;
+	}
+
+	/* Padding bytes are '\n', as ar writes them */
+	if ((buf = malloc(total)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	memset(buf, '\n', total);
+
+	p = buf;
+	memcpy(p, AR_MAGIC, strlen(AR_MAGIC));
+	p += strlen(AR_MAGIC);
+
+	put_header(p, "/", even(index_len));
+	index = p + AR_HEADER_LEN;
+	memset(index, 0, even(index_len));
+	put32be(index, ar->count);
+	len = 4 + 4 * (size_t)ar->count;
+	for (i = 0; i < ar->count; i++) {
+		put32be(index + 4 + 4 * i, offset);
+		strcpy((char *)index + len, ar->members[i].symbol);
+		len += strlen(ar->members[i].symbol) + 1;
+		offset += AR_HEADER_LEN + even(object_size(&ar->members[i]));
+	}
+	p = index + even(index_len);
+
+	if (names_len) {
+		put_header(p, "//", even(names_len));
+		p += AR_HEADER_LEN;
+		for (i = 0; i < ar->count; i++) {
+			if (is_long_name(ar->members[i].name)) {
+				len = strlen(ar->members[i].name);
+				memcpy(p, ar->members[i].name, len);
+				p[len] = '/';
+				p += len + 2;
+			}
+		}
+		p += names_len & 1;
+	}
+
+	for (i = 0; i < ar->count; i++) {
+		const stub_member *member = &ar->members[i];
+
+		if (is_long_name(member->name)) {
+			snprintf(header_name, sizeof(header_name), "/%lu", (unsigned long)names_ofs);
+			names_ofs += strlen(member->name) + 2;
+		} else {
+			snprintf(header_name, sizeof(header_name), "%s/", member->name);
+		}
+
+		len = object_size(member);
+		put_header(p, header_name, len);
+		p += AR_HEADER_LEN;
+		build_object(member, p);
+		p += even(len);
+	}
+
+	*data = buf;
+	*size = total;
+	return 1;
+}
@@ -0,0 +1,29 @@
+#ifndef STUB_ARCHIVE_H
+#define STUB_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A static library of import stubs, each member the relocatable object the
+ * assembler would make from the .S vita-libs-gen writes for that stub: a
+ * 16-byte .vitalink.fstubs or .vitalink.vstubs section holding the library,
+ * module and target NIDs, and a global symbol at its start */
+typedef struct stub_archive stub_archive_t;
+
+/* Returns an empty archive, or NULL if out of memory */
+stub_archive_t *stub_archive_new(void);
+
+void stub_archive_free(stub_archive_t *ar);
+
+/* Appends a member called name defining symbol as a function stub, or as a
+ * variable stub if is_variable is set.  Returns 0 if out of memory. */
+int stub_archive_add(stub_archive_t *ar, const char *name, const char *symbol, int is_variable,
+		uint32_t library_nid, uint32_t module_nid, uint32_t target_nid);
+
+/* Lays out the members in the order they were added, after the symbol index
+ * ranlib would make, with every date, owner and mode fixed so that the same
+ * stubs always give the same bytes.  Sets *data to a buffer of *size bytes
+ * for the caller to free.  Returns 0 and prints why on failure. */
+int stub_archive_build(const stub_archive_t *ar, void **data, size_t *size);
+
+#endif
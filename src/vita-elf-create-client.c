@@ -0,0 +1,83 @@
+/* Thin front end for a resident "vita-elf-create --server" process.
+ *
+ * Takes exactly the vita-elf-create command line.  If $VITA_ELF_CREATE_SOCKET
+ * names a live server the conversion runs there, with output going to this
+ * process's stdout/stderr; otherwise vita-elf-create is run directly. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "elf-create-argp.h"
+#include "elf-create-proto.h"
+
+static int connect_server(const char *socket_path)
+{
+	struct sockaddr_un addr = {};
+	int sock;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return -1;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static int run_locally(char *argv[])
+{
+	argv[0] = "vita-elf-create";
+	execvp(argv[0], argv);
+	perror(argv[0]);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+	elf_create_args args = {};
+	const char *socket_path;
+	char cwd[PATH_MAX];
+	int status;
+	int sock;
+
+	socket_path = getenv(ELF_CREATE_SOCKET_ENV);
+	if (socket_path == NULL || *socket_path == '\0')
+		return run_locally(argv);
+
+	if (parse_arguments(argc, argv, &args) < 0)
+		return EXIT_FAILURE;
+
+	// Batch and server runs gain nothing from a resident process
+	if (args.batch || args.server)
+		return run_locally(argv);
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("getcwd");
+		return EXIT_FAILURE;
+	}
+
+	if ((sock = connect_server(socket_path)) < 0)
+		return run_locally(argv);
+
+	if (!elf_create_send_request(sock, cwd, &args) || !elf_create_recv_status(sock, &status)) {
+		fprintf(stderr, "lost connection to %s\n", socket_path);
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	close(sock);
+	return status;
+}
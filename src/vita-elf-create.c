@@ -16,6 +16,11 @@
 #include "elf-utils.h"
 #include "fail-utils.h"
 #include "elf-create-argp.h"
+#include "elf-create-stats.h"
+#include "elf-create-batch.h"
+#include "elf-create-server.h"
+#include "elf-create-cache.h"
+#include "fself.h"
 
 // logging level
 int g_log = 0;
@@ -74,6 +79,19 @@ void print_rtable(vita_elf_rela_table_t *rtable)
 	}
 }
 
+void print_fixups(const sce_elf_fixup_table_t *fixups)
+{
+	const sce_elf_fixup_t *fixup;
+	int num_fixups;
+
+	for (num_fixups = fixups->num_fixups, fixup = fixups->fixups; num_fixups; num_fixups--, fixup++) {
+		TRACEF(VERBOSE, "    offset %06x: type %s, %s = %08x\n",
+				fixup->offset,
+				elf_decode_r_type(fixup->type),
+				fixup->symbol->name, fixup->value);
+	}
+}
+
 void list_rels(vita_elf_t *ve)
 {
 	vita_elf_rela_table_t *rtable;
@@ -156,117 +174,184 @@ char default_json[] = DEFAULT_JSON;
 char default_json[] = "";
 #endif
 
-vita_imports_t **load_imports(elf_create_args *args, int *imports_count)
+/* Resolves default_json against the binary directory.  Returns a malloc'ed
+ * array of malloc'ed paths; only call once, since default_json is tokenized in place. */
+char **get_default_import_paths(int *default_count)
 {
-	vita_imports_t **imports = NULL;
-	int user_count = args->extra_imports_count;
-	int default_count = 0;
-	int loaded = 0;
+	char **paths;
 	char path[PATH_MAX] = { 0 };
-	int i;
 	char *s;
 	char *saveptr;
-	int count;
 	int base_length;
+	int count = 0;
 
+	*default_count = 0;
 	for (s = default_json; *s; ++s)
 		if (*s == ':')
-			++default_count;
+			++count;
 	// Only way we get 0 is when default_json is empty
 	if (*default_json)
-		++default_count;
+		++count;
 
-	count = user_count + default_count;
-	imports = calloc(count, sizeof(*imports));
-	if (!imports)
-		goto failure;
+	paths = calloc(count + 1, sizeof(*paths));
+	if (!paths)
+		return NULL;
 
-	// First, load default imports
 	get_binary_directory(path, sizeof(path));
 	base_length = strlen(path);
 
 	s = strtok_r(default_json, ":", &saveptr);
 	while (s) {
 		strncpy(path + base_length, s, sizeof(path) - base_length - 1);
-		if ((imports[loaded++] = vita_imports_load(path, g_log >= DEBUG)) == NULL)
-			goto failure;
+		paths[(*default_count)++] = strdup(path);
 		s = strtok_r(NULL, ":", &saveptr);
 	}
 
+	return paths;
+}
+
+vita_imports_t **load_imports(elf_create_args *args, int *imports_count)
+{
+	vita_imports_t **imports = NULL;
+	int user_count = args->extra_imports_count;
+	int default_count = 0;
+	char **default_paths;
+	int loaded = 0;
+	int i;
+	int count;
+
+	if (!(default_paths = get_default_import_paths(&default_count)))
+		return NULL;
+
+	count = user_count + default_count;
+	imports = calloc(count, sizeof(*imports));
+	if (!imports)
+		goto failure;
+
+	// First, load default imports
+	for (i = 0; i < default_count; i++) {
+		if ((imports[loaded++] = vita_imports_load(default_paths[i], g_log >= DEBUG)) == NULL)
+			goto failure;
+	}
+
 	// Load imports specified by the user
 	for (i = 0; i < user_count; i++) {
 		if ((imports[loaded++] = vita_imports_load(args->extra_imports[i], g_log >= DEBUG)) == NULL)
 			goto failure;
 	}
 	*imports_count = count;
+	for (i = 0; i < default_count; i++)
+		free(default_paths[i]);
+	free(default_paths);
 	return imports;
 failure:
-	for (i = 0; i < count; ++i)
+	for (i = 0; i < default_count; i++)
+		free(default_paths[i]);
+	free(default_paths);
+	for (i = 0; imports && i < count; ++i)
 		vita_imports_free(imports[i]);
 	free(imports);
 	return NULL;
 }
 
-int main(int argc, char *argv[])
+int elf_create_convert(const elf_create_job *job, vita_imports_t **imports, int imports_count, elf_create_stats *stats)
 {
-	vita_elf_t *ve;
-	vita_imports_t **imports;
-	sce_module_info_t *module_info;
+	vita_elf_t *ve = NULL;
+	sce_module_info_t *module_info = NULL;
 	sce_section_sizes_t section_sizes;
-	void *encoded_modinfo;
+	void *encoded_modinfo = NULL;
 	vita_elf_rela_table_t rtable = {};
-	int imports_count;
+	vita_elf_rela_table_t *curtable;
+	sce_elf_fixup_table_t fixups = {};
 	vita_export_t *exports = NULL;
+	elf_utils_output output = { .fd = -1 };
+	Elf *dest = NULL;
+	int relas_before = 0, relas_after = 0;
+	elf_create_cache_key cache_key;
+	int cache_hit = 0;
+	int total_size;
+	int i;
 	
 	int status = EXIT_SUCCESS;
 
-	elf_create_args args = {};
-	if (parse_arguments(argc, argv, &args) < 0)
-		return EXIT_FAILURE;
-
-	g_log = args.log_level;
+	stats_phase_begin(stats);
 
-	if ((ve = vita_elf_load(args.input, args.check_stub_count)) == NULL)
-		return EXIT_FAILURE;
+	if ((ve = vita_elf_load(job->input, job->check_stub_count)) == NULL)
+		goto failure;
 
-	if (args.exports) {
-		exports = vita_exports_load(args.exports, args.input, 0);
-		
-		if (!exports)
-			return EXIT_FAILURE;
+	// With content_nid the file is not hashed; the NID is derived once the exports are known
+	if (job->exports) {
+		exports = vita_exports_load(job->exports, job->content_nid ? NULL : job->input, 0);
+	}
+	else if (job->content_nid) {
+		exports = vita_export_generate_named(job->input);
 	}
 	else {
 		// generate a default export list
-		exports = vita_export_generate_default(args.input);
+		exports = vita_export_generate_default(job->input);
 	}
-	
-	if (!(imports = load_imports(&args, &imports_count)))
-		return EXIT_FAILURE;
 
-	if (!vita_elf_lookup_imports(ve, imports, imports_count))
-		status = EXIT_FAILURE;
+	if (!exports)
+		goto failure;
 
-	if (ve->fstubs_ndx) {
-		TRACEF(VERBOSE, "Function stubs in section %d:\n", ve->fstubs_ndx);
-		print_stubs(ve->fstubs, ve->num_fstubs);
+	if (job->content_nid && !exports->nid_explicit) {
+		if (!sce_elf_content_nid(ve, exports, &exports->nid))
+			goto failure;
+		TRACEF(VERBOSE, "Module NID from loadable content: 0x%08X\n", exports->nid);
 	}
-	if (ve->vstubs_ndx) {
-		TRACEF(VERBOSE, "Variable stubs in section %d:\n", ve->vstubs_ndx);
-		print_stubs(ve->vstubs, ve->num_vstubs);
+
+	if (job->cache_dir) {
+		elf_create_cache_make_key(ve, exports, job->imports_digest, &cache_key);
+		cache_hit = elf_create_cache_load(job->cache_dir, &cache_key, &section_sizes, &encoded_modinfo, &rtable);
+		TRACEF(VERBOSE, "Module info cache %s\n", cache_hit ? "hit" : "miss");
 	}
 
-	TRACEF(VERBOSE, "Relocations:\n");
-	list_rels(ve);
+	stats_phase_end(stats, STATS_LOAD);
 
-	TRACEF(VERBOSE, "Segments:\n");
-	list_segments(ve);
+	if (!cache_hit) {
+		stats_phase_begin(stats);
 
-	module_info = sce_elf_module_info_create(ve, exports);
+		if (!vita_elf_lookup_imports(ve, imports, imports_count))
+			status = EXIT_FAILURE;
+
+		stats_phase_end(stats, STATS_IMPORT_LOOKUP);
+
+		if (g_log >= VERBOSE) {
+			if (ve->fstubs_ndx) {
+				TRACEF(VERBOSE, "Function stubs in section %d:\n", ve->fstubs_ndx);
+				print_stubs(ve->fstubs, ve->num_fstubs);
+			}
+			if (ve->vstubs_ndx) {
+				TRACEF(VERBOSE, "Variable stubs in section %d:\n", ve->vstubs_ndx);
+				print_stubs(ve->vstubs, ve->num_vstubs);
+			}
+		}
+
+		stats_phase_begin(stats);
+
+		module_info = sce_elf_module_info_create(ve, exports);
+
+		if (!module_info)
+			goto failure;
+
+		stats_phase_end(stats, STATS_MODINFO_CREATE);
+
+		total_size = sce_elf_module_info_get_size(module_info, &section_sizes);
+	} else {
+		total_size = 0;
+		for (i = 0; i < sizeof(section_sizes) / sizeof(Elf32_Word); i++)
+			total_size += ((Elf32_Word *)&section_sizes)[i];
+	}
+
+	/* The dumps below walk every relocation; skip them entirely unless they will print */
+	if (g_log >= VERBOSE) {
+		TRACEF(VERBOSE, "Relocations:\n");
+		list_rels(ve);
+
+		TRACEF(VERBOSE, "Segments:\n");
+		list_segments(ve);
+	}
 
-	if (!module_info)
-		return EXIT_FAILURE;
-	
-	int total_size = sce_elf_module_info_get_size(module_info, &section_sizes);
 	int curpos = 0;
 	TRACEF(VERBOSE, "Total SCE data size: %d / %x\n", total_size, total_size);
 #define PRINTSEC(name) TRACEF(VERBOSE, "  .%.*s.%s: %d (%x @ %x)\n", (int)strcspn(#name,"_"), #name, strchr(#name,'_')+1, section_sizes.name, section_sizes.name, curpos+ve->segments[0].vaddr+ve->segments[0].memsz); curpos += section_sizes.name
@@ -279,32 +364,154 @@ int main(int argc, char *argv[])
 	PRINTSEC(sceFStub_rodata);
 	PRINTSEC(sceVNID_rodata);
 	PRINTSEC(sceVStub_rodata);
+#undef PRINTSEC
 
-	encoded_modinfo = sce_elf_module_info_encode(
-			module_info, ve, &section_sizes, &rtable);
+	if (!cache_hit) {
+		stats_phase_begin(stats);
 
-	TRACEF(VERBOSE, "Relocations from encoded modinfo:\n");
-	print_rtable(&rtable);
+		encoded_modinfo = sce_elf_module_info_encode(
+				module_info, ve, &section_sizes, &rtable);
 
-	FILE *outfile;
-	Elf *dest;
-	ASSERT(dest = elf_utils_copy_to_file(args.output, ve->elf, &outfile));
+		stats_phase_end(stats, STATS_MODINFO_ENCODE);
+
+		if (!encoded_modinfo)
+			goto failure;
+
+		/* Only entries from clean conversions may be replayed later */
+		if (job->cache_dir && status == EXIT_SUCCESS)
+			elf_create_cache_store(job->cache_dir, &cache_key, &section_sizes, encoded_modinfo, &rtable);
+	}
+
+	if (g_log >= VERBOSE) {
+		TRACEF(VERBOSE, "Relocations from encoded modinfo:\n");
+		print_rtable(&rtable);
+	}
+
+	stats_phase_begin(stats);
+	ASSERT(dest = elf_utils_copy_to_output(job->output, ve->elf, &output,
+			job->strip_debug ? ELF_UTILS_COPY_STRIP : 0));
 	ASSERT(elf_utils_duplicate_shstrtab(dest));
+	stats_phase_end(stats, STATS_SHIFT_COPY);
+
+	stats_phase_begin(stats);
+	ASSERT(sce_elf_resolve_abs_relocs(dest, ve, ve->rela_tables, &fixups));
+	for (curtable = ve->rela_tables; curtable; curtable = curtable->next)
+		relas_before += curtable->num_relas;
 	ASSERT(sce_elf_discard_invalid_relocs(ve, ve->rela_tables));
+	for (curtable = ve->rela_tables; curtable; curtable = curtable->next)
+		relas_after += curtable->num_relas;
+	stats_phase_end(stats, STATS_RELOC_DISCARD);
+
+	TRACEF(VERBOSE, "Absolute relocations resolved: %d\n", fixups.num_fixups);
+	print_fixups(&fixups);
+
+	stats_phase_begin(stats);
 	ASSERT(sce_elf_write_module_info(dest, ve, &section_sizes, encoded_modinfo));
+	stats_phase_end(stats, STATS_SHIFT_COPY);
+
+	stats_phase_begin(stats);
 	rtable.next = ve->rela_tables;
-	ASSERT(sce_elf_write_rela_sections(dest, ve, &rtable));
+	ASSERT(sce_elf_write_rela_sections(dest, ve, &rtable, stats ? &stats->relas : NULL));
+	stats_phase_end(stats, STATS_RELOC_ENCODE);
+
+	stats_phase_begin(stats);
 	ASSERT(sce_elf_rewrite_stubs(dest, ve));
-	ELF_ASSERT(elf_update(dest, ELF_C_WRITE) >= 0);
-	elf_end(dest);
-	ASSERT(sce_elf_set_headers(outfile, ve));
-	fclose(outfile);
+	stats_phase_end(stats, STATS_SHIFT_COPY);
 
+	stats_phase_begin(stats);
+	/* An fself is the velf image behind a fixed-size header, so it is built in the same file */
+	if (job->fself)
+		output.prefix = FSELF_HEADER_LEN;
+	ASSERT(elf_utils_output_map(dest, &output));
+	elf_end(dest);
+	dest = NULL;
+	ASSERT(sce_elf_set_headers(output.image, ve));
+	if (job->fself && !fself_build_header_for_image((char *)output.image - output.prefix,
+			output.image, output.size, job->fself_authid))
+		FAILX("Too many program headers to fit the SELF header");
+	ASSERT(elf_utils_output_commit(&output));
+	if (job->debug_file)
+		ASSERT(elf_utils_write_debug_file(job->debug_file, ve->elf));
+	stats_phase_end(stats, STATS_ELF_UPDATE);
+
+	if (stats) {
+		stats->num_fstubs = ve->num_fstubs;
+		stats->num_vstubs = ve->num_vstubs;
+		stats->num_abs_fixups = fixups.num_fixups;
+		stats->cache_hit = cache_hit;
+		stats->num_discarded_relas = relas_before - relas_after;
+	}
 
+	goto cleanup;
+failure:
+	status = EXIT_FAILURE;
+cleanup:
+	if (dest)
+		elf_end(dest);
+	elf_utils_output_discard(&output);
+	free(encoded_modinfo);
+	free(rtable.relas);
+	free(fixups.fixups);
 	sce_elf_module_info_free(module_info);
-	vita_elf_free(ve);
+	vita_exports_free(exports);
+	if (ve)
+		vita_elf_free(ve);
 
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	vita_imports_t **imports;
+	int imports_count;
+	elf_create_stats stats = {};
+	elf_create_job job = {};
+	uint8_t imports_digest[ELF_CREATE_CACHE_DIGEST_LEN];
+	int status;
 	int i;
+
+	elf_create_args args = {};
+	if (parse_arguments(argc, argv, &args) < 0)
+		return EXIT_FAILURE;
+
+	g_log = args.log_level;
+
+	if (args.server)
+		return elf_create_serve(args.server, &args);
+
+	stats_phase_begin(&stats);
+
+	if (!(imports = load_imports(&args, &imports_count)))
+		return EXIT_FAILURE;
+
+	stats_phase_end(&stats, STATS_LOAD);
+
+	job.exports = args.exports;
+	job.check_stub_count = args.check_stub_count;
+	job.strip_debug = args.strip_debug;
+	job.debug_file = args.debug_file;
+	job.cache_dir = args.cache;
+	job.content_nid = args.content_nid;
+	job.fself = args.fself;
+	job.fself_authid = elf_create_fself_authid(&args);
+	if (job.cache_dir) {
+		elf_create_cache_digest_imports(imports, imports_count, imports_digest);
+		job.imports_digest = imports_digest;
+	}
+
+	if (args.batch) {
+		status = elf_create_run_batch(args.batch, args.jobs, &job,
+				imports, imports_count, args.stats) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	} else {
+		job.input = args.input;
+		job.output = args.output;
+
+		status = elf_create_convert(&job, imports, imports_count, args.stats ? &stats : NULL);
+
+		if (args.stats && !stats_write_json(&stats, args.input, args.stats))
+			status = EXIT_FAILURE;
+	}
+
 	for (i = 0; i < imports_count; i++) {
 		vita_imports_free(imports[i]);
 	}
@@ -312,6 +519,4 @@ int main(int argc, char *argv[])
 	free(imports);
 
 	return status;
-failure:
-	return EXIT_FAILURE;
 }
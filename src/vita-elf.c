@@ -113,21 +113,26 @@ failure:
 }
 
 #define THUMB_SHUFFLE(x) ((((x) & 0xFFFF0000) >> 16) | (((x) & 0xFFFF) << 16))
-static uint32_t decode_rel_target(uint32_t data, int type, uint32_t addr)
+/* Stores in *target what the instruction or word data at addr points to */
+static int decode_rel_target(uint32_t data, int type, uint32_t addr, uint32_t *target)
 {
 	uint32_t upper, lower, sign, j1, j2, imm10, imm11;
 	switch(type) {
 		case R_ARM_NONE:
 		case R_ARM_V4BX:
-			return 0xdeadbeef;
+			*target = 0xdeadbeef;
+			return 1;
 		case R_ARM_ABS32:
 		case R_ARM_TARGET1:
-			return data;
+			*target = data;
+			return 1;
 		case R_ARM_REL32:
 		case R_ARM_TARGET2:
-			return data + addr;
+			*target = data + addr;
+			return 1;
 		case R_ARM_PREL31:
-			return data + addr;
+			*target = data + addr;
+			return 1;
 		case R_ARM_THM_CALL: // bl (THUMB)
 			data = THUMB_SHUFFLE(data);
 			upper = data >> 16;
@@ -137,33 +142,40 @@ static uint32_t decode_rel_target(uint32_t data, int type, uint32_t addr)
 			j2 = (lower >> 11) & 1;
 			imm10 = upper & 0x3ff;
 			imm11 = lower & 0x7ff;
-			return addr + (((imm11 | (imm10 << 11) | (!(j2 ^ sign) << 21) | (!(j1 ^ sign) << 22) | (sign << 23)) << 1) | (sign ? 0xff000000 : 0));
+			*target = addr + (((imm11 | (imm10 << 11) | (!(j2 ^ sign) << 21) | (!(j1 ^ sign) << 22) | (sign << 23)) << 1) | (sign ? 0xff000000 : 0));
+			return 1;
 		case R_ARM_CALL: // bl/blx
 		case R_ARM_JUMP24: // b/bl<cond>
 			data = (data & 0x00ffffff) << 2;
 			// if we got a negative value, sign extend it
 			if (data & (1 << 25))
 				data |= 0xfc000000;
-			return data + addr;
+			*target = data + addr;
+			return 1;
 		case R_ARM_MOVW_ABS_NC: //movw
-			return ((data & 0xf0000) >> 4) | (data & 0xfff);
+			*target = ((data & 0xf0000) >> 4) | (data & 0xfff);
+			return 1;
 		case R_ARM_MOVT_ABS: //movt
-			return (((data & 0xf0000) >> 4) | (data & 0xfff)) << 16;
+			*target = (((data & 0xf0000) >> 4) | (data & 0xfff)) << 16;
+			return 1;
 		case R_ARM_THM_MOVW_ABS_NC: //MOVW (THUMB)
 			data = THUMB_SHUFFLE(data);
-			return (((data >> 16) & 0xf) << 12)
+			*target = (((data >> 16) & 0xf) << 12)
 				| (((data >> 26) & 0x1) << 11)
 				| (((data >> 12) & 0x7) << 8)
 				| (data & 0xff);
+			return 1;
 		case R_ARM_THM_MOVT_ABS: //MOVT (THUMB)
 			data = THUMB_SHUFFLE(data);
-			return (((data >> 16) & 0xf) << 28)
+			*target = (((data >> 16) & 0xf) << 28)
 				| (((data >> 26) & 0x1) << 27)
 				| (((data >> 12) & 0x7) << 24)
 				| ((data & 0xff) << 16);
+			return 1;
 	}
 
-	errx(EXIT_FAILURE, "Invalid relocation type: %d", type);
+	warnx("Invalid relocation type: %d", type);
+	return 0;
 }
 
 #define REL_HANDLE_NORMAL 0
@@ -262,7 +274,8 @@ static int load_rel_table(vita_elf_t *ve, Elf_Scn *scn)
 
 		currela->symbol = ve->symtab + rel_sym;
 
-		target = decode_rel_target(insn, currela->type, rel.r_offset);
+		if (!decode_rel_target(insn, currela->type, rel.r_offset, &target))
+			goto failure;
 
 		/* From some testing the added for MOVT/MOVW should actually always be 0 */
 		if (currela->type == R_ARM_MOVT_ABS || currela->type == R_ARM_THM_MOVT_ABS)
@@ -519,9 +532,11 @@ void vita_elf_free(vita_elf_t *ve)
 	}
 
 	/* free() is safe to call on NULL */
+	free(ve->segments);
 	free(ve->fstubs);
 	free(ve->vstubs);
 	free(ve->symtab);
+	free_rela_table(ve->rela_tables);
 	if (ve->elf != NULL)
 		elf_end(ve->elf);
 	if (ve->file != NULL)
@@ -315,6 +315,8 @@ int process_module_info(yaml_node *parent, yaml_node *child, vita_export_t *info
 			fprintf(stderr, "error: line: %zd, column: %zd, could not convert module nid '%s' to 32 bit integer.\n", child->position.line, child->position.column, child->data.scalar.value);
 			return -1;
 		}
+		
+		info->nid_explicit = 1;
 	}
 	
 	else if (strcmp(key->value, "main") == 0) {
@@ -419,23 +421,30 @@ vita_export_t *vita_exports_loads(FILE *text, const char *elf, int verbose)
 	if (tree->count != 1)
 	{
 		fprintf(stderr, "error: expecting a single yaml document, got: %zd\n", tree->count);
-		// TODO: cleanup tree
+		free_yaml_tree(tree);
 		return NULL;
 	}
 	
-	if (sha256_32_file(elf, &nid) < 0)
+	// without an ELF the caller fills in the nid, unless the spec sets one
+	if (elf && sha256_32_file(elf, &nid) < 0)
 	{
-		// TODO: cleanup tree
+		free_yaml_tree(tree);
 		return NULL;
 	}
 	
-	return read_module_exports(tree->docs[0], nid);
+	// everything kept from the tree is copied
+	vita_export_t *exports = read_module_exports(tree->docs[0], nid);
+	free_yaml_tree(tree);
+	return exports;
 }
 
-vita_export_t *vita_export_generate_default(const char *elf)
+vita_export_t *vita_export_generate_named(const char *elf)
 {
 	vita_export_t *exports = calloc(1, sizeof(vita_export_t));
 	
+	if (!exports)
+		return NULL;
+	
 	// set module name to elf output name
 	char *fs = strrchr(elf, '/');
 	char *bs = strrchr(elf, '\\');
@@ -461,14 +470,6 @@ vita_export_t *vita_export_generate_default(const char *elf)
 	// default attribute of 0
 	exports->attributes = 0;
 	
-	
-	// nid is SHA256-32 of ELF
-	if (sha256_32_file(elf, &exports->nid) < 0)
-	{
-		free(exports);
-		return NULL;
-	}
-	
 	// we don't specify any specific symbols
 	exports->start = NULL;
 	exports->stop = NULL;
@@ -479,3 +480,53 @@ vita_export_t *vita_export_generate_default(const char *elf)
 	exports->modules = NULL;
 	return exports;
 }
+
+vita_export_t *vita_export_generate_default(const char *elf)
+{
+	vita_export_t *exports = vita_export_generate_named(elf);
+	
+	if (!exports)
+		return NULL;
+	
+	// nid is SHA256-32 of ELF
+	if (sha256_32_file(elf, &exports->nid) < 0)
+	{
+		free(exports);
+		return NULL;
+	}
+	
+	return exports;
+}
+
+static void free_symbols(vita_export_symbol **symbols, size_t count)
+{
+	size_t i;
+	
+	for (i = 0; i < count; i++) {
+		free((char *)symbols[i]->name);
+		free(symbols[i]);
+	}
+	
+	free(symbols);
+}
+
+void vita_exports_free(vita_export_t *exp)
+{
+	size_t i;
+	
+	if (!exp)
+		return;
+	
+	for (i = 0; i < exp->module_n; i++) {
+		free_symbols(exp->modules[i]->functions, exp->modules[i]->function_n);
+		free_symbols(exp->modules[i]->variables, exp->modules[i]->variable_n);
+		free((char *)exp->modules[i]->name);
+		free(exp->modules[i]);
+	}
+	
+	free(exp->modules);
+	free((char *)exp->start);
+	free((char *)exp->stop);
+	free((char *)exp->exit);
+	free(exp);
+}
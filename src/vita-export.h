@@ -26,6 +26,7 @@ typedef struct {
 	uint8_t ver_minor;
 	uint16_t attributes;
 	uint32_t nid;
+	int nid_explicit;	/* nid was given in the export spec */
 	const char *start;
 	const char *stop;
 	const char *exit;
@@ -33,9 +34,13 @@ typedef struct {
 	vita_library_export **modules;
 } vita_export_t;
 
+/* The module nid defaults to the SHA256-32 of the elf file; pass NULL to skip
+ * hashing and leave it at 0 for the caller to derive */
 vita_export_t *vita_exports_load(const char *filename, const char *elf, int verbose);
 vita_export_t *vita_exports_loads(FILE *text, const char *elf, int verbose);
 vita_export_t *vita_export_generate_default(const char *elf);
+/* As vita_export_generate_default, but leaves the nid for the caller */
+vita_export_t *vita_export_generate_named(const char *elf);
 void vita_exports_free(vita_export_t *exp);
 
 #endif // VITA_EXPORT_H
@@ -9,6 +9,7 @@ vita_imports_t *vita_imports_new(int n_libs)
 		return NULL;
 
 	imp->n_libs = n_libs;
+	imp->sorted = false;
 
 	imp->libs = calloc(n_libs, sizeof(*imp->libs));
 
@@ -22,6 +23,7 @@ void vita_imports_free(vita_imports_t *imp)
 		for (i = 0; i < imp->n_libs; i++) {
 			vita_imports_lib_free(imp->libs[i]);
 		}
+		free(imp->libs);
 		free(imp);
 	}
 }
@@ -35,6 +37,7 @@ vita_imports_lib_t *vita_imports_lib_new(const char *name, uint32_t NID, int n_m
 	lib->name = strdup(name);
 	lib->NID = NID;
 	lib->n_modules = n_modules;
+	lib->sorted = false;
 
 	lib->modules = calloc(n_modules, sizeof(*lib->modules));
 
@@ -53,6 +56,7 @@ vita_imports_module_t *vita_imports_module_new(const char *name, bool kernel, ui
 	mod->is_kernel = kernel;
 	mod->n_functions = n_functions;
 	mod->n_variables = n_variables;
+	mod->sorted = false;
 
 	mod->functions = calloc(n_functions, sizeof(*mod->functions));
 
@@ -71,6 +75,8 @@ void vita_imports_module_free(vita_imports_module_t *mod)
 		for (i = 0; i < mod->n_functions; i++) {
 			vita_imports_stub_free(mod->functions[i]);
 		}
+		free(mod->variables);
+		free(mod->functions);
 		free(mod->name);
 		free(mod);
 	}
@@ -84,6 +90,7 @@ void vita_imports_lib_free(vita_imports_lib_t *lib)
 		for (i = 0; i < lib->n_modules; i++) {
 			vita_imports_module_free(lib->modules[i]);
 		}
+		free(lib->modules);
 		free(lib->name);
 		free(lib);
 	}
@@ -109,12 +116,105 @@ void vita_imports_stub_free(vita_imports_stub_t *stub)
 	}
 }
 
-/* For now these functions are just dumb full-table searches.  We can implement qsort/bsearch/whatever later if necessary. */
+typedef struct {
+	vita_imports_common_fields *entry;
+	int index;
+} sort_item;
+
+static int _common_sort(const void *el1, const void *el2)
+{
+	const sort_item *item1 = el1;
+	const sort_item *item2 = el2;
+	const vita_imports_common_fields *entry1 = item1->entry;
+	const vita_imports_common_fields *entry2 = item2->entry;
+
+	/* Keep NULL (failed to load) entries at the end */
+	if (entry1 == NULL || entry2 == NULL) {
+		if ((entry1 == NULL) != (entry2 == NULL))
+			return (entry1 == NULL) - (entry2 == NULL);
+	} else if (entry1->NID > entry2->NID) {
+		return 1;
+	} else if (entry1->NID < entry2->NID) {
+		return -1;
+	}
+
+	/* qsort is not stable; keep the declared order among equal NIDs so the
+	 * first one declared is the one found */
+	return (item1->index > item2->index) - (item1->index < item2->index);
+}
+
+/* Returns false, leaving entries as they were, if out of memory */
+static bool sort_entries(void *entries, int n_entries)
+{
+	vita_imports_common_fields **list = entries;
+	sort_item *items;
+	int i;
+
+	if (n_entries < 2)
+		return true;
+
+	if ((items = malloc(n_entries * sizeof(*items))) == NULL)
+		return false;
+
+	for (i = 0; i < n_entries; i++) {
+		items[i].entry = list[i];
+		items[i].index = i;
+	}
+	qsort(items, n_entries, sizeof(*items), _common_sort);
+	for (i = 0; i < n_entries; i++)
+		list[i] = items[i].entry;
+
+	free(items);
+	return true;
+}
 
-static vita_imports_common_fields *generic_find(vita_imports_common_fields **entries, int n_entries, uint32_t NID) {
+void vita_imports_build_index(vita_imports_t *imp)
+{
+	int i, j;
+	vita_imports_lib_t *lib;
+	vita_imports_module_t *mod;
+
+	for (i = 0; i < imp->n_libs; i++) {
+		if ((lib = imp->libs[i]) == NULL)
+			continue;
+		for (j = 0; j < lib->n_modules; j++) {
+			if ((mod = lib->modules[j]) == NULL)
+				continue;
+			mod->sorted = sort_entries(mod->functions, mod->n_functions)
+				&& sort_entries(mod->variables, mod->n_variables);
+		}
+		lib->sorted = sort_entries(lib->modules, lib->n_modules);
+	}
+	imp->sorted = sort_entries(imp->libs, imp->n_libs);
+}
+
+/* Full-table searches unless vita_imports_build_index has sorted the table */
+
+static vita_imports_common_fields *sorted_find(vita_imports_common_fields **entries, int n_entries, uint32_t NID) {
+	int lo = 0, hi = n_entries, mid;
+
+	/* Lower bound, so duplicate NIDs resolve to the same entry every time */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (entries[mid] != NULL && entries[mid]->NID < NID)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < n_entries && entries[lo] != NULL && entries[lo]->NID == NID)
+		return entries[lo];
+
+	return NULL;
+}
+
+static vita_imports_common_fields *generic_find(vita_imports_common_fields **entries, int n_entries, uint32_t NID, bool sorted) {
 	int i;
 	vita_imports_common_fields *entry;
 
+	if (sorted)
+		return sorted_find(entries, n_entries, NID);
+
 	for (i = 0; i < n_entries; i++) {
 		entry = entries[i];
 		if (entry == NULL)
@@ -128,14 +228,14 @@ static vita_imports_common_fields *generic_find(vita_imports_common_fields **ent
 }
 
 vita_imports_lib_t *vita_imports_find_lib(vita_imports_t *imp, uint32_t NID) {
-	return (vita_imports_lib_t *)generic_find((vita_imports_common_fields **)imp->libs, imp->n_libs, NID);
+	return (vita_imports_lib_t *)generic_find((vita_imports_common_fields **)imp->libs, imp->n_libs, NID, imp->sorted);
 }
 vita_imports_module_t *vita_imports_find_module(vita_imports_lib_t *lib, uint32_t NID) {
-	return (vita_imports_module_t *)generic_find((vita_imports_common_fields **)lib->modules, lib->n_modules, NID);
+	return (vita_imports_module_t *)generic_find((vita_imports_common_fields **)lib->modules, lib->n_modules, NID, lib->sorted);
 }
 vita_imports_stub_t *vita_imports_find_function(vita_imports_module_t *mod, uint32_t NID) {
-	return (vita_imports_stub_t *)generic_find((vita_imports_common_fields **)mod->functions, mod->n_functions, NID);
+	return (vita_imports_stub_t *)generic_find((vita_imports_common_fields **)mod->functions, mod->n_functions, NID, mod->sorted);
 }
 vita_imports_stub_t *vita_imports_find_variable(vita_imports_module_t *mod, uint32_t NID) {
-	return (vita_imports_stub_t *)generic_find((vita_imports_common_fields **)mod->variables, mod->n_variables, NID);
+	return (vita_imports_stub_t *)generic_find((vita_imports_common_fields **)mod->variables, mod->n_variables, NID, mod->sorted);
 }
@@ -24,6 +24,7 @@ typedef struct {
 	vita_imports_stub_t **variables;
 	int n_functions;
 	int n_variables;
+	bool sorted;	/* functions and variables are sorted by NID, see vita_imports_build_index */
 } vita_imports_module_t;
 
 typedef struct {
@@ -31,11 +32,13 @@ typedef struct {
 	uint32_t NID;
 	vita_imports_module_t **modules;
 	int n_modules;
+	bool sorted;
 } vita_imports_lib_t;
 
 typedef struct {
 	vita_imports_lib_t **libs;
 	int n_libs;
+	bool sorted;
 } vita_imports_t;
 
 
@@ -45,6 +48,10 @@ vita_imports_t *vita_imports_loads(FILE *text, int verbose);
 vita_imports_t *vita_imports_new(int n_libs);
 void vita_imports_free(vita_imports_t *imp);
 
+/* Sorts every table of imp by NID so that the find functions can binary search.
+ * This reorders the tables, so only use it when declaration order does not matter. */
+void vita_imports_build_index(vita_imports_t *imp);
+
 vita_imports_lib_t *vita_imports_find_lib(vita_imports_t *imp, uint32_t NID);
 
 
@@ -1,18 +1,63 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
 #include "vita-import.h"
+#include "stub-archive.h"
+#include "getopt.h"
 
 #define KERNEL_LIBS_STUB "SceKernel"
 
 void usage();
-int generate_assembly(vita_imports_t **imports, int imports_count);
-int generate_makefile(vita_imports_t **imports, int imports_count);
+int generate_assembly(vita_imports_t **imports, int imports_count, int num_threads);
+int generate_makefile(vita_imports_t **imports, int imports_count, int per_module);
+int generate_archives(vita_imports_t **imports, int imports_count, int per_module);
+int remove_stale_files(vita_imports_t **imports, int imports_count, int archives, int per_module);
+
+static struct option arg_opts[] = {
+	{"archives", no_argument, NULL, 'a'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"per-module", no_argument, NULL, 'm'},
+	{ NULL, 0, NULL, 0 }
+};
 
 int main(int argc, char *argv[])
 {
+	int archives = 0;
+	int num_threads = 0;
+	int per_module = 0;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "aj:m", arg_opts, NULL)) != -1) {
+		switch (ch) {
+		case 'a':
+			archives = 1;
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+		case 'm':
+			per_module = 1;
+			break;
+		default:
+			usage();
+			goto exit_failure;
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc < 3) {
 		usage();
 		goto exit_failure;
@@ -45,16 +90,26 @@ int main(int argc, char *argv[])
 		goto exit_failure;
 	}
 
-	if (!generate_assembly(imports, imports_count)) {
+	if (archives) {
+		if (!generate_archives(imports, imports_count, per_module)) {
+			fprintf(stderr, "Error generating the stub archives\n");
+			goto exit_failure;
+		}
+	} else if (!generate_assembly(imports, imports_count, num_threads)) {
 		fprintf(stderr, "Error generating the assembly file\n");
 		goto exit_failure;
 	}
 
-	if (!generate_makefile(imports, imports_count)) {
+	if (!archives && !generate_makefile(imports, imports_count, per_module)) {
 		fprintf(stderr, "Error generating the assembly makefile\n");
 		goto exit_failure;
 	}
 
+	if (!remove_stale_files(imports, imports_count, archives, per_module)) {
+		fprintf(stderr, "Error removing stale stubs\n");
+		goto exit_failure;
+	}
+
 	for (i = 0; i < imports_count; i++)
 	{
 		vita_imports_free(imports[i]);
@@ -68,223 +123,666 @@ exit_failure:
 }
 
 
-int generate_assembly(vita_imports_t **imports, int imports_count)
-{
-	char filename[128];
-	FILE *fp;
-	int h, i, j, k;
+typedef struct {
+	vita_imports_lib_t **libs;
+	int num_libs;
+	int next_lib;
+	int failed;
+	pthread_mutex_t lock;
+} assembly_queue;
 
-	for (h = 0; h < imports_count; h++) {
-		vita_imports_t *imp = imports[h];
-		for (i = 0; i < imp->n_libs; i++) {
-			vita_imports_lib_t *library = imp->libs[i];
-			for (j = 0; j < library->n_modules; j++) {
-				vita_imports_module_t *module = library->modules[j];
+static int online_cpus(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
 
-				for (k = 0; k < module->n_functions; k++) {
-					vita_imports_stub_t *function = module->functions[k];
-					const char *fname = function->name;
-					char filename[4096];
-					snprintf(filename, sizeof(filename), "%s_%s_%s.S", library->name, module->name, fname);
-					if ((fp = fopen(filename, "w")) == NULL)
-						return 0;
-					fprintf(fp, ".arch armv7a\n\n");
-					fprintf(fp, ".section .vitalink.fstubs,\"ax\",%%progbits\n\n");
-					fprintf(fp,
-						"\t.align 4\n"
-						"\t.global %s\n"
-						"\t.type %s, %%function\n"
-						"%s:\n"
-						"\t.word 0x%08X\n"
-						"\t.word 0x%08X\n"
-						"\t.word 0x%08X\n"
-						"\t.align 4\n\n",
-						fname, fname, fname,
-						library->NID,
-						module->NID,
-						function->NID);
-					fclose(fp);
-				}
+/* Writes data to path unless it holds exactly that already, so that make
+ * does not see a stub as changed when it is not */
+static int write_if_changed(const char *path, const char *data, size_t size)
+{
+	struct stat st;
+	FILE *fp;
+	char *old;
+	int same = 0;
 
-				for (k = 0; k < module->n_variables; k++) {
-					vita_imports_stub_t *variable = module->variables[k];
-					const char *vname = variable->name;
-					char filename[4096];
-					snprintf(filename, sizeof(filename), "%s_%s_%s.S", library->name, module->name, vname);
-					if ((fp = fopen(filename, "w")) == NULL)
-						return 0;
-					fprintf(fp, ".arch armv7a\n\n");
-					fprintf(fp, ".section .vitalink.vstubs,\"aw\",%%progbits\n\n");
-					fprintf(fp,
-						"\t.align 4\n"
-						"\t.global %s\n"
-						"\t.type %s, %%object\n"
-						"%s:\n"
-						"\t.word 0x%08X\n"
-						"\t.word 0x%08X\n"
-						"\t.word 0x%08X\n"
-						"\t.align 4\n\n",
-						vname, vname, vname,
-						library->NID,
-						module->NID,
-						variable->NID);
-					fclose(fp);
-				}
-			}
+	if (stat(path, &st) == 0 && (size_t)st.st_size == size && (fp = fopen(path, "rb")) != NULL) {
+		if ((old = malloc(size ? size : 1)) != NULL) {
+			same = fread(old, 1, size, fp) == size && memcmp(old, data, size) == 0;
+			free(old);
 		}
+		fclose(fp);
+		if (same)
+			return 1;
+	}
+
+	if ((fp = fopen(path, "wb")) == NULL) {
+		perror(path);
+		return 0;
+	}
+	if (fwrite(data, 1, size, fp) != size) {
+		perror(path);
+		fclose(fp);
+		return 0;
+	}
+	if (fclose(fp) != 0) {
+		perror(path);
+		return 0;
 	}
 
 	return 1;
 }
 
-char *g_kernel_objs;
-size_t g_special_size, g_special_written;
-FILE *fp;
+static int write_stub(vita_imports_lib_t *library, vita_imports_module_t *module,
+		vita_imports_stub_t *stub, int is_variable)
+{
+	char filename[4096];
+	char *text;
+	size_t size = 3 * strlen(stub->name) + 256;
+	int len, ok;
+
+	snprintf(filename, sizeof(filename), "%s_%s_%s.S", library->name, module->name, stub->name);
+
+	if ((text = malloc(size)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+
+	len = snprintf(text, size,
+		".arch armv7a\n\n"
+		".section .vitalink.%s,\"%s\",%%progbits\n\n"
+		"\t.align 4\n"
+		"\t.global %s\n"
+		"\t.type %s, %%%s\n"
+		"%s:\n"
+		"\t.word 0x%08X\n"
+		"\t.word 0x%08X\n"
+		"\t.word 0x%08X\n"
+		"\t.align 4\n\n",
+		is_variable ? "vstubs" : "fstubs",
+		is_variable ? "aw" : "ax",
+		stub->name,
+		stub->name, is_variable ? "object" : "function",
+		stub->name,
+		library->NID,
+		module->NID,
+		stub->NID);
+
+	ok = write_if_changed(filename, text, len);
+	free(text);
+	return ok;
+}
 
-void write_symbol(const char *symbol, int is_kernel)
+static void *assembly_worker(void *arg)
 {
-	if (is_kernel) {
-		size_t len = strlen(symbol);
-		while (g_special_written + len >= g_special_size) {
-			g_special_size *= 2;
-			g_kernel_objs = realloc(g_kernel_objs, g_special_size);
+	assembly_queue *queue = arg;
+	vita_imports_lib_t *library;
+	int i, j, k;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		i = queue->failed ? queue->num_libs : queue->next_lib++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= queue->num_libs)
+			break;
+
+		library = queue->libs[i];
+		for (j = 0; j < library->n_modules; j++) {
+			vita_imports_module_t *module = library->modules[j];
+
+			for (k = 0; k < module->n_functions; k++) {
+				if (!write_stub(library, module, module->functions[k], 0))
+					goto failure;
+			}
+
+			for (k = 0; k < module->n_variables; k++) {
+				if (!write_stub(library, module, module->variables[k], 1))
+					goto failure;
+			}
 		}
-		strcat(g_kernel_objs, symbol);
-		g_special_written += len;
+		continue;
+
+	failure:
+		pthread_mutex_lock(&queue->lock);
+		queue->failed = 1;
+		pthread_mutex_unlock(&queue->lock);
 	}
-	fprintf(fp, "%s", symbol); // write regardless if its kernel or not
+
+	return NULL;
 }
 
-int generate_makefile(vita_imports_t **imports, int imports_count)
+/* Writes a .S for every stub, one library per worker at a time.  Files that
+ * already hold what they would be given are left alone. */
+int generate_assembly(vita_imports_t **imports, int imports_count, int num_threads)
 {
-	int h, i, j, k;
-	int is_special;
+	assembly_queue queue = {0};
+	pthread_t *threads;
+	int h, i, started;
 
-	if ((fp = fopen("Makefile", "w")) == NULL) {
+	for (h = 0; h < imports_count; h++)
+		queue.num_libs += imports[h]->n_libs;
+
+	if ((queue.libs = malloc((queue.num_libs ? queue.num_libs : 1) * sizeof(vita_imports_lib_t *))) == NULL)
 		return 0;
+
+	queue.num_libs = 0;
+	for (h = 0; h < imports_count; h++) {
+		for (i = 0; i < imports[h]->n_libs; i++)
+			queue.libs[queue.num_libs++] = imports[h]->libs[i];
 	}
 
-	g_special_size = 1024;
-	g_special_written = 0;
-	g_kernel_objs = malloc(g_special_size);
-	g_kernel_objs[0] = '\0';
+	pthread_mutex_init(&queue.lock, NULL);
 
-	fputs(
-		"ARCH ?= arm-vita-eabi\n"
-		"AS = $(ARCH)-as\n"
-		"AR = $(ARCH)-ar\n"
-		"RANLIB = $(ARCH)-ranlib\n\n"
-		"TARGETS =", fp);
+	if (num_threads <= 0)
+		num_threads = online_cpus();
+	if (num_threads > queue.num_libs)
+		num_threads = queue.num_libs;
+
+	/* The calling thread always works too */
+	threads = calloc(num_threads ? num_threads : 1, sizeof(pthread_t));
+	for (started = 0; threads && started < num_threads - 1; started++) {
+		if (pthread_create(threads + started, NULL, assembly_worker, &queue) != 0)
+			break;
+	}
+	assembly_worker(&queue);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&queue.lock);
+	free(threads);
+	free(queue.libs);
+
+	return !queue.failed;
+}
+
+/* Every library gets a lib<library>_stub.a of its non-kernel modules, unless
+ * those get archives of their own.  SceKernel's always collects the stubs of
+ * every kernel module as well. */
+static int has_library_archive(const vita_imports_lib_t *library, int per_module)
+{
+	return !per_module || strcmp(KERNEL_LIBS_STUB, library->name) == 0;
+}
+
+/* Kernel modules always get a lib<module>_stub.a, other modules only with
+ * --per-module, so that apps link against just the modules they use */
+static int has_module_archive(const vita_imports_module_t *module, int per_module)
+{
+	return module->is_kernel || per_module;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	size_t len = strlen(name), suffix_len = strlen(suffix);
+
+	return len >= suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+static int add_name(char ***names, int *count, int *allocation, const char *name)
+{
+	char **grown;
+
+	if (*count == *allocation) {
+		grown = realloc(*names, (*allocation ? *allocation * 2 : 256) * sizeof(char *));
+		if (!grown)
+			return 0;
+		*names = grown;
+		*allocation = *allocation ? *allocation * 2 : 256;
+	}
+
+	if (((*names)[*count] = strdup(name)) == NULL)
+		return 0;
+	(*count)++;
+
+	return 1;
+}
+
+/* Lists, one name per line, every file the last run generated */
+#define GENERATED_LIST ".vita-libs-gen"
+
+/* Removes the files the previous run generated and this one did not: the
+ * stubs of NIDs that are no longer in the database, with the objects the
+ * Makefile built from them, and the archives and object lists of libraries
+ * and modules no longer there.  Only files named in GENERATED_LIST are ever
+ * removed, so anything else in the output directory is left alone.  The
+ * list is then rewritten for this run. */
+int remove_stale_files(vita_imports_t **imports, int imports_count, int archives, int per_module)
+{
+	char filename[4096], line[4096];
+	const char *key = line;
+	char **names = NULL;
+	int num_names = 0, names_allocation = 0;
+	int ok = 0;
+	int h, i, j, k;
+	size_t len;
+	FILE *fp;
+
+	if (!archives && !add_name(&names, &num_names, &names_allocation, "Makefile"))
+		goto out_of_memory;
 
 	for (h = 0; h < imports_count; h++) {
-		vita_imports_t *imp = imports[h];
-		for (i = 0; i < imp->n_libs; i++) {
-			fprintf(fp, " lib%s_stub.a", imp->libs[i]->name);
+		for (i = 0; i < imports[h]->n_libs; i++) {
+			vita_imports_lib_t *library = imports[h]->libs[i];
 
-			for (j = 0; j < imp->libs[i]->n_modules; j++) {
-				vita_imports_module_t *module = imp->libs[i]->modules[j];
+			for (j = -1; j < library->n_modules; j++) {
+				const char *target = NULL;
 
-				if (!module->is_kernel)
+				if (j < 0 && has_library_archive(library, per_module))
+					target = library->name;
+				else if (j >= 0 && has_module_archive(library->modules[j], per_module))
+					target = library->modules[j]->name;
+				if (!target)
 					continue;
 
-				fprintf(fp, " lib%s_stub.a", module->name);
+				snprintf(filename, sizeof(filename), "lib%s_stub.a", target);
+				if (!add_name(&names, &num_names, &names_allocation, filename))
+					goto out_of_memory;
+				snprintf(filename, sizeof(filename), "lib%s_stub.objs", target);
+				if (!archives && !add_name(&names, &num_names, &names_allocation, filename))
+					goto out_of_memory;
+			}
+
+			for (j = 0; !archives && j < library->n_modules; j++) {
+				vita_imports_module_t *module = library->modules[j];
+
+				for (k = 0; k < module->n_functions + module->n_variables; k++) {
+					vita_imports_stub_t *stub = k < module->n_functions
+						? module->functions[k] : module->variables[k - module->n_functions];
+					snprintf(filename, sizeof(filename), "%s_%s_%s.S", library->name, module->name, stub->name);
+					if (!add_name(&names, &num_names, &names_allocation, filename))
+						goto out_of_memory;
+				}
 			}
 		}
 	}
 
-	fprintf(fp, "\n\n");
+	qsort(names, num_names, sizeof(char *), compare_names);
+
+	if ((fp = fopen(GENERATED_LIST, "rb")) != NULL) {
+		while (fgets(line, sizeof(line), fp)) {
+			len = strcspn(line, "\r\n");
+			line[len] = '\0';
+
+			/* Never follow a name out of the output directory */
+			if (len == 0 || line[0] == '.' || strpbrk(line, "/\\:"))
+				continue;
+			if (bsearch(&key, names, num_names, sizeof(char *), compare_names))
+				continue;
+
+			if (remove(line) != 0 && errno != ENOENT)
+				perror(line);
+			if (has_suffix(line, ".S")) {
+				line[len - 1] = 'o';
+				if (remove(line) != 0 && errno != ENOENT)
+					perror(line);
+			}
+		}
+		fclose(fp);
+	}
+
+	if ((fp = fopen(GENERATED_LIST, "wb")) == NULL) {
+		perror(GENERATED_LIST);
+		goto exit;
+	}
+	for (i = 0; i < num_names; i++)
+		fprintf(fp, "%s\n", names[i]);
+	if (fclose(fp) != 0) {
+		perror(GENERATED_LIST);
+		goto exit;
+	}
+
+	ok = 1;
+	goto exit;
+
+out_of_memory:
+	fprintf(stderr, "Out of memory\n");
+exit:
+	for (i = 0; i < num_names; i++)
+		free(names[i]);
+	free(names);
+	return ok;
+}
+
+static int add_module_stubs(stub_archive_t *ar, vita_imports_lib_t *library, vita_imports_module_t *module)
+{
+	char name[4096];
+	int k;
+
+	for (k = 0; k < module->n_functions; k++) {
+		vita_imports_stub_t *function = module->functions[k];
+		snprintf(name, sizeof(name), "%s_%s_%s.o", library->name, module->name, function->name);
+		if (!stub_archive_add(ar, name, function->name, 0, library->NID, module->NID, function->NID))
+			return 0;
+	}
+
+	for (k = 0; k < module->n_variables; k++) {
+		vita_imports_stub_t *variable = module->variables[k];
+		snprintf(name, sizeof(name), "%s_%s_%s.o", library->name, module->name, variable->name);
+		if (!stub_archive_add(ar, name, variable->name, 1, library->NID, module->NID, variable->NID))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Writes ar to filename unless it holds those bytes already */
+static int write_archive(const stub_archive_t *ar, const char *filename)
+{
+	void *data;
+	size_t size;
+	int ok;
+
+	if (!stub_archive_build(ar, &data, &size))
+		return 0;
+
+	ok = write_if_changed(filename, data, size);
+	free(data);
+	return ok;
+}
+
+/* Writes the archives the Makefile would build, with the same members in
+ * the same order, without going through the assembler.  Each comes with
+ * its symbol index, so there is no ranlib step either. */
+int generate_archives(vita_imports_t **imports, int imports_count, int per_module)
+{
+	char filename[4096];
+	stub_archive_t *kernel_ar, *ar = NULL;
+	int has_kernel_lib = 0;
+	int h, i, j;
+
+	if ((kernel_ar = stub_archive_new()) == NULL)
+		goto failure;
 
 	for (h = 0; h < imports_count; h++) {
 		vita_imports_t *imp = imports[h];
 		for (i = 0; i < imp->n_libs; i++) {
 			vita_imports_lib_t *library = imp->libs[i];
-			is_special = (strcmp(KERNEL_LIBS_STUB, library->name) == 0);
+			int is_special = (strcmp(KERNEL_LIBS_STUB, library->name) == 0);
+			stub_archive_t *lib_ar = NULL;
+
+			if (is_special) {
+				has_kernel_lib = 1;
+				lib_ar = kernel_ar;
+			} else if (has_library_archive(library, per_module)) {
+				snprintf(filename, sizeof(filename), "lib%s_stub.a", library->name);
+				if ((lib_ar = stub_archive_new()) == NULL)
+					goto failure;
+				ar = lib_ar;
+			}
 
-			if (!is_special) {
-				fprintf(fp, "%s_OBJS =", library->name);
+			for (j = 0; lib_ar && j < library->n_modules; j++) {
+				if (!library->modules[j]->is_kernel
+				    && !add_module_stubs(lib_ar, library, library->modules[j]))
+					goto failure;
+			}
+
+			if (ar) {
+				if (!write_archive(ar, filename))
+					goto failure_write;
+				stub_archive_free(ar);
+				ar = NULL;
 			}
 
 			for (j = 0; j < library->n_modules; j++) {
 				vita_imports_module_t *module = library->modules[j];
 
-				if(module->is_kernel)
+				if (!has_module_archive(module, per_module))
 					continue;
 
-				char buf[4096];
-				for (k = 0; k < module->n_functions; k++) {
-					vita_imports_stub_t *function = module->functions[k];
-					snprintf(buf, sizeof(buf), " %s_%s_%s.o", library->name, module->name, function->name);
-					write_symbol(buf, is_special);
-				}
-				for (k = 0; k < module->n_variables; k++) {
-					vita_imports_stub_t *variable = module->variables[k];
-					snprintf(buf, sizeof(buf), " %s_%s_%s.o", library->name, module->name, variable->name);
-					write_symbol(buf, is_special);
-				}
+				snprintf(filename, sizeof(filename), "lib%s_stub.a", module->name);
+				if ((ar = stub_archive_new()) == NULL
+				    || !add_module_stubs(ar, library, module)
+				    || (module->is_kernel && !add_module_stubs(kernel_ar, library, module)))
+					goto failure;
+				if (!write_archive(ar, filename))
+					goto failure_write;
+				stub_archive_free(ar);
+				ar = NULL;
 			}
+		}
+	}
+
+	snprintf(filename, sizeof(filename), "lib%s_stub.a", KERNEL_LIBS_STUB);
+	if (has_kernel_lib && !write_archive(kernel_ar, filename))
+		goto failure_write;
 
-			if (!is_special) {
-				fprintf(fp, "\n");
+	stub_archive_free(kernel_ar);
+	return 1;
+
+failure:
+	fprintf(stderr, "Out of memory\n");
+failure_write:
+	stub_archive_free(ar);
+	stub_archive_free(kernel_ar);
+	return 0;
+}
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} text_buffer;
+
+/* Appends to text in amortized constant time per byte */
+static int text_append(text_buffer *text, const char *format, ...)
+{
+	va_list ap;
+	char *data;
+	size_t size;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(text->data + text->len, text->size - text->len, format, ap);
+	va_end(ap);
+	if (len < 0)
+		return 0;
+
+	if (text->len + len >= text->size) {
+		size = text->size ? text->size * 2 : 4096;
+		while (text->len + len >= size)
+			size *= 2;
+		if ((data = realloc(text->data, size)) == NULL)
+			return 0;
+		text->data = data;
+		text->size = size;
+
+		va_start(ap, format);
+		vsnprintf(text->data + text->len, text->size - text->len, format, ap);
+		va_end(ap);
+	}
+
+	text->len += len;
+	return 1;
+}
+
+/* An archive the Makefile builds, from the objects listed one per line */
+typedef struct {
+	char *name;		/* Without lib and _stub.a */
+	text_buffer *objs;
+} stub_target;
+
+static int add_target(stub_target **targets, int *count, int *allocation, const char *name, text_buffer *objs)
+{
+	stub_target *grown;
+
+	if (*count == *allocation) {
+		grown = realloc(*targets, (*allocation ? *allocation * 2 : 64) * sizeof(stub_target));
+		if (!grown)
+			return 0;
+		*targets = grown;
+		*allocation = *allocation ? *allocation * 2 : 64;
+	}
+
+	if (((*targets)[*count].name = strdup(name)) == NULL)
+		return 0;
+	(*targets)[*count].objs = objs;
+	(*count)++;
+
+	return 1;
+}
+
+static int add_module_objs(text_buffer *objs, vita_imports_lib_t *library, vita_imports_module_t *module)
+{
+	int k;
+
+	for (k = 0; k < module->n_functions; k++) {
+		if (!text_append(objs, "%s_%s_%s.o\n", library->name, module->name, module->functions[k]->name))
+			return 0;
+	}
+
+	for (k = 0; k < module->n_variables; k++) {
+		if (!text_append(objs, "%s_%s_%s.o\n", library->name, module->name, module->variables[k]->name))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Writes a Makefile that builds each lib*_stub.a from the objects listed in
+ * its lib*_stub.objs, which ar reads as a response file.  The archive also
+ * depends on that list, so a stub that went away makes it be built again
+ * from scratch rather than keep the old member.  Nothing is rewritten
+ * unless it changed. */
+int generate_makefile(vita_imports_t **imports, int imports_count, int per_module)
+{
+	text_buffer makefile = {0}, kernel_objs = {0};
+	stub_target *targets = NULL;
+	int num_targets = 0, targets_allocation = 0;
+	char filename[4096];
+	const char *obj, *end;
+	int h, i, j, ok = 0;
+
+	for (h = 0; h < imports_count; h++) {
+		vita_imports_t *imp = imports[h];
+		for (i = 0; i < imp->n_libs; i++) {
+			vita_imports_lib_t *library = imp->libs[i];
+			int is_special = (strcmp(KERNEL_LIBS_STUB, library->name) == 0);
+			text_buffer *objs = &kernel_objs;
+
+			if (!has_library_archive(library, per_module))
+				objs = NULL;
+			else if (!is_special && (objs = calloc(1, sizeof(text_buffer))) == NULL)
+				goto exit;
+			if (objs && !add_target(&targets, &num_targets, &targets_allocation, library->name, objs)) {
+				if (!is_special)
+					free(objs);
+				goto exit;
+			}
+
+			for (j = 0; objs && j < library->n_modules; j++) {
+				if (!library->modules[j]->is_kernel
+				    && !add_module_objs(objs, library, library->modules[j]))
+					goto exit;
 			}
 
 			for (j = 0; j < library->n_modules; j++) {
 				vita_imports_module_t *module = library->modules[j];
 
-				if (!module->is_kernel)
+				if (!has_module_archive(module, per_module))
 					continue;
 
-				char buf[4096];
-
-				fprintf(fp, "%s_OBJS =", module->name);
-
-				for (k = 0; k < module->n_functions; k++) {
-					vita_imports_stub_t *function = module->functions[k];
-					snprintf(buf, sizeof(buf), " %s_%s_%s.o", library->name, module->name, function->name);
-					write_symbol(buf, 1);
-				}
-
-				for (k = 0; k < module->n_variables; k++) {
-					vita_imports_stub_t *variable = module->variables[k];
-					snprintf(buf, sizeof(buf), " %s_%s_%s.o", library->name, module->name, variable->name);
-					write_symbol(buf, 1);
+				if ((objs = calloc(1, sizeof(text_buffer))) == NULL)
+					goto exit;
+				if (!add_target(&targets, &num_targets, &targets_allocation, module->name, objs)) {
+					free(objs);
+					goto exit;
 				}
-
-				fprintf(fp, "\n");
+				if (!add_module_objs(objs, library, module)
+				    || (module->is_kernel && !add_module_objs(&kernel_objs, library, module)))
+					goto exit;
 			}
 		}
 	}
 
-	// write kernel lib stub
-	fprintf(fp, "%s_OBJS =%s\n", KERNEL_LIBS_STUB, g_kernel_objs);
+	if (!text_append(&makefile,
+		"ARCH ?= arm-vita-eabi\n"
+		"AS = $(ARCH)-as\n"
+		"AR = $(ARCH)-ar\n"
+		"RANLIB = $(ARCH)-ranlib\n\n"
+		"TARGETS ="))
+		goto exit;
 
-	fputs(
-		"ALL_OBJS=\n\n"
-		"all: $(TARGETS)\n\n"
-		"define LIBRARY_template\n"
-		" $(1): $$($(1:lib%_stub.a=%)_OBJS)\n"
-		" ALL_OBJS += $$($(1:lib%_stub.a=%)_OBJS)\n"
-		"endef\n\n"
-		"$(foreach library,$(TARGETS),$(eval $(call LIBRARY_template,$(library))))\n\n"
+	for (i = 0; i < num_targets; i++) {
+		if (!text_append(&makefile, " \\\n\tlib%s_stub.a", targets[i].name))
+			goto exit;
+	}
+
+	if (!text_append(&makefile,
+		"\n\n"
 		"all: $(TARGETS)\n\n"
-		"clean:\n\n"
-		"\trm -f $(TARGETS) $(ALL_OBJS)\n\n"
+		"clean:\n"
+		"\trm -f $(TARGETS) *.o\n\n"
 		"$(TARGETS):\n"
-		"\t$(AR) cru $@ $?\n"
+		"\trm -f $@\n"
+		"\t$(AR) cru $@ @$(@:.a=.objs)\n"
 		"\t$(RANLIB) $@\n\n"
-		"%.o: %.S\n"
-		"\t$(AS) $< -o $@\n"
-		, fp);
+		"%%.o: %%.S\n"
+		"\t$(AS) $< -o $@\n"))
+		goto exit;
 
-	fclose(fp);
-	free(g_kernel_objs);
+	for (i = 0; i < num_targets; i++) {
+		text_buffer *objs = targets[i].objs;
 
-	return 1;
+		if (!text_append(&makefile, "\nlib%s_stub.a: lib%s_stub.objs", targets[i].name, targets[i].name))
+			goto exit;
+
+		for (obj = objs->data; obj && obj < objs->data + objs->len; obj = end + 1) {
+			end = strchr(obj, '\n');
+			if (!text_append(&makefile, " \\\n\t%.*s", (int)(end - obj), obj))
+				goto exit;
+		}
+
+		if (!text_append(&makefile, "\n"))
+			goto exit;
+
+		snprintf(filename, sizeof(filename), "lib%s_stub.objs", targets[i].name);
+		if (!write_if_changed(filename, objs->data ? objs->data : "", objs->len))
+			goto exit_written;
+	}
+
+	ok = write_if_changed("Makefile", makefile.data, makefile.len);
+	goto exit_written;
+
+exit:
+	fprintf(stderr, "Out of memory\n");
+exit_written:
+	for (i = 0; i < num_targets; i++) {
+		if (targets[i].objs != &kernel_objs) {
+			free(targets[i].objs->data);
+			free(targets[i].objs);
+		}
+		free(targets[i].name);
+	}
+	free(targets);
+	free(kernel_objs.data);
+	free(makefile.data);
+	return ok;
 }
 
 void usage()
 {
 	fprintf(stderr,
 		"vita-libs-gen by xerpi\n"
-		"usage:\n\tvita-libs-gen nids.json [extra.json ...] output-dir\n"
+		"usage:\n\tvita-libs-gen [-a] [-j threads] [-m] nids.json [extra.json ...] output-dir\n"
+		"\t-a, --archives: write the lib*_stub.a archives directly instead of\n"
+		"\t                assembly files and a Makefile to build them\n"
+		"\t-j, --jobs:     write the assembly files with this many threads,\n"
+		"\t                one per CPU by default\n"
+		"\t-m, --per-module: give every module a lib<module>_stub.a of its own,\n"
+		"\t                instead of one per library for all but kernel modules\n"
+		"\tStubs that did not change keep their files and modification times,\n"
+		"\tand files an earlier run generated for NIDs no longer in the database\n"
+		"\tare removed; " GENERATED_LIST " in output-dir lists them.\n"
 	);
 }
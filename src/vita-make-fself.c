@@ -1,38 +1,270 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#endif
 
 #include "self.h"
+#include "fself.h"
+
+#define COPY_BUFFER 0x10000
+#define PT_LOAD 1
+
+/* A segment's data as stored in a compressed SELF */
+typedef struct {
+	unsigned char *data;
+	uint64_t length;
+	int compressed;
+	int failed;
+} segment_blob;
+
+typedef struct {
+	const char *input_path;
+	const e_phdr *phdrs;
+	segment_blob *blobs;
+	int num_segments;
+	int next_segment;
+	pthread_mutex_t lock;
+} compress_queue;
 
 void usage(char *argv[]) {
-	fprintf(stderr, "Usage: %s [-s] input.velf output-eboot.bin\n", argv[0] ? argv[0] : "make_fself");
+	fprintf(stderr, "Usage: %s [-s] [-c] input.velf output-eboot.bin\n", argv[0] ? argv[0] : "make_fself");
 	fprintf(stderr, "\t-s: Generate a safe eboot.bin. A safe eboot.bin does not have access\n\tto restricted APIs and important parts of the filesystem.\n");
+	fprintf(stderr, "\t-c: Compress the loadable segments with zlib.\n");
 	exit(1);
 }
 
+static int online_cpus(void) {
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+/* Reads one segment and, for PT_LOAD, deflates it. Segments that do not
+ * get smaller are kept as they are. */
+static int load_segment(FILE *fin, const e_phdr *phdr, segment_blob *blob) {
+	unsigned char *raw, *packed;
+	uLongf packed_len;
+
+	if (phdr->p_filesz == 0)
+		return 1;
+
+	raw = malloc(phdr->p_filesz);
+	if (!raw)
+		return 0;
+	if (fseek(fin, phdr->p_offset, SEEK_SET) != 0 || fread(raw, phdr->p_filesz, 1, fin) != 1) {
+		free(raw);
+		return 0;
+	}
+	blob->data = raw;
+	blob->length = phdr->p_filesz;
+
+	if (phdr->p_type != PT_LOAD)
+		return 1;
+
+	packed_len = compressBound(phdr->p_filesz);
+	packed = malloc(packed_len);
+	if (packed && compress2(packed, &packed_len, raw, phdr->p_filesz, Z_BEST_COMPRESSION) == Z_OK
+			&& packed_len < phdr->p_filesz) {
+		free(raw);
+		blob->data = packed;
+		blob->length = packed_len;
+		blob->compressed = 1;
+	} else {
+		free(packed);
+	}
+
+	return 1;
+}
+
+static void *compress_worker(void *arg) {
+	compress_queue *queue = arg;
+	FILE *fin = fopen(queue->input_path, "rb");
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next_segment++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= queue->num_segments)
+			break;
+
+		if (!fin || !load_segment(fin, &queue->phdrs[i], &queue->blobs[i]))
+			queue->blobs[i].failed = 1;
+	}
+
+	if (fin)
+		fclose(fin);
+	return NULL;
+}
+
+/* Prepares every segment on one thread per CPU, each with its own handle on the input */
+static int compress_segments(const char *input_path, const e_phdr *phdrs, int num_segments, segment_blob *blobs) {
+	compress_queue queue = { 0 };
+	pthread_t *threads;
+	int num_threads = online_cpus();
+	int i, started;
+
+	queue.input_path = input_path;
+	queue.phdrs = phdrs;
+	queue.blobs = blobs;
+	queue.num_segments = num_segments;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	if (num_threads > num_segments)
+		num_threads = num_segments;
+
+	/* The calling thread always works too */
+	threads = calloc(num_threads ? num_threads : 1, sizeof(pthread_t));
+	for (started = 0; threads && started < num_threads - 1; started++) {
+		if (pthread_create(threads + started, NULL, compress_worker, &queue) != 0)
+			break;
+	}
+	compress_worker(&queue);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&queue.lock);
+	free(threads);
+
+	for (i = 0; i < num_segments; i++) {
+		if (blobs[i].failed)
+			return 0;
+	}
+	return 1;
+}
+
+/* Copies the first len bytes of fin to fout at HEADER_LEN. The data goes
+ * kernel-side where possible and is never held in memory as a whole. */
+static int copy_body(FILE *fin, FILE *fout, uint64_t len) {
+	static char buffer[COPY_BUFFER];
+	uint64_t done = 0;
+	size_t chunk;
+
+	if (fflush(fout) != 0)
+		return 0;
+
+#ifndef _WIN32
+	int in_fd = fileno(fin);
+	int out_fd = fileno(fout);
+	ssize_t ret;
+
+#if HAVE_COPY_FILE_RANGE
+	off_t in_off = 0, out_off = HEADER_LEN;
+	while (done < len) {
+		ret = copy_file_range(in_fd, &in_off, out_fd, &out_off, len - done, 0);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	if (done == len)
+		return 1;
+#endif
+
+#if defined(__linux__)
+	// sendfile takes the output position from the descriptor
+	off_t send_off = done;
+	if (lseek(out_fd, HEADER_LEN + done, SEEK_SET) < 0)
+		return 0;
+	while (done < len) {
+		ret = sendfile(out_fd, in_fd, &send_off, len - done);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	if (done == len)
+		return 1;
+#endif
+
+	char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, in_fd, 0);
+	if (map != MAP_FAILED) {
+		while (done < len) {
+			ret = pwrite(out_fd, map + done, len - done, HEADER_LEN + done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+		munmap(map, len);
+		return done == len;
+	}
+#endif
+
+	// Plain buffered copy, a chunk at a time
+	if (fseek(fin, done, SEEK_SET) != 0 || fseek(fout, HEADER_LEN + done, SEEK_SET) != 0)
+		return 0;
+	while (done < len) {
+		chunk = len - done < COPY_BUFFER ? len - done : COPY_BUFFER;
+		if (fread(buffer, chunk, 1, fin) != 1 || fwrite(buffer, chunk, 1, fout) != 1)
+			return 0;
+		done += chunk;
+	}
+
+	return 1;
+}
+
+static void free_blobs(segment_blob *blobs, int num_segments) {
+	for (int i = 0; i < num_segments; i++)
+		free(blobs[i].data);
+	free(blobs);
+}
+
 int main(int argc, char *argv[]) {
 	const char *input_path, *output_path;
 	FILE *fin = NULL;
 	FILE *fout = NULL;
-
-	if (argc != 3 && argc != 4)
-		usage(argv);
+	e_phdr *phdrs = NULL;
+	fself_segment *sinfos = NULL;
+	segment_blob *blobs = NULL;
+	int aligned = 0;
 
 	int safe = 0;
-	if (argc == 4) {
-		if (strcmp(argv[1], "-s") == 0)
+	int compress = 0;
+	int argi;
+	for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
+		if (strcmp(argv[argi], "-s") == 0)
 			safe = 1;
+		else if (strcmp(argv[argi], "-c") == 0)
+			compress = 1;
 		else
 			usage(argv);
-
-		input_path = argv[2];
-		output_path = argv[3];
-	} else {
-		input_path = argv[1];
-		output_path = argv[2];
 	}
 
+	if (argc - argi != 2)
+		usage(argv);
+
+	input_path = argv[argi];
+	output_path = argv[argi + 1];
+
 	fin = fopen(input_path, "rb");
 	if (!fin) {
 		perror("Failed to open input file");
@@ -42,145 +274,138 @@ int main(int argc, char *argv[]) {
 	size_t sz = ftell(fin);
 	fseek(fin, 0, SEEK_SET);
 
-	char *input = calloc(1, sz);
-	if (!input) {
-		perror("Failed to allocate buffer for input file");
-		goto error;
-	}
-	if (fread(input, sz, 1, fin) != 1) {
-		static const char s[] = "Failed to read input file";
+	// Only the ELF header and program headers are needed up front
+	ELF_header ehdr_in;
+	ELF_header *ehdr = &ehdr_in;
+	if (fread(ehdr, sizeof(*ehdr), 1, fin) != 1) {
+		static const char s[] = "Failed to read input ELF header";
 		if (feof(fin))
 			fprintf(stderr, "%s: unexpected end of file\n", s);
 		else
 			perror(s);
 		goto error;
 	}
-	fclose(fin);
-	fin = NULL;
 
-	ELF_header *ehdr = (ELF_header*)input;
-
-	SCE_header hdr = { 0 };
-	hdr.magic = 0x454353; // "SCE\0"
-	hdr.version = 3;
-	hdr.sdk_type = 0xC0;
-	hdr.header_type = 1;
-	hdr.metadata_offset = 0x600; // ???
-	hdr.header_len = HEADER_LEN;
-	hdr.elf_filesize = sz;
-	// self_filesize
-	hdr.self_offset = 4;
-	hdr.appinfo_offset = 0x80;
-	hdr.elf_offset = sizeof(SCE_header) + sizeof(SCE_appinfo);
-	hdr.phdr_offset = hdr.elf_offset + sizeof(ELF_header);
-	// hdr.shdr_offset = ;
-	hdr.section_info_offset = hdr.phdr_offset + sizeof(e_phdr) * ehdr->e_phnum;
-	hdr.sceversion_offset = hdr.section_info_offset + sizeof(segment_info) * ehdr->e_phnum;
-	hdr.controlinfo_offset = hdr.sceversion_offset + sizeof(SCE_version);
-	hdr.controlinfo_size = sizeof(SCE_controlinfo_5) + sizeof(SCE_controlinfo_6) + sizeof(SCE_controlinfo_7);
-	hdr.self_filesize = hdr.section_info_offset + sizeof(segment_info) * ehdr->e_phnum + sz;
+	phdrs = calloc(ehdr->e_phnum ? ehdr->e_phnum : 1, sizeof(e_phdr));
+	if (!phdrs) {
+		perror("Failed to allocate program headers");
+		goto error;
+	}
+	for (int i = 0; i < ehdr->e_phnum; ++i) {
+		if (fseek(fin, ehdr->e_phoff + ehdr->e_phentsize * i, SEEK_SET) != 0
+				|| fread(&phdrs[i], sizeof(e_phdr), 1, fin) != 1) {
+			static const char s[] = "Failed to read program headers";
+			if (feof(fin))
+				fprintf(stderr, "%s: unexpected end of file\n", s);
+			else
+				perror(s);
+			goto error;
+		}
+	}
+
+	aligned = fself_fixup_phdrs(phdrs, ehdr->e_phnum);
 
 	uint32_t offset_to_real_elf = HEADER_LEN;
 
-	// SCE_header should be ok
-
-	SCE_appinfo appinfo = { 0 };
-	if (safe)
-		appinfo.authid = 0x2F00000000000002ULL;
-	else
-		appinfo.authid = 0x2F00000000000001ULL;
-	appinfo.vendor_id = 0;
-	appinfo.self_type = 8;
-	appinfo.version = 0x1000000000000;
-	appinfo.padding = 0;
-
-	SCE_version ver = { 0 };
-	ver.unk1 = 1;
-	ver.unk2 = 0;
-	ver.unk3 = 16;
-	ver.unk4 = 0;
-
-	SCE_controlinfo_5 control_5 = { 0 };
-	control_5.common.type = 5;
-	control_5.common.size = sizeof(control_5);
-	control_5.common.unk = 1;
-	SCE_controlinfo_6 control_6 = { 0 };
-	control_6.common.type = 6;
-	control_6.common.size = sizeof(control_6);
-	control_6.common.unk = 1;
-	control_6.unk1 = 1;
-	SCE_controlinfo_7 control_7 = { 0 };
-	control_7.common.type = 7;
-	control_7.common.size = sizeof(control_7);
-
-	ELF_header myhdr = { 0 };
-	memcpy(myhdr.e_ident, "\177ELF\1\1\1", 8);
-	myhdr.e_type = ehdr->e_type;
-	myhdr.e_machine = 0x28;
-	myhdr.e_version = 1;
-	myhdr.e_entry = ehdr->e_entry;
-	myhdr.e_phoff = 0x34;
-	myhdr.e_flags = 0x05000000U;
-	myhdr.e_ehsize = 0x34;
-	myhdr.e_phentsize = 0x20;
-	myhdr.e_phnum = ehdr->e_phnum;
+	// where each segment's data ends up, for the segment info that sony loader expects
+	sinfos = calloc(ehdr->e_phnum ? ehdr->e_phnum : 1, sizeof(fself_segment));
+	if (!sinfos) {
+		perror("Failed to allocate segment info");
+		goto error;
+	}
+
+	uint64_t body_len;
+	uint64_t prefix_len = 0;
+	if (compress) {
+		// The ELF and program headers are copied as usual, followed by each segment
+		blobs = calloc(ehdr->e_phnum ? ehdr->e_phnum : 1, sizeof(segment_blob));
+		if (!blobs) {
+			perror("Failed to allocate segments");
+			goto error;
+		}
+		if (!compress_segments(input_path, phdrs, ehdr->e_phnum, blobs)) {
+			fprintf(stderr, "Failed to read or compress segments\n");
+			goto error;
+		}
+
+		prefix_len = ehdr->e_phoff + (uint64_t)ehdr->e_phentsize * ehdr->e_phnum;
+		if (prefix_len < sizeof(ELF_header))
+			prefix_len = sizeof(ELF_header);
+
+		body_len = prefix_len;
+		for (int i = 0; i < ehdr->e_phnum; ++i) {
+			body_len = (body_len + 0xF) & ~(uint64_t)0xF;
+			sinfos[i].offset = offset_to_real_elf + body_len;
+			sinfos[i].length = blobs[i].length;
+			sinfos[i].compressed = blobs[i].compressed;
+			body_len += blobs[i].length;
+		}
+	} else {
+		body_len = sz;
+		for (int i = 0; i < ehdr->e_phnum; ++i) {
+			e_phdr *phdr = &phdrs[i]; // TODO: sanity checks
+			sinfos[i].offset = offset_to_real_elf + phdr->p_offset;
+			sinfos[i].length = phdr->p_filesz;
+		}
+	}
+
+	static char header[HEADER_LEN];
+	if (!fself_build_header(header, ehdr, phdrs, sinfos, sz, body_len, safe ? FSELF_AUTHID_SAFE : FSELF_AUTHID_DEFAULT)) {
+		fprintf(stderr, "Too many program headers to fit the SELF header\n");
+		goto error;
+	}
 
 	fout = fopen(output_path, "wb");
 	if (!fout) {
 		perror("Failed to open output file");
 		goto error;
 	}
-	if (fwrite(&hdr, sizeof(hdr), 1, fout) != 1) {
+	if (fwrite(header, sizeof(header), 1, fout) != 1) {
 		perror("Failed to write SCE header");
 		goto error;
 	}
-	if (fwrite(&appinfo, sizeof(appinfo), 1, fout) != 1) {
-		perror("Failed to write appinfo");
+
+	if (!copy_body(fin, fout, compress ? prefix_len : sz)) {
+		perror("Failed to write a copy of input ELF");
 		goto error;
 	}
-	fwrite(&myhdr, sizeof(myhdr), 1, fout);
-	// copy elf phdr in same format
-	for (int i = 0; i < ehdr->e_phnum; ++i) {
-		e_phdr *phdr = (e_phdr*)(input + ehdr->e_phoff + ehdr->e_phentsize * i);
-		// but fixup alignment, TODO: fix in toolchain
-		if (phdr->p_align > 0x1000)
-			phdr->p_align = 0x1000;
-		if (fwrite(phdr, sizeof(*phdr), 1, fout) != 1) {
-			perror("Failed to write phdr");
-			goto error;
-		}
-	}
 
-	// convert elf phdr info to segment info that sony loader expects
-	for (int i = 0; i < ehdr->e_phnum; ++i) {
-		e_phdr *phdr = (e_phdr*)(input + ehdr->e_phoff + ehdr->e_phentsize * i); // TODO: sanity checks
-		segment_info sinfo = { 0 };
-		sinfo.offset = offset_to_real_elf + phdr->p_offset;
-		sinfo.length = phdr->p_filesz;
-		sinfo.compression = 1;
-		sinfo.encryption = 2;
-		if (fwrite(&sinfo, sizeof(sinfo), 1, fout) != 1) {
-			perror("Failed to write segment info");
-			goto error;
+	// The copy carries the program headers too, so give it the same alignment fixup
+	if (aligned) {
+		for (int i = 0; i < ehdr->e_phnum; ++i) {
+			if (fseek(fout, HEADER_LEN + ehdr->e_phoff + ehdr->e_phentsize * i, SEEK_SET) != 0
+					|| fwrite(&phdrs[i], sizeof(e_phdr), 1, fout) != 1) {
+				perror("Failed to write a copy of input ELF");
+				goto error;
+			}
 		}
 	}
 
-	if (fwrite(&ver, sizeof(ver), 1, fout) != 1) {
-		perror("Failed to write SCE_version");
-		goto error;
+	if (compress) {
+		for (int i = 0; i < ehdr->e_phnum; ++i) {
+			if (blobs[i].length == 0)
+				continue;
+			if (fseek(fout, sinfos[i].offset, SEEK_SET) != 0
+					|| fwrite(blobs[i].data, blobs[i].length, 1, fout) != 1) {
+				perror("Failed to write segment");
+				goto error;
+			}
+		}
 	}
-	fwrite(&control_5, sizeof(control_5), 1, fout);
-	fwrite(&control_6, sizeof(control_6), 1, fout);
-	fwrite(&control_7, sizeof(control_7), 1, fout);
-
-	fseek(fout, HEADER_LEN, SEEK_SET);
 
-	if (fwrite(input, sz, 1, fout) != 1) {
-		perror("Failed to write a copy of input ELF");
+	fclose(fin);
+	fin = NULL;
+	if (fclose(fout) != 0) {
+		fout = NULL;
+		perror("Failed to write output file");
 		goto error;
 	}
+	fout = NULL;
 
-	fclose(fout);
+	if (blobs)
+		free_blobs(blobs, ehdr->e_phnum);
+	free(sinfos);
+	free(phdrs);
 
 	return 0;
 error:
@@ -188,5 +413,9 @@ error:
 		fclose(fin);
 	if (fout)
 		fclose(fout);
+	if (blobs)
+		free_blobs(blobs, ehdr->e_phnum);
+	free(sinfos);
+	free(phdrs);
 	return 1;
 }
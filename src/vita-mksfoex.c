@@ -12,351 +12,297 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "getopt.h"
-#include "types.h"
-
-#define PSF_MAGIC	0x46535000
-#define PSF_VERSION  0x00000101
-
-struct SfoHeader 
-{
-	uint32_t magic;
-	uint32_t version;
-	uint32_t keyofs;
-	uint32_t valofs;
-	uint32_t count;
-};
-
-struct SfoEntry
-{
-	uint16_t nameofs;
-	uint8_t  alignment;
-	uint8_t  type;
-	uint32_t valsize;
-	uint32_t totalsize;
-	uint32_t dataofs;
-};
-
-#define PSF_TYPE_BIN  0
-#define PSF_TYPE_STR  2
-#define PSF_TYPE_VAL  4
-
-struct EntryContainer
-{
-	const char *name;
-	int type;
-	uint32_t value;
-	const char *data;
-};
-
-struct EntryContainer g_defaults[] = {
-	{ "APP_VER", PSF_TYPE_STR, 0, "00.00" },
-	{ "ATTRIBUTE", PSF_TYPE_VAL, 0x8000, NULL },
-	{ "ATTRIBUTE2", PSF_TYPE_VAL, 0, NULL },
-	{ "ATTRIBUTE_MINOR", PSF_TYPE_VAL, 0x10, NULL },
-	{ "BOOT_FILE", PSF_TYPE_STR, 32, "" },
-	{ "CATEGORY", PSF_TYPE_STR, 0, "gd" },
-	{ "CONTENT_ID", PSF_TYPE_STR, 48, "" },
-	{ "EBOOT_APP_MEMSIZE", PSF_TYPE_VAL, 0, NULL },
-	{ "EBOOT_ATTRIBUTE", PSF_TYPE_VAL, 0, NULL },
-	{ "EBOOT_PHY_MEMSIZE", PSF_TYPE_VAL, 0, NULL },
-	{ "LAREA_TYPE", PSF_TYPE_VAL, 0, NULL },
-	{ "NP_COMMUNICATION_ID", PSF_TYPE_STR, 16, "" },
-	{ "PARENTAL_LEVEL", PSF_TYPE_VAL, 0, NULL },
-	{ "PSP2_DISP_VER", PSF_TYPE_STR, 0, "00.000" },
-	{ "PSP2_SYSTEM_VER", PSF_TYPE_VAL, 0, NULL },
-	{ "STITLE", PSF_TYPE_STR, 52, "Homebrew" },
-	{ "TITLE", PSF_TYPE_STR, 0x80, "Homebrew" },
-	{ "TITLE_ID", PSF_TYPE_STR, 0, "ABCD99999" },
-	{ "VERSION", PSF_TYPE_STR, 0, "00.00" },
-};
-
-#define MAX_OPTIONS (256)
+#include "sfo.h"
 
 static const char *g_title = NULL;
 static const char *g_filename = NULL;
+static const char *g_batch = NULL;
 static int g_empty = 0;
-static struct EntryContainer g_vals[MAX_OPTIONS];
+static sfo_t *g_sfo = NULL;
 
 static struct option arg_opts[] = 
 {
 	{"dword", required_argument, NULL, 'd'},
 	{"string", required_argument, NULL, 's'},
 	{"empty", no_argument, NULL, 'e'},
+	{"batch", required_argument, NULL, 'b'},
 	{ NULL, 0, NULL, 0 }
 };
 
-struct EntryContainer *find_free()
+/* Process the arguments */
+int process_args(int argc, char **argv)
 {
-	int i;
+	int ch;
 
-	for(i = 0; i < MAX_OPTIONS; i++)
+	g_title = NULL;
+	g_filename = NULL;
+	g_batch = NULL;
+	g_empty = 0;
+
+	ch = getopt_long(argc, argv, "ed:s:b:", arg_opts, NULL);
+	while(ch != -1)
 	{
-		if(g_vals[i].name == NULL)
+		switch(ch)
 		{
-			return &g_vals[i];
-		}
-	}
+			case 'd' : if(!sfo_set_assignment(g_sfo, optarg, SFO_TYPE_INT))
+					   {
+						   return 0;
+					   }
+				break;
+			case 's' : if(!sfo_set_assignment(g_sfo, optarg, SFO_TYPE_STR))
+					   {
+						   return 0;
+					   }
+				break;
+			case 'e' : g_empty = 1;
+				break;
+			case 'b' : g_batch = optarg;
+				break;
+			default  : break;
+		};
 
-	return NULL;
-}
+		ch = getopt_long(argc, argv, "ed:s:b:", arg_opts, NULL);
+	}
 
-struct EntryContainer *find_name(const char *name)
-{
-	int i;
+	argc -= optind;
+	argv += optind;
 
-	for(i = 0; i < MAX_OPTIONS; i++)
+	/* In batch mode every output comes from the manifest; TITLE is optional */
+	if(g_batch)
 	{
-		if((g_vals[i].name != NULL) && (strcmp(g_vals[i].name, name) == 0))
+		if(argc > 1)
 		{
-			return &g_vals[i];
+			return 0;
 		}
-	}
 
-	return NULL;
-}
+		if(argc == 1)
+		{
+			g_title = argv[0];
+		}
 
-int add_string(char *str)
-{
-	char *equals = NULL;
-	struct EntryContainer *entry;
+		return 1;
+	}
 
-	equals = strchr(str, '=');
-	if(equals == NULL)
+	if(argc < 1)
 	{
-		fprintf(stderr, "Invalid option (no =)\n");
 		return 0;
 	}
 
-	*equals++ = 0;
-	
-	if ((entry = find_name(str)))
+	if(!g_empty)
 	{
-		entry->data = equals;
+		g_title = argv[0];
+		argc--;
+		argv++;
 	}
-	else
-	{
-		entry = find_free();
-		if(entry == NULL)
-		{
-			fprintf(stderr, "Maximum options reached\n");
-			return 0;
-		}
 
-		memset(entry, 0, sizeof(struct EntryContainer));
-		entry->name = str;
-		entry->type = PSF_TYPE_STR;
-		entry->data = equals;
+	if(argc < 1)
+	{
+		return 0;
 	}
-	
+
+	g_filename = argv[0];
+
 	return 1;
 }
 
-int add_dword(char *str)
+/* Applies one manifest line: -s NAME=STR, -d NAME=VALUE or -t TITLE (or
+ * --string, --dword, --title), the argument running to the end of the line */
+static int apply_line(sfo_t *sfo, char *line, int lineno)
 {
-	char *equals = NULL;
-	struct EntryContainer *entry;
+	char *arg = line;
 
-	equals = strchr(str, '=');
-	if(equals == NULL)
+	while(*arg && *arg != ' ' && *arg != '\t')
 	{
-		fprintf(stderr, "Invalid option (no =)\n");
-		return 0;
+		arg++;
 	}
-
-	*equals++ = 0;
-
-	if ((entry = find_name(str)))
+	if(*arg)
 	{
-		entry->value = strtoul(equals, NULL, 0);
+		*arg++ = 0;
 	}
-	else
+	while(*arg == ' ' || *arg == '\t')
 	{
-		entry = find_free();
-		if(entry == NULL)
-		{
-			fprintf(stderr, "Maximum options reached\n");
-			return 0;
-		}
+		arg++;
+	}
 
-		memset(entry, 0, sizeof(struct EntryContainer));
-		entry->name = str;
-		entry->type = PSF_TYPE_VAL;
-		entry->value = strtoul(equals, NULL, 0);		
+	if(strcmp(line, "-s") == 0 || strcmp(line, "--string") == 0)
+	{
+		return sfo_set_assignment(sfo, arg, SFO_TYPE_STR);
+	}
+	if(strcmp(line, "-d") == 0 || strcmp(line, "--dword") == 0)
+	{
+		return sfo_set_assignment(sfo, arg, SFO_TYPE_INT);
+	}
+	if(strcmp(line, "-t") == 0 || strcmp(line, "--title") == 0)
+	{
+		return sfo_set_title(sfo, arg);
 	}
 
-	return 1;
+	fprintf(stderr, "%s:%d: unknown option %s\n", g_batch, lineno, line);
+	return 0;
 }
 
-/* Process the arguments */
-int process_args(int argc, char **argv)
+/* Writes one SFO per [output.sfo] section of the manifest.  Each starts
+ * from the command line's keys and those set before the first section. */
+static int run_batch(void)
 {
-	int ch;
+	FILE *fp;
+	char *text = NULL, *buf, *line, *next, *end;
+	size_t len = 0, cap = 0, n;
+	sfo_t *base = g_sfo, *variant = NULL;
+	const char *output = NULL;
+	int lineno = 0, count = 0, ok = 1;
 
-	g_title = NULL;
-	g_filename = NULL;
-	g_empty = 0;
+	fp = strcmp(g_batch, "-") == 0 ? stdin : fopen(g_batch, "rb");
+	if(fp == NULL)
+	{
+		fprintf(stderr, "Cannot open manifest %s: %s\n", g_batch, strerror(errno));
+		return 0;
+	}
 
-	ch = getopt_long(argc, argv, "ed:s:", arg_opts, NULL);
-	while(ch != -1)
+	do
 	{
-		switch(ch)
+		if(len + 4096 >= cap)
 		{
-			case 'd' : if(!add_dword(optarg))
-					   {
-						   return 0;
-					   }
+			cap = cap ? cap * 2 : 65536;
+			if((buf = realloc(text, cap)) == NULL)
+			{
+				ok = 0;
 				break;
-			case 's' : if(!add_string(optarg))
-					   {
-					   }
-				break;
-			default  : break;
-		};
+			}
+			text = buf;
+		}
+		n = fread(text + len, 1, cap - len - 1, fp);
+		len += n;
+	} while(n > 0);
 
-		ch = getopt_long(argc, argv, "ed:s:", arg_opts, NULL);
+	if(fp != stdin)
+	{
+		fclose(fp);
 	}
-
-	argc -= optind;
-	argv += optind;
-
-	if(argc < 1)
+	if(!ok)
 	{
+		fprintf(stderr, "Out of memory\n");
+		free(text);
 		return 0;
 	}
+	text[len] = 0;
 
-	if(!g_empty)
+	for(line = text; ok && line < text + len; line = next)
 	{
-		g_title = argv[0];
-		argc--;
-		argv++;
+		lineno++;
+		end = strchr(line, '\n');
+		next = end ? end + 1 : text + len;
+		if(!end)
+		{
+			end = text + len;
+		}
+		if(end > line && end[-1] == '\r')
+		{
+			end--;
+		}
+		*end = 0;
+
+		while(*line == ' ' || *line == '\t')
+		{
+			line++;
+		}
+		if(*line == 0 || *line == '#')
+		{
+			continue;
+		}
+
+		if(*line == '[')
+		{
+			if(end - line < 3 || end[-1] != ']')
+			{
+				fprintf(stderr, "%s:%d: expected [output.sfo]\n", g_batch, lineno);
+				ok = 0;
+				break;
+			}
+			end[-1] = 0;
+
+			if(variant)
+			{
+				ok = sfo_write(variant, output);
+				sfo_free(variant);
+				count++;
+			}
+			output = line + 1;
+			variant = ok ? sfo_copy(base) : NULL;
+			if(ok && variant == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				ok = 0;
+			}
+			continue;
+		}
+
+		ok = apply_line(variant ? variant : base, line, lineno);
 	}
 
-	if(argc < 1)
+	if(ok && variant)
 	{
-		return 0;
+		ok = sfo_write(variant, output);
+		count++;
 	}
+	sfo_free(variant);
+	free(text);
 
-	g_filename = argv[0];
+	if(ok && count == 0)
+	{
+		fprintf(stderr, "%s: no [output.sfo] sections\n", g_batch);
+		ok = 0;
+	}
 
-	return 1;
+	return ok;
 }
 
 int main(int argc, char **argv)
 {
-	FILE *fp;
-	int i;
-	char head[8192];
-	char keys[8192];
-	char data[8192];
-	struct SfoHeader *h;
-	struct SfoEntry  *e;
-	char *k;
-	char *d;
-	unsigned int align;
-	unsigned int keyofs;
-	unsigned int count;
-	
-	for(i = 0; i < (sizeof(g_defaults) / sizeof(struct EntryContainer)); i++)
+	int ret;
+
+	g_sfo = sfo_new(1);
+	if(g_sfo == NULL)
 	{
-		struct EntryContainer *entry = find_free();
-		if(entry == NULL)
-		{
-			fprintf(stderr, "Maximum options reached\n");
-			return 0;
-		}
-		*entry = g_defaults[i];
+		fprintf(stderr, "Out of memory\n");
+		return 1;
 	}
-	
+
 	if(!process_args(argc, argv)) 
 	{
 		fprintf(stderr, "Usage: mksfoex [options] TITLE output.sfo\n");
+		fprintf(stderr, "       mksfoex [options] --batch manifest [TITLE]\n");
 		fprintf(stderr, "Options:\n");
 		fprintf(stderr, "-d NAME=VALUE - Add a new DWORD value\n");
 		fprintf(stderr, "-s NAME=STR   - Add a new string value\n");
+		fprintf(stderr, "-e            - Leave the title out (no TITLE argument)\n");
+		fprintf(stderr, "-b MANIFEST   - Write every [output.sfo] section of MANIFEST, each\n");
+		fprintf(stderr, "                applying its -s, -d and -t TITLE lines to the above\n");
 
+		sfo_free(g_sfo);
 		return 1;
 	}
-	
-	if (g_title)
-	{
-		struct EntryContainer *entry = find_name("TITLE");
-		entry->data = g_title;
-		
-		entry = find_name("STITLE");
-		entry->data = g_title;
-	}
 
-	memset(head, 0, sizeof(head));
-	memset(keys, 0, sizeof(keys));
-	memset(data, 0, sizeof(data));
-	h = (struct SfoHeader*) head;
-	e = (struct SfoEntry*)  (head+sizeof(struct SfoHeader));
-	k = keys;
-	d = data;
-	SW(&h->magic, PSF_MAGIC);
-	SW(&h->version, PSF_VERSION);
-	count = 0;
-
-	for(i = 0; g_vals[i].name; i++)
+	if(g_title && !sfo_set_title(g_sfo, g_title))
 	{
-		SW(&h->count, ++count);
-		SW(&e->nameofs, k-keys);
-		SW(&e->dataofs, d-data);
-		SW(&e->alignment, 4);
-		SW(&e->type, g_vals[i].type);
-
-		strcpy(k, g_vals[i].name);
-		k += strlen(k)+1;
-		if(e->type == PSF_TYPE_VAL)
-		{
-			SW(&e->valsize, 4);
-			SW(&e->totalsize, 4);
-			SW((uint32_t*) d, g_vals[i].value);
-			d += 4;
-		}
-		else
-		{
-			int totalsize;
-			int valsize = 0;
-
-			if (g_vals[i].data)
-				valsize = strlen(g_vals[i].data)+1;
-			totalsize = (g_vals[i].value) ? (g_vals[i].value) : ((valsize + 3) & ~3);
-			SW(&e->valsize, valsize);
-			SW(&e->totalsize, totalsize);
-			memset(d, 0, totalsize);
-			
-			if (g_vals[i].data)
-				memcpy(d, g_vals[i].data, valsize);
-			d += totalsize;
-		}
-		e++;
+		fprintf(stderr, "Out of memory\n");
+		sfo_free(g_sfo);
+		return 1;
 	}
 
-
-	keyofs = (char*)e - head;
-	SW(&h->keyofs, keyofs);
-	align = 3 - ((unsigned int) (k-keys) & 3);
-	while(align < 3)
+	if(g_batch)
 	{
-		k++;
-		align--;
+		ret = run_batch() ? 0 : 1;
 	}
-	
-	SW(&h->valofs, keyofs + (k-keys));
-
-	fp = fopen(g_filename, "wb");
-	if(fp == NULL)
+	else
 	{
-		fprintf(stderr, "Cannot open filename %s\n", g_filename);
-		return 0;
+		/* Kept from the original tool, which exited 0 when it could not write */
+		sfo_write(g_sfo, g_filename);
+		ret = 0;
 	}
 
-	fwrite(head, 1, (char*)e-head, fp);
-	fwrite(keys, 1, k-keys, fp);
-	fwrite(data, 1, d-data, fp);
-	fclose(fp);
-
-	return 0;
-}
\ No newline at end of file
+	sfo_free(g_sfo);
+	return ret;
+}
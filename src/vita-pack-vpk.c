@@ -2,8 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <getopt.h>
-#include <zip.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "vpk-pack.h"
+#include "sfo.h"
 
 #define DEFAULT_OUTPUT_FILE "output.vpk"
 
@@ -12,118 +18,444 @@ static void usage(const char *arg);
 static const struct option long_options[] = {
 	{"sfo", required_argument, NULL, 's'},
 	{"eboot", required_argument, NULL, 'b'},
+	{"sfo-string", required_argument, NULL, 'K'},
+	{"sfo-dword", required_argument, NULL, 'W'},
+	{"sfo-title", required_argument, NULL, 'I'},
 	{"add", required_argument, NULL, 'a'},
+	{"add-dir", required_argument, NULL, 'd'},
+	{"manifest", required_argument, NULL, 'm'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"level", required_argument, NULL, 'l'},
+	{"store", required_argument, NULL, 'S'},
+	{"compress", required_argument, NULL, 'C'},
+	{"no-default-store", no_argument, NULL, 'N'},
+	{"update", no_argument, NULL, 'u'},
+	{"no-dedup", no_argument, NULL, 'D'},
+	{"deterministic", no_argument, NULL, 'R'},
+	{"timestamp", required_argument, NULL, 'T'},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, NULL, 0}
 };
 
-static int add_file_zip(zip_t *zip, const char *src, const char *dst)
+/* Every entry of the archive.  The first two slots are kept for param.sfo and
+ * eboot.bin, which are filled in once all options are known; each later
+ * entry owns one allocation holding its src followed by its dst. */
+#define FILE_LIST_RESERVED 2
+
+static struct {
+	vpk_file *files;
+	int num;
+	int cap;
+} file_list;
+
+static int file_list_reserve(int extra)
 {
-	int ret;
-	zip_source_t *zip_src;
+	vpk_file *files;
+	int cap = file_list.cap ? file_list.cap : 64;
+
+	if (file_list.num + extra <= file_list.cap)
+		return 1;
 
-	zip_src = zip_source_file(zip, src, 0, 0);
-	if (!zip_src) {
-		printf("Error adding \'%s\': %s\n", src,
-			zip_strerror(zip));
+	while (cap < file_list.num + extra)
+		cap *= 2;
+
+	files = realloc(file_list.files, sizeof(*files) * cap);
+	if (!files) {
+		printf("Out of memory.\n");
 		return 0;
 	}
 
-	ret = zip_file_add(zip, dst, zip_src, 0);
-	if (ret == -1) {
-		printf("Error adding \'%s\': %s\n", src,
-			zip_strerror(zip));
+	file_list.files = files;
+	file_list.cap = cap;
+	return 1;
+}
+
+/* Joins dst_prefix and dst with a '/' unless either is empty */
+static int file_list_add(const char *src, size_t src_len,
+		const char *dst_prefix, size_t prefix_len,
+		const char *dst, size_t dst_len)
+{
+	char *buf;
+	size_t slash = prefix_len && dst_len;
+
+	if (!file_list_reserve(1))
+		return 0;
+
+	buf = malloc(src_len + 1 + prefix_len + slash + dst_len + 1);
+	if (!buf) {
+		printf("Out of memory.\n");
 		return 0;
 	}
 
+	memcpy(buf, src, src_len);
+	buf[src_len] = '\0';
+	file_list.files[file_list.num].src = buf;
+
+	buf += src_len + 1;
+	memcpy(buf, dst_prefix, prefix_len);
+	if (slash)
+		buf[prefix_len] = '/';
+	memcpy(buf + prefix_len + slash, dst, dst_len);
+	buf[prefix_len + slash + dst_len] = '\0';
+	file_list.files[file_list.num].dst = buf;
+	file_list.files[file_list.num].data = NULL;
+	file_list.files[file_list.num].size = 0;
+
+	file_list.num++;
+	return 1;
+}
+
+static int file_list_init()
+{
+	file_list.files = NULL;
+	file_list.num = 0;
+	file_list.cap = 0;
+
+	if (!file_list_reserve(FILE_LIST_RESERVED))
+		return 0;
+
+	file_list.num = FILE_LIST_RESERVED;
 	return 1;
 }
 
+static void file_list_free()
+{
+	int i;
+
+	for (i = FILE_LIST_RESERVED; i < file_list.num; i++)
+		free((char *)file_list.files[i].src);
+
+	free(file_list.files);
+}
+
+static int parse_add_subopt(const char *arg, size_t len)
+{
+	const char *equals = memchr(arg, '=', len);
+
+	if (!equals || equals == arg || equals == arg + len - 1) {
+		printf("Invalid entry \'%.*s\', expected src=dst.\n", (int)len, arg);
+		return 0;
+	}
+
+	return file_list_add(arg, equals - arg, "", 0,
+		equals + 1, len - (equals - arg + 1));
+}
+
+/* Adds every regular file below the directory in path[0..len), growing
+ * path as it descends.  dst[0..dst_len) is the matching archive prefix. */
+static int add_dir_walk(char **path, size_t *path_cap, size_t len,
+		char **dst, size_t *dst_cap, size_t dst_len)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+	size_t name_len;
+	int is_dir, ok = 1;
+	char *buf;
+
+	(*path)[len] = '\0';
+	dir = opendir(*path);
+	if (!dir) {
+		printf("Error reading directory \'%s\': %s\n", *path, strerror(errno));
+		return 0;
+	}
+
+	while (ok && (ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+
+		name_len = strlen(ent->d_name);
+		if (len + 1 + name_len + 1 > *path_cap) {
+			*path_cap = (len + 1 + name_len + 1) * 2;
+			if ((buf = realloc(*path, *path_cap)) == NULL) {
+				printf("Out of memory.\n");
+				ok = 0;
+				break;
+			}
+			*path = buf;
+		}
+		if (dst_len + 1 + name_len + 1 > *dst_cap) {
+			*dst_cap = (dst_len + 1 + name_len + 1) * 2;
+			if ((buf = realloc(*dst, *dst_cap)) == NULL) {
+				printf("Out of memory.\n");
+				ok = 0;
+				break;
+			}
+			*dst = buf;
+		}
+
+		(*path)[len] = '/';
+		memcpy(*path + len + 1, ent->d_name, name_len + 1);
+
+#if defined(_DIRENT_HAVE_D_TYPE) && defined(DT_DIR)
+		if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) {
+			if (ent->d_type != DT_DIR && ent->d_type != DT_REG)
+				continue;
+			is_dir = ent->d_type == DT_DIR;
+		} else
+#endif
+		{
+			if (stat(*path, &st) != 0) {
+				printf("Error adding \'%s\': %s\n", *path, strerror(errno));
+				ok = 0;
+				break;
+			}
+			if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+				continue;
+			is_dir = S_ISDIR(st.st_mode);
+		}
+
+		if (is_dir) {
+			size_t sub_len = dst_len ? dst_len + 1 + name_len : name_len;
+
+			if (dst_len)
+				(*dst)[dst_len] = '/';
+			memcpy(*dst + sub_len - name_len, ent->d_name, name_len);
+			ok = add_dir_walk(path, path_cap, len + 1 + name_len,
+				dst, dst_cap, sub_len);
+		} else {
+			ok = file_list_add(*path, len + 1 + name_len,
+				*dst, dst_len, ent->d_name, name_len);
+		}
+	}
+
+	closedir(dir);
+	return ok;
+}
+
+/* src=dst, or just src to put the directory's contents at the root */
+static int parse_add_dir_subopt(const char *arg)
+{
+	const char *equals = strchr(arg, '=');
+	size_t src_len = equals ? (size_t)(equals - arg) : strlen(arg);
+	const char *dst = equals ? equals + 1 : "";
+	size_t dst_len = strlen(dst);
+	size_t path_cap = src_len + 256;
+	size_t dst_cap = dst_len + 256;
+	char *path, *prefix;
+	int ok;
+
+	while (src_len > 1 && arg[src_len - 1] == '/')
+		src_len--;
+	while (dst_len > 0 && dst[dst_len - 1] == '/')
+		dst_len--;
+
+	if (src_len == 0) {
+		printf("Invalid --add-dir \'%s\', expected src=dst.\n", arg);
+		return 0;
+	}
+
+	path = malloc(path_cap);
+	prefix = malloc(dst_cap);
+	if (!path || !prefix) {
+		printf("Out of memory.\n");
+		free(path);
+		free(prefix);
+		return 0;
+	}
+
+	memcpy(path, arg, src_len);
+	memcpy(prefix, dst, dst_len);
+
+	ok = add_dir_walk(&path, &path_cap, src_len, &prefix, &dst_cap, dst_len);
+
+	free(path);
+	free(prefix);
+	return ok;
+}
+
+/* One src=dst per line, as for --add; blank lines and lines starting with
+ * '#' are skipped.  "-" reads the manifest from standard input. */
+static int parse_manifest(const char *path)
+{
+	FILE *fp;
+	char *data = NULL, *buf, *line, *end, *next;
+	size_t len = 0, cap = 0, n;
+	int lines = 0, ok = 1;
+
+	fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	if (!fp) {
+		printf("Error reading manifest \'%s\': %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	do {
+		if (len + 65536 > cap) {
+			cap = cap ? cap * 2 : 65536;
+			if ((buf = realloc(data, cap)) == NULL) {
+				printf("Out of memory.\n");
+				ok = 0;
+				break;
+			}
+			data = buf;
+		}
+		n = fread(data + len, 1, cap - len, fp);
+		len += n;
+	} while (n > 0);
+
+	if (ok && ferror(fp)) {
+		printf("Error reading manifest \'%s\': %s\n", path, strerror(errno));
+		ok = 0;
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	/* Size the entry list once for the whole manifest */
+	for (line = data; ok && line < data + len; line++) {
+		if (*line == '\n')
+			lines++;
+	}
+	if (ok && !file_list_reserve(lines + 1))
+		ok = 0;
+
+	for (line = data; ok && line < data + len; line = next) {
+		end = memchr(line, '\n', data + len - line);
+		next = end ? end + 1 : data + len;
+		if (!end)
+			end = data + len;
+		if (end > line && end[-1] == '\r')
+			end--;
+
+		if (end == line || *line == '#')
+			continue;
+
+		ok = parse_add_subopt(line, end - line);
+	}
+
+	free(data);
+	return ok;
+}
+
 static struct {
-	char **src;
-	char **dst;
+	vpk_level_rule *rules;
 	int num;
-} additional_list;
+} rule_list;
 
-static void additional_list_add(char *src, char *dst)
+/* Takes ownership of pattern, which may be NULL if allocating it failed */
+static int rule_list_add(char *pattern, int level)
 {
-	additional_list.src = realloc(additional_list.src,
-		sizeof(*additional_list.src) * (additional_list.num + 1));
-	additional_list.dst = realloc(additional_list.dst,
-		sizeof(*additional_list.dst) * (additional_list.num + 1));
+	vpk_level_rule *rules = NULL;
+
+	if (pattern)
+		rules = realloc(rule_list.rules, sizeof(*rules) * (rule_list.num + 1));
+	if (!rules) {
+		printf("Out of memory.\n");
+		free(pattern);
+		return 0;
+	}
 
-	additional_list.src[additional_list.num] = src;
-	additional_list.dst[additional_list.num] = dst;
+	rule_list.rules = rules;
+	rule_list.rules[rule_list.num].pattern = pattern;
+	rule_list.rules[rule_list.num].level = level;
 
-	additional_list.num++;
+	rule_list.num++;
+	return 1;
 }
 
-static void additional_list_init()
+static void rule_list_free()
 {
-	additional_list.src = NULL;
-	additional_list.dst = NULL;
-	additional_list.num = 0;
+	int i;
+
+	for (i = 0; i < rule_list.num; i++)
+		free((char *)rule_list.rules[i].pattern);
+
+	free(rule_list.rules);
+	rule_list.rules = NULL;
+	rule_list.num = 0;
 }
 
-static void additional_list_free()
+/* Seconds since the epoch, as in SOURCE_DATE_EPOCH */
+static int parse_timestamp(const char *arg, time_t *timestamp)
 {
-	int i;
+	char *end;
+	long long value = strtoll(arg, &end, 10);
 
-	for (i = 0; i < additional_list.num; i++) {
-		free(additional_list.src[i]);
-		free(additional_list.dst[i]);
+	if (end == arg || *end != '\0' || value < VPK_TIMESTAMP_DEFAULT) {
+		printf("Invalid timestamp \'%s\', expected seconds since 1980.\n", arg);
+		return 0;
 	}
 
-	free(additional_list.src);
-	free(additional_list.dst);
+	*timestamp = value;
+	return 1;
 }
 
-static void parse_add_subopt(char *optarg)
+static int parse_level(const char *arg, int *level)
 {
-	char *src;
-	char *dst;
-	const char *equals;
-	size_t src_len;
-	size_t dst_len;
-	size_t len = strlen(optarg);
+	char *end;
+	long value = strtol(arg, &end, 10);
+
+	if (end == arg || *end != '\0' || value < 0 || value > 9) {
+		printf("Invalid compression level \'%s\', expected 0-9.\n", arg);
+		return 0;
+	}
 
-	equals = strchr(optarg, '=');
-	if (!equals || (equals == optarg + len - 1))
-		return;
+	*level = value;
+	return 1;
+}
 
-	src_len = equals - optarg;
-	dst_len = len - (equals - optarg + 1);
+/* GLOB=LEVEL; the level follows the last '=' so that globs may contain one */
+static int parse_compress_subopt(const char *optarg)
+{
+	const char *equals = strrchr(optarg, '=');
+	char *pattern;
+	int level;
 
-	src = malloc(sizeof(char) * (src_len + 1));
-	dst = malloc(sizeof(char) * (dst_len + 1));
+	if (!equals || equals == optarg) {
+		printf("Invalid --compress \'%s\', expected GLOB=LEVEL.\n", optarg);
+		return 0;
+	}
 
-	strncpy(src, optarg, src_len);
-	src[src_len] = '\0';
+	if (!parse_level(equals + 1, &level))
+		return 0;
 
-	strncpy(dst, optarg + src_len + 1, dst_len);
-	dst[dst_len] = '\0';
+	pattern = malloc(equals - optarg + 1);
+	if (pattern) {
+		memcpy(pattern, optarg, equals - optarg);
+		pattern[equals - optarg] = '\0';
+	}
 
-	additional_list_add(src, dst);
+	return rule_list_add(pattern, level);
+}
+
+/* The param.sfo built from --sfo-* options, with vita-mksfoex's defaults */
+static sfo_t *generated_sfo(void)
+{
+	static sfo_t *sfo;
+
+	if (!sfo && (sfo = sfo_new(1)) == NULL)
+		printf("Out of memory.\n");
+
+	return sfo;
 }
 
 int main(int argc, char *argv[])
 {
-	int i;
-	int err;
-	zip_t *zip;
 	int opt;
 	char *output = NULL;
 	char *sfo = NULL;
 	char *eboot = NULL;
+	sfo_t *gen_sfo = NULL;
+	void *sfo_data = NULL;
+	size_t sfo_size = 0;
+	char *end;
+	const char *epoch;
+	int update = 0;
+	vpk_pack_options options;
 
 	if (argc < 2) {
 		usage(argv[0]);
 		return -1;
 	}
 
-	additional_list_init();
+	if (!file_list_init())
+		return -1;
+	vpk_pack_options_init(&options);
+
+	epoch = getenv("SOURCE_DATE_EPOCH");
+	if (epoch && *epoch && !parse_timestamp(epoch, &options.timestamp))
+		goto error_wrong_args;
 
-	while ((opt = getopt_long(argc, argv, "hs:b:a:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hs:b:a:d:m:j:l:u", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 's':
 			sfo = strdup(optarg);
@@ -131,16 +463,83 @@ int main(int argc, char *argv[])
 		case 'b':
 			eboot = strdup(optarg);
 			break;
+		case 'K':
+			if ((gen_sfo = generated_sfo()) == NULL
+					|| !sfo_set_assignment(gen_sfo, optarg, SFO_TYPE_STR))
+				goto error_wrong_args;
+			break;
+		case 'W':
+			if ((gen_sfo = generated_sfo()) == NULL
+					|| !sfo_set_assignment(gen_sfo, optarg, SFO_TYPE_INT))
+				goto error_wrong_args;
+			break;
+		case 'I':
+			if ((gen_sfo = generated_sfo()) == NULL
+					|| !sfo_set_title(gen_sfo, optarg))
+				goto error_wrong_args;
+			break;
 		case 'a':
-			parse_add_subopt(optarg);
+			if (!parse_add_subopt(optarg, strlen(optarg)))
+				goto error_wrong_args;
+			break;
+		case 'd':
+			if (!parse_add_dir_subopt(optarg))
+				goto error_wrong_args;
+			break;
+		case 'm':
+			if (!parse_manifest(optarg))
+				goto error_wrong_args;
+			break;
+		case 'j':
+			options.num_threads = strtol(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || options.num_threads < 0) {
+				printf("Invalid job count \'%s\'.\n", optarg);
+				goto error_wrong_args;
+			}
+			break;
+		case 'l':
+			if (!parse_level(optarg, &options.default_level))
+				goto error_wrong_args;
+			break;
+		case 'S':
+			if (!rule_list_add(strdup(optarg), VPK_LEVEL_STORE))
+				goto error_wrong_args;
+			break;
+		case 'C':
+			if (!parse_compress_subopt(optarg))
+				goto error_wrong_args;
+			break;
+		case 'N':
+			options.store_compressed = 0;
+			break;
+		case 'u':
+			update = 1;
+			break;
+		case 'D':
+			options.dedup = 0;
+			break;
+		case 'R':
+			options.deterministic = 1;
+			break;
+		case 'T':
+			if (!parse_timestamp(optarg, &options.timestamp))
+				goto error_wrong_args;
+			options.deterministic = 1;
 			break;
 		case 'h':
 			usage(argv[0]);
 			goto error_wrong_args;
+		default:
+			goto error_wrong_args;
 		}
 	}
 
-	if (!sfo) {
+	if (sfo && gen_sfo) {
+		printf("Use either --sfo or the --sfo-* options.\n");
+		goto error_wrong_args;
+	}
+
+	if (!sfo && !gen_sfo) {
 		printf(".sfo file missing.\n");
 		goto error_wrong_args;
 	}
@@ -158,52 +557,50 @@ int main(int argc, char *argv[])
 	else
 		output  = strdup(DEFAULT_OUTPUT_FILE);
 
-	zip = zip_open(output, ZIP_CREATE | ZIP_TRUNCATE, &err);
-	if (!zip) {
-		printf("Error creating: \'%s\': %s\n", output,
-			zip_strerror(zip));
-		goto error_create_zip;
-	}
+	/* A generated param.sfo goes in straight from memory */
+	if (gen_sfo && !sfo_build(gen_sfo, &sfo_data, &sfo_size))
+		goto error_pack;
 
-	if (!add_file_zip(zip, sfo, "sce_sys/param.sfo"))
-		goto error_add_zip;
+	file_list.files[0].src = sfo ? sfo : "generated param.sfo";
+	file_list.files[0].dst = "sce_sys/param.sfo";
+	file_list.files[0].data = sfo_data;
+	file_list.files[0].size = sfo_size;
+	file_list.files[1].src = eboot;
+	file_list.files[1].dst = "eboot.bin";
+	file_list.files[1].data = NULL;
+	file_list.files[1].size = 0;
 
-	if (!add_file_zip(zip, eboot, "eboot.bin"))
-		goto error_add_zip;
+	options.rules = rule_list.rules;
+	options.num_rules = rule_list.num;
+	if (update)
+		options.previous = output;
 
-	for (i = 0; i < additional_list.num; i++) {
-		if (!add_file_zip(zip, additional_list.src[i],
-				  additional_list.dst[i]))
-			goto error_add_zip;
-	}
-
-	err = zip_close(zip);
-	if (err == -1) {
-		printf("Error creating: \'%s\': %s\n", output,
-			zip_strerror(zip));
-		goto error_add_zip;
-	}
+	if (!vpk_pack(output, file_list.files, file_list.num, &options))
+		goto error_pack;
 
 	free(output);
 	free(sfo);
 	free(eboot);
-	additional_list_free();
+	free(sfo_data);
+	sfo_free(gen_sfo);
+	file_list_free();
+	rule_list_free();
 
 	return 0;
 
-error_add_zip:
-	zip_discard(zip);
-
-error_create_zip:
+error_pack:
 	free(output);
+	free(sfo_data);
 
 error_wrong_args:
 	if (sfo)
 		free(sfo);
 	if (eboot)
 		free(eboot);
+	sfo_free(gen_sfo);
 
-	additional_list_free();
+	file_list_free();
+	rule_list_free();
 
 	return -1;
 }
@@ -213,7 +610,24 @@ void usage(const char *arg)
 	printf("Usage:\n\t%s [OPTIONS] output.vpk\n\n"
 		"  -s, --sfo=param.sfo     sets the param.sfo file\n"
 		"  -b, --eboot=eboot.bin   sets the eboot.bin file\n"
+		"      --sfo-title=TITLE   builds param.sfo in memory instead, as vita-mksfoex\n"
+		"                          TITLE would, with the keys --sfo-string NAME=STR and\n"
+		"                          --sfo-dword NAME=VALUE add (vita-mksfoex -s and -d)\n"
 		"  -a, --add src=dst       adds the file src to the vpk as dst\n"
+		"  -d, --add-dir src[=dst] adds every file below the directory src under dst\n"
+		"  -m, --manifest=FILE     adds the src=dst entries listed in FILE, one per line\n"
+		"  -j, --jobs=N            compresses with N threads (default: one per CPU)\n"
+		"  -l, --level=N           zlib level 0-9 for entries without a rule (default: 9)\n"
+		"      --store=GLOB        stores entries whose name matches GLOB uncompressed\n"
+		"      --compress=GLOB=N   uses zlib level N for entries matching GLOB\n"
+		"      --no-default-store  also compresses PNG, OGG, AT9 and other packed formats\n"
+		"  -u, --update            keeps the compressed data of entries unchanged since\n"
+		"                          the existing output.vpk (same size, mtime and CRC)\n"
+		"      --no-dedup          compresses identical files separately\n"
+		"      --deterministic     sorts entries by name and dates them all the same, so\n"
+		"                          identical inputs give a byte-identical vpk\n"
+		"      --timestamp=SECONDS date for --deterministic (default: $SOURCE_DATE_EPOCH,\n"
+		"                          else 1980-01-01), implies --deterministic\n"
 		"  -h, --help              displays this help and exit\n"
 		, arg);
 }
@@ -0,0 +1,1226 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#else
+#include <unistd.h>
+#endif
+
+#include "vpk-pack.h"
+#include "sha256.h"
+
+#define SPOOL_MEMORY	(16 * 1024 * 1024)	/* Deflated data kept in memory before spilling to a temporary file */
+#define IO_BUFFER	(256 * 1024)
+#define ZIP64_LIMIT	0xFFFFFFFFULL
+
+#define ZIP_STORED	0
+#define ZIP_DEFLATED	8
+
+/* Names matched by store_compressed; deflating these again gains next to nothing */
+static const char *const compressed_formats[] = {
+	"*.png", "*.jpg", "*.jpeg", "*.gif", "*.webp",
+	"*.ogg", "*.opus", "*.mp3", "*.m4a", "*.aac", "*.at3", "*.at9",
+	"*.mp4", "*.m4v", "*.webm", "*.pmf",
+	"*.zip", "*.gz", "*.tgz", "*.bz2", "*.xz", "*.7z", "*.lz4", "*.zst",
+	NULL
+};
+
+/* An entry's deflated data: in memory, then in a temporary file once it
+ * outgrows SPOOL_MEMORY, so that large assets do not pile up in memory */
+typedef struct {
+	unsigned char *buf;
+	size_t len;
+	size_t cap;
+	FILE *spill;
+} spool;
+
+/* An entry of the archive being updated, from its central directory */
+typedef struct {
+	const char *name;
+	uint16_t method;
+	uint16_t dtime;
+	uint16_t ddate;
+	uint32_t crc;
+	uint64_t size;
+	uint64_t comp_size;
+	uint64_t offset;	/* Of the local header */
+} previous_entry;
+
+typedef struct {
+	FILE *fp;
+	previous_entry *entries;
+	int num_entries;
+	char *names;
+} previous_archive;
+
+typedef enum {
+	ENTRY_PENDING,
+	ENTRY_READY,
+	ENTRY_FAILED
+} entry_state;
+
+typedef struct {
+	const vpk_file *file;
+	int level;
+	entry_state state;
+
+	uint64_t src_size;	/* As stat() saw it before packing began */
+	uint16_t dtime;		/* DOS time and date to record */
+	uint16_t ddate;
+
+	uint16_t method;
+	uint32_t crc;
+	uint64_t size;
+	uint64_t comp_size;
+	spool data;		/* Stored entries are copied from src instead */
+	const previous_entry *previous;	/* Same name in the archive being updated */
+	int reuse;		/* Its compressed data is copied over as is */
+
+	int candidate;		/* Another entry has the same size and level */
+	uint8_t digest[SHA256_MAC_LEN];
+	uint64_t blob_size;	/* Bytes digested; fixed once claim_blob sees it */
+	int dup;		/* Entry whose data this one shares, or -1 */
+
+	uint64_t offset;	/* Of the local header */
+	uint64_t data_offset;
+} pack_entry;
+
+typedef struct {
+	pack_entry *entries;
+	int num_entries;
+	int next_entry;		/* Next one to compress */
+	int written;		/* Entries already in the archive */
+	int window;		/* Workers stay at most this many entries ahead of the writer */
+	int abort;
+	int *blobs;		/* Open-addressed by digest: index + 1 of the first entry with that content */
+	size_t blobs_mask;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;	/* An entry finished compressing */
+	pthread_cond_t room;	/* The writer moved on, or gave up */
+} pack_queue;
+
+static int online_cpus(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+/* '*' matches any run of characters including '/', '?' any one character */
+static int glob_match(const char *pattern, const char *name)
+{
+	const char *star = NULL, *resume = NULL;
+
+	while (*name) {
+		if (*pattern == '*') {
+			star = pattern++;
+			resume = name;
+		} else if (*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*name)) {
+			pattern++;
+			name++;
+		} else if (star) {
+			pattern = star + 1;
+			name = ++resume;
+		} else {
+			return 0;
+		}
+	}
+
+	while (*pattern == '*')
+		pattern++;
+
+	return *pattern == '\0';
+}
+
+void vpk_pack_options_init(vpk_pack_options *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->default_level = VPK_LEVEL_DEFAULT;
+	options->store_compressed = 1;
+	options->dedup = 1;
+	options->timestamp = VPK_TIMESTAMP_DEFAULT;
+}
+
+int vpk_pack_level(const vpk_pack_options *options, const char *dst)
+{
+	int level = options->default_level;
+	int i;
+
+	if (options->store_compressed) {
+		for (i = 0; compressed_formats[i]; i++) {
+			if (glob_match(compressed_formats[i], dst)) {
+				level = VPK_LEVEL_STORE;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < options->num_rules; i++) {
+		if (glob_match(options->rules[i].pattern, dst))
+			level = options->rules[i].level;
+	}
+
+	return level;
+}
+
+static int spool_write(spool *s, const void *data, size_t len)
+{
+	unsigned char *buf;
+	size_t cap;
+
+	if (!s->spill && s->len + len > SPOOL_MEMORY) {
+		/* Without a temporary file the data simply stays in memory */
+		if ((s->spill = tmpfile()) != NULL) {
+			if (s->len && fwrite(s->buf, s->len, 1, s->spill) != 1)
+				return 0;
+			free(s->buf);
+			s->buf = NULL;
+			s->len = s->cap = 0;
+		}
+	}
+
+	if (s->spill)
+		return len == 0 || fwrite(data, len, 1, s->spill) == 1;
+
+	if (s->len + len > s->cap) {
+		cap = s->cap ? s->cap * 2 : IO_BUFFER;
+		while (cap < s->len + len)
+			cap *= 2;
+		if ((buf = realloc(s->buf, cap)) == NULL)
+			return 0;
+		s->buf = buf;
+		s->cap = cap;
+	}
+
+	memcpy(s->buf + s->len, data, len);
+	s->len += len;
+	return 1;
+}
+
+static int spool_copy(spool *s, FILE *out, unsigned char *buffer)
+{
+	size_t n;
+
+	if (!s->spill)
+		return s->len == 0 || fwrite(s->buf, s->len, 1, out) == 1;
+
+	rewind(s->spill);
+	while ((n = fread(buffer, 1, IO_BUFFER, s->spill)) > 0) {
+		if (fwrite(buffer, n, 1, out) != 1)
+			return 0;
+	}
+
+	return !ferror(s->spill);
+}
+
+static void spool_free(spool *s)
+{
+	free(s->buf);
+	if (s->spill)
+		fclose(s->spill);
+	memset(s, 0, sizeof(*s));
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+/* DOS times carry no zone; zip tools write local time, but a reproducible
+ * archive must not depend on the packing machine's zone */
+static void dos_time(time_t t, int utc, uint16_t *dtime, uint16_t *ddate)
+{
+	struct tm *tm = utc ? gmtime(&t) : localtime(&t);
+
+	if (tm == NULL || tm->tm_year < 80) {
+		*dtime = 0;
+		*ddate = (1 << 5) | 1;	/* 1980-01-01, the earliest DOS date */
+		return;
+	}
+
+	*dtime = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec >> 1);
+	*ddate = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static int compare_previous(const void *a, const void *b)
+{
+	return strcmp(((const previous_entry *)a)->name, ((const previous_entry *)b)->name);
+}
+
+static void previous_close(previous_archive *prev)
+{
+	if (prev->fp)
+		fclose(prev->fp);
+	free(prev->entries);
+	free(prev->names);
+	memset(prev, 0, sizeof(*prev));
+}
+
+static int read_at(FILE *fp, uint64_t offset, void *buf, size_t len)
+{
+	return fseeko(fp, offset, SEEK_SET) == 0 && (len == 0 || fread(buf, len, 1, fp) == 1);
+}
+
+/* Reads the central directory of the archive at path.  A missing archive
+ * simply has no entries; one that cannot be understood is reported and
+ * ignored, so that everything gets packed afresh. */
+static void previous_open(previous_archive *prev, const char *path)
+{
+	unsigned char tail[22 + 0xFFFF], rec[56], *cd = NULL, *p, *end;
+	unsigned char *extra, *field, *field_end;
+	uint64_t file_size, tail_off, cd_size, cd_offset, count, i;
+	uint16_t name_len, extra_len, comment_len, flags, id, len;
+	previous_entry *entry;
+	size_t tail_len;
+	char *names;
+	long pos;
+
+	memset(prev, 0, sizeof(*prev));
+
+	if ((prev->fp = fopen(path, "rb")) == NULL) {
+		if (errno != ENOENT)
+			printf("Warning: cannot update \'%s\': %s\n", path, strerror(errno));
+		return;
+	}
+
+	if (fseeko(prev->fp, 0, SEEK_END) != 0)
+		goto corrupt;
+	file_size = ftello(prev->fp);
+	tail_len = file_size < sizeof(tail) ? file_size : sizeof(tail);
+	tail_off = file_size - tail_len;
+	if (tail_len < 22 || !read_at(prev->fp, tail_off, tail, tail_len))
+		goto corrupt;
+
+	for (pos = tail_len - 22; pos >= 0; pos--) {
+		if (get32(tail + pos) == 0x06054b50)
+			break;
+	}
+	if (pos < 0)
+		goto corrupt;
+
+	count = get16(tail + pos + 10);
+	cd_size = get32(tail + pos + 12);
+	cd_offset = get32(tail + pos + 16);
+
+	if (count == 0xFFFF || cd_size == ZIP64_LIMIT || cd_offset == ZIP64_LIMIT) {
+		if (tail_off + pos < 20 || !read_at(prev->fp, tail_off + pos - 20, rec, 20)
+				|| get32(rec) != 0x07064b50)
+			goto corrupt;
+		if (!read_at(prev->fp, get64(rec + 8), rec, 56) || get32(rec) != 0x06064b50)
+			goto corrupt;
+		count = get64(rec + 32);
+		cd_size = get64(rec + 40);
+		cd_offset = get64(rec + 48);
+	}
+
+	if (cd_offset > file_size || cd_size > file_size - cd_offset || count > cd_size / 46)
+		goto corrupt;
+
+	if ((cd = malloc(cd_size ? cd_size : 1)) == NULL
+			|| (prev->entries = calloc(count ? count : 1, sizeof(previous_entry))) == NULL
+			|| (prev->names = malloc(cd_size + count + 1)) == NULL)
+		goto corrupt;
+	if (!read_at(prev->fp, cd_offset, cd, cd_size))
+		goto corrupt;
+
+	p = cd;
+	end = cd + cd_size;
+	names = prev->names;
+	for (i = 0; i < count; i++) {
+		if (end - p < 46 || get32(p) != 0x02014b50)
+			goto corrupt;
+		flags = get16(p + 8);
+		name_len = get16(p + 28);
+		extra_len = get16(p + 30);
+		comment_len = get16(p + 32);
+		if (end - p < 46 + name_len + extra_len + comment_len)
+			goto corrupt;
+
+		entry = &prev->entries[prev->num_entries];
+		entry->method = get16(p + 10);
+		entry->dtime = get16(p + 12);
+		entry->ddate = get16(p + 14);
+		entry->crc = get32(p + 16);
+		entry->comp_size = get32(p + 20);
+		entry->size = get32(p + 24);
+		entry->offset = get32(p + 42);
+
+		/* Fields that overflowed are in the ZIP64 extra field, in this order */
+		for (extra = p + 46 + name_len; extra + 4 <= p + 46 + name_len + extra_len; extra += 4 + len) {
+			id = get16(extra);
+			len = get16(extra + 2);
+			if (id != 0x0001)
+				continue;
+			field = extra + 4;
+			field_end = extra + 4 + len;
+			if (entry->size == ZIP64_LIMIT && field + 8 <= field_end)
+				entry->size = get64(field), field += 8;
+			if (entry->comp_size == ZIP64_LIMIT && field + 8 <= field_end)
+				entry->comp_size = get64(field), field += 8;
+			if (entry->offset == ZIP64_LIMIT && field + 8 <= field_end)
+				entry->offset = get64(field);
+		}
+
+		memcpy(names, p + 46, name_len);
+		names[name_len] = '\0';
+		entry->name = names;
+		names += name_len + 1;
+
+		/* Only plain stored or deflated data can be carried over */
+		if (!(flags & 0x0001) && (entry->method == ZIP_STORED || entry->method == ZIP_DEFLATED)
+				&& entry->offset < cd_offset && entry->comp_size <= cd_offset - entry->offset)
+			prev->num_entries++;
+
+		p += 46 + name_len + extra_len + comment_len;
+	}
+
+	qsort(prev->entries, prev->num_entries, sizeof(previous_entry), compare_previous);
+	free(cd);
+	return;
+corrupt:
+	printf("Warning: cannot update \'%s\': not a readable archive, packing everything\n", path);
+	free(cd);
+	previous_close(prev);
+}
+
+static const previous_entry *previous_find(const previous_archive *prev, const char *name)
+{
+	previous_entry key;
+
+	if (prev->num_entries == 0)
+		return NULL;
+
+	key.name = name;
+	return bsearch(&key, prev->entries, prev->num_entries, sizeof(previous_entry), compare_previous);
+}
+
+/* Whether the previous archive may still hold this entry; the CRC decides */
+static int entry_unchanged(const pack_entry *entry)
+{
+	const previous_entry *prev = entry->previous;
+	if (!prev || prev->size != entry->src_size)
+		return 0;
+
+	/* A stored entry may be kept for any level, as deflate may not have
+	 * paid off; a deflated one only while the entry is to be compressed */
+	if (entry->level == VPK_LEVEL_STORE && prev->method != ZIP_STORED)
+		return 0;
+
+	return entry->dtime == prev->dtime && entry->ddate == prev->ddate;
+}
+
+/* Looks the entry's content up among those seen so far.  Returns 1 if it
+ * is new, or 0 with entry->dup set if another entry already carries it. */
+static int claim_blob(pack_queue *queue, pack_entry *entry)
+{
+	pack_entry *other;
+	size_t slot;
+	int found = 0;
+
+	memcpy(&slot, entry->digest, sizeof(slot));
+
+	pthread_mutex_lock(&queue->lock);
+	for (slot &= queue->blobs_mask; queue->blobs[slot]; slot = (slot + 1) & queue->blobs_mask) {
+		other = &queue->entries[queue->blobs[slot] - 1];
+		if (other->level == entry->level && other->blob_size == entry->blob_size
+				&& memcmp(other->digest, entry->digest, sizeof(entry->digest)) == 0) {
+			entry->dup = other - queue->entries;
+			found = 1;
+			break;
+		}
+	}
+	if (!found)
+		queue->blobs[slot] = entry - queue->entries + 1;
+	pthread_mutex_unlock(&queue->lock);
+
+	return !found;
+}
+
+/* Where an entry's bytes come from: its src file, or the caller's buffer */
+typedef struct {
+	FILE *fp;
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+} source;
+
+static int source_open(source *s, const vpk_file *file)
+{
+	memset(s, 0, sizeof(*s));
+
+	if (file->data) {
+		s->data = file->data;
+		s->size = file->size;
+		return 1;
+	}
+
+	return (s->fp = fopen(file->src, "rb")) != NULL;
+}
+
+static size_t source_read(source *s, void *buf, size_t len)
+{
+	if (s->fp)
+		return fread(buf, 1, len, s->fp);
+
+	if (len > s->size - s->pos)
+		len = s->size - s->pos;
+	memcpy(buf, s->data + s->pos, len);
+	s->pos += len;
+	return len;
+}
+
+static int source_error(source *s)
+{
+	return s->fp && ferror(s->fp);
+}
+
+/* Whether everything has been read */
+static int source_eof(source *s)
+{
+	return s->fp ? feof(s->fp) : s->pos == s->size;
+}
+
+static void source_rewind(source *s)
+{
+	if (s->fp)
+		rewind(s->fp);
+	s->pos = 0;
+}
+
+static void source_close(source *s)
+{
+	if (s->fp)
+		fclose(s->fp);
+	s->fp = NULL;
+}
+
+/* Computes the CRC and sizes of one entry and, unless it is stored, a
+ * duplicate or can be taken from the previous archive, deflates it */
+static int compress_entry(pack_queue *queue, pack_entry *entry)
+{
+	const char *src = entry->file->src;
+	unsigned char *in = NULL, *out = NULL;
+	SHA256_CTX sha;
+	z_stream zs;
+	int deflating = 0;
+	int counted = 0;
+	int flush, zret;
+	size_t n;
+	source in_src;
+
+	if (!source_open(&in_src, entry->file))
+		goto error;
+
+	if ((in = malloc(IO_BUFFER)) == NULL || (out = malloc(IO_BUFFER)) == NULL)
+		goto error;
+
+	/* Entries that may share their data are hashed before any compression,
+	 * so that only the first of a set of duplicates gets compressed */
+	if (entry->candidate || entry_unchanged(entry)) {
+		if (entry->candidate)
+			sha256_init(&sha);
+		entry->crc = crc32(0, NULL, 0);
+		while ((n = source_read(&in_src, in, IO_BUFFER)) > 0) {
+			entry->crc = crc32(entry->crc, in, n);
+			if (entry->candidate)
+				sha256_update(&sha, in, n);
+			entry->size += n;
+		}
+		if (source_error(&in_src))
+			goto error;
+
+		counted = 1;
+
+		if (entry->candidate) {
+			sha256_final(&sha, entry->digest);
+			entry->blob_size = entry->size;
+			if (!claim_blob(queue, entry))
+				goto done;
+		}
+
+		if (entry_unchanged(entry) && entry->size == entry->previous->size
+				&& entry->crc == entry->previous->crc) {
+			entry->method = entry->previous->method;
+			entry->comp_size = entry->previous->comp_size;
+			entry->reuse = 1;
+			goto done;
+		}
+
+		/* Other workers may be looking at this entry by now; its size
+		 * is already known, so the second pass leaves it alone */
+		source_rewind(&in_src);
+	}
+
+	if (entry->level != VPK_LEVEL_STORE) {
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, entry->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			goto error;
+		deflating = 1;
+	}
+
+	entry->crc = crc32(0, NULL, 0);
+	do {
+		n = source_read(&in_src, in, IO_BUFFER);
+		if (source_error(&in_src))
+			goto error;
+		entry->crc = crc32(entry->crc, in, n);
+		if (!counted)
+			entry->size += n;
+
+		if (!deflating)
+			continue;
+
+		flush = source_eof(&in_src) ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = in;
+		zs.avail_in = n;
+		do {
+			zs.next_out = out;
+			zs.avail_out = IO_BUFFER;
+			zret = deflate(&zs, flush);
+			if (zret == Z_STREAM_ERROR)
+				goto error;
+			if (!spool_write(&entry->data, out, IO_BUFFER - zs.avail_out))
+				goto error;
+		} while (zs.avail_out == 0);
+	} while (!source_eof(&in_src));
+
+	entry->method = ZIP_STORED;
+	entry->comp_size = entry->size;
+	if (deflating) {
+		deflateEnd(&zs);
+		deflating = 0;
+
+		/* Keep the deflated data only if it actually saves space */
+		if (zs.total_out < entry->size) {
+			entry->method = ZIP_DEFLATED;
+			entry->comp_size = zs.total_out;
+		} else {
+			spool_free(&entry->data);
+		}
+	}
+
+done:
+	source_close(&in_src);
+	free(in);
+	free(out);
+	return 1;
+error:
+	printf("Error adding \'%s\': %s\n", src, strerror(errno));
+	if (deflating)
+		deflateEnd(&zs);
+	source_close(&in_src);
+	free(in);
+	free(out);
+	spool_free(&entry->data);
+	return 0;
+}
+
+static void *pack_worker(void *arg)
+{
+	pack_queue *queue = arg;
+	int i, ok;
+
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		while (!queue->abort && queue->next_entry < queue->num_entries
+				&& queue->next_entry >= queue->written + queue->window)
+			pthread_cond_wait(&queue->room, &queue->lock);
+		if (queue->abort || queue->next_entry >= queue->num_entries)
+			break;
+		i = queue->next_entry++;
+		pthread_mutex_unlock(&queue->lock);
+
+		ok = compress_entry(queue, &queue->entries[i]);
+
+		pthread_mutex_lock(&queue->lock);
+		queue->entries[i].state = ok ? ENTRY_READY : ENTRY_FAILED;
+		pthread_cond_broadcast(&queue->ready);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+static uint16_t entry_flags(const pack_entry *entry)
+{
+	const unsigned char *p;
+	uint16_t flags = 0;
+
+	/* Deflate speed hint, as zip tools record it */
+	if (entry->method == ZIP_DEFLATED) {
+		if (entry->level >= 8)
+			flags |= 0x0002;
+		else if (entry->level == 2)
+			flags |= 0x0004;
+		else if (entry->level == 1)
+			flags |= 0x0006;
+	}
+
+	/* Names that are not plain ASCII are taken to be UTF-8 */
+	for (p = (const unsigned char *)entry->file->dst; *p; p++) {
+		if (*p >= 0x80) {
+			flags |= 0x0800;
+			break;
+		}
+	}
+
+	return flags;
+}
+
+static int write_local_header(FILE *out, const pack_entry *entry)
+{
+	unsigned char hdr[30 + 20];
+	size_t name_len = strlen(entry->file->dst);
+	int zip64 = entry->size >= ZIP64_LIMIT || entry->comp_size >= ZIP64_LIMIT;
+
+	put32(hdr + 0, 0x04034b50);
+	put16(hdr + 4, zip64 ? 45 : 20);
+	put16(hdr + 6, entry_flags(entry));
+	put16(hdr + 8, entry->method);
+	put16(hdr + 10, entry->dtime);
+	put16(hdr + 12, entry->ddate);
+	put32(hdr + 14, entry->crc);
+	put32(hdr + 18, zip64 ? ZIP64_LIMIT : entry->comp_size);
+	put32(hdr + 22, zip64 ? ZIP64_LIMIT : entry->size);
+	put16(hdr + 26, name_len);
+	put16(hdr + 28, zip64 ? 20 : 0);
+
+	if (fwrite(hdr, 30, 1, out) != 1 || fwrite(entry->file->dst, name_len, 1, out) != 1)
+		return 0;
+
+	if (zip64) {
+		put16(hdr + 30, 0x0001);
+		put16(hdr + 32, 16);
+		put64(hdr + 34, entry->size);
+		put64(hdr + 42, entry->comp_size);
+		if (fwrite(hdr + 30, 20, 1, out) != 1)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Stored entries are read from their source once more, and must not have changed since */
+static int copy_stored(FILE *out, const pack_entry *entry, unsigned char *buffer)
+{
+	uint64_t left = entry->size;
+	uint32_t crc = crc32(0, NULL, 0);
+	size_t n;
+	FILE *fp;
+
+	if (entry->file->data)
+		return entry->size == 0 || fwrite(entry->file->data, entry->size, 1, out) == 1;
+
+	if ((fp = fopen(entry->file->src, "rb")) == NULL) {
+		printf("Error adding \'%s\': %s\n", entry->file->src, strerror(errno));
+		return 0;
+	}
+
+	while (left > 0) {
+		n = fread(buffer, 1, left < IO_BUFFER ? left : IO_BUFFER, fp);
+		if (n == 0)
+			break;
+		crc = crc32(crc, buffer, n);
+		if (fwrite(buffer, n, 1, out) != 1) {
+			fclose(fp);
+			return 0;
+		}
+		left -= n;
+	}
+
+	if (left > 0 || fgetc(fp) != EOF || crc != entry->crc) {
+		printf("Error adding \'%s\': file changed while packing\n", entry->file->src);
+		fclose(fp);
+		return 0;
+	}
+
+	fclose(fp);
+	return 1;
+}
+
+/* Copies an unchanged entry's compressed data over from the previous archive */
+static int copy_previous(FILE *out, FILE *prev, const pack_entry *entry, unsigned char *buffer)
+{
+	unsigned char hdr[30];
+	uint64_t left = entry->comp_size;
+	size_t n;
+
+	if (!read_at(prev, entry->previous->offset, hdr, 30) || get32(hdr) != 0x04034b50
+			|| fseeko(prev, entry->previous->offset + 30 + get16(hdr + 26) + get16(hdr + 28), SEEK_SET) != 0)
+		goto corrupt;
+
+	while (left > 0) {
+		n = fread(buffer, 1, left < IO_BUFFER ? left : IO_BUFFER, prev);
+		if (n == 0)
+			goto corrupt;
+		if (fwrite(buffer, n, 1, out) != 1)
+			return 0;
+		left -= n;
+	}
+
+	return 1;
+corrupt:
+	printf("Error adding \'%s\': previous archive entry \'%s\' is damaged\n",
+		entry->file->src, entry->previous->name);
+	return 0;
+}
+
+static int write_central_directory(FILE *out, const pack_entry *entries, int num_entries, uint64_t cd_offset)
+{
+	unsigned char hdr[56 + 20 + 22];
+	unsigned char extra[4 + 24];
+	const pack_entry *entry;
+	uint64_t cd_size = 0;
+	size_t name_len, extra_len;
+	int i;
+
+	for (i = 0; i < num_entries; i++) {
+		entry = &entries[i];
+		name_len = strlen(entry->file->dst);
+
+		/* Only the fields that overflow go into the ZIP64 extra field, in this order */
+		extra_len = 4;
+		if (entry->size >= ZIP64_LIMIT)
+			put64(extra + (extra_len += 8) - 8, entry->size);
+		if (entry->comp_size >= ZIP64_LIMIT)
+			put64(extra + (extra_len += 8) - 8, entry->comp_size);
+		if (entry->offset >= ZIP64_LIMIT)
+			put64(extra + (extra_len += 8) - 8, entry->offset);
+		put16(extra, 0x0001);
+		put16(extra + 2, extra_len - 4);
+		if (extra_len == 4)
+			extra_len = 0;
+
+		put32(hdr + 0, 0x02014b50);
+		put16(hdr + 4, (3 << 8) | 45);		/* Made by UNIX */
+		put16(hdr + 6, extra_len ? 45 : 20);
+		put16(hdr + 8, entry_flags(entry));
+		put16(hdr + 10, entry->method);
+		put16(hdr + 12, entry->dtime);
+		put16(hdr + 14, entry->ddate);
+		put32(hdr + 16, entry->crc);
+		put32(hdr + 20, entry->comp_size >= ZIP64_LIMIT ? ZIP64_LIMIT : entry->comp_size);
+		put32(hdr + 24, entry->size >= ZIP64_LIMIT ? ZIP64_LIMIT : entry->size);
+		put16(hdr + 28, name_len);
+		put16(hdr + 30, extra_len);
+		put16(hdr + 32, 0);			/* Comment */
+		put16(hdr + 34, 0);			/* Disk */
+		put16(hdr + 36, 0);			/* Internal attributes */
+		put32(hdr + 38, 0100644 << 16);		/* Regular file, rw-r--r-- */
+		put32(hdr + 42, entry->offset >= ZIP64_LIMIT ? ZIP64_LIMIT : entry->offset);
+
+		if (fwrite(hdr, 46, 1, out) != 1 || fwrite(entry->file->dst, name_len, 1, out) != 1)
+			return 0;
+		if (extra_len && fwrite(extra, extra_len, 1, out) != 1)
+			return 0;
+		cd_size += 46 + name_len + extra_len;
+	}
+
+	if (num_entries >= 0xFFFF || cd_offset >= ZIP64_LIMIT || cd_size >= ZIP64_LIMIT) {
+		/* ZIP64 end of central directory record and its locator */
+		put32(hdr + 0, 0x06064b50);
+		put64(hdr + 4, 56 - 12);
+		put16(hdr + 12, (3 << 8) | 45);
+		put16(hdr + 14, 45);
+		put32(hdr + 16, 0);
+		put32(hdr + 20, 0);
+		put64(hdr + 24, num_entries);
+		put64(hdr + 32, num_entries);
+		put64(hdr + 40, cd_size);
+		put64(hdr + 48, cd_offset);
+
+		put32(hdr + 56, 0x07064b50);
+		put32(hdr + 60, 0);
+		put64(hdr + 64, cd_offset + cd_size);
+		put32(hdr + 72, 1);
+
+		if (fwrite(hdr, 56 + 20, 1, out) != 1)
+			return 0;
+	}
+
+	put32(hdr + 0, 0x06054b50);
+	put16(hdr + 4, 0);
+	put16(hdr + 6, 0);
+	put16(hdr + 8, num_entries >= 0xFFFF ? 0xFFFF : num_entries);
+	put16(hdr + 10, num_entries >= 0xFFFF ? 0xFFFF : num_entries);
+	put32(hdr + 12, cd_size >= ZIP64_LIMIT ? ZIP64_LIMIT : cd_size);
+	put32(hdr + 16, cd_offset >= ZIP64_LIMIT ? ZIP64_LIMIT : cd_offset);
+	put16(hdr + 20, 0);
+
+	return fwrite(hdr, 22, 1, out) == 1;
+}
+
+static int compare_dst(const void *a, const void *b)
+{
+	return strcmp((*(const vpk_file **)a)->dst, (*(const vpk_file **)b)->dst);
+}
+
+static int compare_file_dst(const void *a, const void *b)
+{
+	return strcmp(((const vpk_file *)a)->dst, ((const vpk_file *)b)->dst);
+}
+
+/* The archive cannot hold two entries of the same name */
+static int check_unique(const vpk_file *files, int num_files)
+{
+	const vpk_file **sorted;
+	int i, ok = 1;
+
+	if (num_files < 2)
+		return 1;
+	if ((sorted = malloc(num_files * sizeof(*sorted))) == NULL)
+		return 0;
+
+	for (i = 0; i < num_files; i++)
+		sorted[i] = &files[i];
+	qsort(sorted, num_files, sizeof(*sorted), compare_dst);
+
+	for (i = 1; i < num_files; i++) {
+		if (strcmp(sorted[i - 1]->dst, sorted[i]->dst) == 0) {
+			printf("Error adding \'%s\': \'%s\' is already in the archive\n", sorted[i]->src, sorted[i]->dst);
+			ok = 0;
+			break;
+		}
+	}
+
+	free(sorted);
+	return ok;
+}
+
+static int compare_size_level(const void *a, const void *b)
+{
+	const pack_entry *x = *(const pack_entry **)a, *y = *(const pack_entry **)b;
+
+	if (x->src_size != y->src_size)
+		return x->src_size < y->src_size ? -1 : 1;
+	return x->level - y->level;
+}
+
+/* Records each source's size and time.  With dedup, entries sharing both
+ * size and level with another become candidates to share data; the rest
+ * cannot have a duplicate and are never hashed. */
+static int stat_entries(pack_queue *queue, const vpk_pack_options *options)
+{
+	pack_entry **sorted;
+	struct stat st;
+	size_t slots;
+	int i, num_candidates = 0;
+
+	for (i = 0; i < queue->num_entries; i++) {
+		if (queue->entries[i].file->data) {
+			st.st_size = queue->entries[i].file->size;
+			st.st_mtime = time(NULL);
+		} else if (stat(queue->entries[i].file->src, &st) != 0) {
+			printf("Error adding \'%s\': %s\n", queue->entries[i].file->src, strerror(errno));
+			return 0;
+		} else if (!S_ISREG(st.st_mode)) {
+			printf("Error adding \'%s\': %s\n", queue->entries[i].file->src, strerror(EISDIR));
+			return 0;
+		}
+		queue->entries[i].src_size = st.st_size;
+		if (options->deterministic)
+			dos_time(options->timestamp, 1, &queue->entries[i].dtime, &queue->entries[i].ddate);
+		else
+			dos_time(st.st_mtime, 0, &queue->entries[i].dtime, &queue->entries[i].ddate);
+		queue->entries[i].dup = -1;
+	}
+
+	if (!options->dedup || queue->num_entries < 2)
+		return 1;
+
+	if ((sorted = malloc(queue->num_entries * sizeof(*sorted))) == NULL) {
+		printf("Out of memory.\n");
+		return 0;
+	}
+	for (i = 0; i < queue->num_entries; i++)
+		sorted[i] = &queue->entries[i];
+	qsort(sorted, queue->num_entries, sizeof(*sorted), compare_size_level);
+
+	for (i = 1; i < queue->num_entries; i++) {
+		if (sorted[i]->src_size > 0 && compare_size_level(&sorted[i - 1], &sorted[i]) == 0) {
+			num_candidates += !sorted[i - 1]->candidate + 1;
+			sorted[i - 1]->candidate = sorted[i]->candidate = 1;
+		}
+	}
+	free(sorted);
+
+	if (num_candidates == 0)
+		return 1;
+
+	for (slots = 16; slots < (size_t)num_candidates * 2; slots *= 2)
+		;
+	if ((queue->blobs = calloc(slots, sizeof(int))) == NULL) {
+		printf("Out of memory.\n");
+		return 0;
+	}
+	queue->blobs_mask = slots - 1;
+
+	return 1;
+}
+
+/* A duplicate of an entry already written copies its data back out of the
+ * archive being written */
+static int copy_written(FILE *out, FILE **readback, const char *tmp_path,
+		uint64_t offset, uint64_t len, unsigned char *buffer)
+{
+	size_t n;
+
+	if (fflush(out) != 0)
+		return 0;
+	if (!*readback && (*readback = fopen(tmp_path, "rb")) == NULL)
+		return 0;
+	if (fseeko(*readback, offset, SEEK_SET) != 0)
+		return 0;
+
+	while (len > 0) {
+		n = fread(buffer, 1, len < IO_BUFFER ? len : IO_BUFFER, *readback);
+		if (n == 0 || fwrite(buffer, n, 1, out) != 1)
+			return 0;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static int rename_output(const char *tmp_path, const char *output)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	return MoveFileExA(tmp_path, output, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(tmp_path, output) == 0;
+#endif
+}
+
+int vpk_pack(const char *output, const vpk_file *files, int num_files, const vpk_pack_options *options)
+{
+	pack_queue queue = {0};
+	previous_archive prev = {0};
+	pthread_t *threads = NULL;
+	vpk_file *sorted = NULL;
+	pack_entry *entry;
+	unsigned char *buffer = NULL;
+	char *tmp_path = NULL;
+	FILE *out = NULL, *readback = NULL;
+	pack_entry *source;
+	uint64_t offset = 0;
+	int num_threads = options->num_threads;
+	int started = 0;
+	int ok = 0;
+	int i;
+
+	if (!check_unique(files, num_files))
+		return 0;
+
+	/* Argument order is an accident of the build; names are not */
+	if (options->deterministic && num_files > 1) {
+		if ((sorted = malloc(num_files * sizeof(*sorted))) == NULL) {
+			printf("Out of memory.\n");
+			return 0;
+		}
+		memcpy(sorted, files, num_files * sizeof(*sorted));
+		qsort(sorted, num_files, sizeof(*sorted), compare_file_dst);
+		files = sorted;
+	}
+
+	if ((queue.entries = calloc(num_files ? num_files : 1, sizeof(pack_entry))) == NULL
+			|| (buffer = malloc(IO_BUFFER)) == NULL
+			|| (tmp_path = malloc(strlen(output) + 32)) == NULL) {
+		printf("Error creating: \'%s\': %s\n", output, strerror(errno));
+		goto cleanup;
+	}
+
+	if (options->previous)
+		previous_open(&prev, options->previous);
+
+	for (i = 0; i < num_files; i++) {
+		queue.entries[i].file = &files[i];
+		queue.entries[i].level = vpk_pack_level(options, files[i].dst);
+		queue.entries[i].previous = previous_find(&prev, files[i].dst);
+	}
+
+	queue.num_entries = num_files;
+	if (!stat_entries(&queue, options))
+		goto cleanup;
+
+	sprintf(tmp_path, "%s.%ld.tmp", output, (long)getpid());
+	if ((out = fopen(tmp_path, "wb")) == NULL) {
+		printf("Error creating: \'%s\': %s\n", tmp_path, strerror(errno));
+		goto cleanup;
+	}
+	setvbuf(out, NULL, _IOFBF, IO_BUFFER);
+
+	if (num_threads <= 0)
+		num_threads = online_cpus();
+	if (num_threads > num_files)
+		num_threads = num_files;
+
+	queue.window = 4 * (num_threads ? num_threads : 1);
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.ready, NULL);
+	pthread_cond_init(&queue.room, NULL);
+
+	threads = calloc(num_threads ? num_threads : 1, sizeof(pthread_t));
+	for (started = 0; threads && started < num_threads; started++) {
+		if (pthread_create(threads + started, NULL, pack_worker, &queue) != 0)
+			break;
+	}
+	if (started == 0 && num_files > 0) {
+		printf("Error creating: \'%s\': could not start any workers\n", output);
+		goto stop;
+	}
+
+	/* Entries go out in order as soon as each is ready */
+	for (i = 0; i < num_files; i++) {
+		entry = &queue.entries[i];
+
+		pthread_mutex_lock(&queue.lock);
+		while (entry->state == ENTRY_PENDING)
+			pthread_cond_wait(&queue.ready, &queue.lock);
+		pthread_mutex_unlock(&queue.lock);
+
+		if (entry->state == ENTRY_FAILED)
+			goto stop;
+
+		/* A duplicate takes everything but its name from the entry it shares
+		 * data with, which may come before or after it */
+		source = entry;
+		if (entry->dup >= 0) {
+			source = &queue.entries[entry->dup];
+
+			pthread_mutex_lock(&queue.lock);
+			while (source->state == ENTRY_PENDING)
+				pthread_cond_wait(&queue.ready, &queue.lock);
+			pthread_mutex_unlock(&queue.lock);
+
+			if (source->state == ENTRY_FAILED)
+				goto stop;
+
+			entry->method = source->method;
+			entry->crc = source->crc;
+			entry->comp_size = source->comp_size;
+		}
+
+		entry->offset = offset;
+		if (!write_local_header(out, entry))
+			goto write_error;
+		offset += 30 + strlen(entry->file->dst);
+		if (entry->size >= ZIP64_LIMIT || entry->comp_size >= ZIP64_LIMIT)
+			offset += 20;
+		entry->data_offset = offset;
+
+		if (entry->dup >= 0 && entry->dup < i) {
+			if (!copy_written(out, &readback, tmp_path, source->data_offset, entry->comp_size, buffer))
+				goto write_error;
+		} else if (source->reuse) {
+			if (!copy_previous(out, prev.fp, source, buffer))
+				goto stop;
+		} else if (source->method == ZIP_STORED) {
+			if (!copy_stored(out, source, buffer))
+				goto stop;
+		} else if (!spool_copy(&source->data, out, buffer)) {
+			goto write_error;
+		}
+		spool_free(&entry->data);
+
+		offset += entry->comp_size;
+
+		pthread_mutex_lock(&queue.lock);
+		queue.written = i + 1;
+		pthread_cond_broadcast(&queue.room);
+		pthread_mutex_unlock(&queue.lock);
+	}
+
+	if (!write_central_directory(out, queue.entries, num_files, offset))
+		goto write_error;
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto write_error;
+	}
+	out = NULL;
+
+	if (!rename_output(tmp_path, output)) {
+		printf("Error creating: \'%s\': %s\n", output, strerror(errno));
+		goto stop;
+	}
+
+	ok = 1;
+	goto stop;
+
+write_error:
+	printf("Error creating: \'%s\': %s\n", output, strerror(errno));
+stop:
+	pthread_mutex_lock(&queue.lock);
+	queue.abort = 1;
+	pthread_cond_broadcast(&queue.room);
+	pthread_mutex_unlock(&queue.lock);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&queue.room);
+	pthread_cond_destroy(&queue.ready);
+	pthread_mutex_destroy(&queue.lock);
+cleanup:
+	if (readback)
+		fclose(readback);
+	if (out)
+		fclose(out);
+	if (!ok && tmp_path)
+		remove(tmp_path);
+	for (i = 0; queue.entries && i < num_files; i++)
+		spool_free(&queue.entries[i].data);
+	free(queue.entries);
+	free(queue.blobs);
+	free(sorted);
+	previous_close(&prev);
+	free(threads);
+	free(tmp_path);
+	free(buffer);
+
+	return ok;
+}
@@ -0,0 +1,62 @@
+#ifndef VPK_PACK_H
+#define VPK_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define VPK_LEVEL_STORE		0	/* Entry is stored without compression */
+#define VPK_LEVEL_DEFAULT	9	/* What every entry got before levels were configurable */
+
+#define VPK_TIMESTAMP_DEFAULT	315532800	/* 1980-01-01 00:00:00 UTC, the earliest DOS time */
+
+/* One file to put into the archive */
+typedef struct {
+	const char *src;	/* Path on disk, or just a name for messages if data is set */
+	const char *dst;	/* Name inside the archive */
+	const void *data;	/* Contents held in memory instead, or NULL */
+	size_t size;
+} vpk_file;
+
+/* Entries whose name matches pattern (a glob where '*' also crosses '/',
+ * compared without regard to case) get this zlib level.  Later rules win. */
+typedef struct {
+	const char *pattern;
+	int level;
+} vpk_level_rule;
+
+typedef struct {
+	int num_threads;		/* Compression workers; 0 = one per online CPU */
+	int default_level;		/* Level for entries no rule matches */
+	int store_compressed;		/* Store formats that are compressed already (PNG, OGG, AT9...) */
+	const vpk_level_rule *rules;
+	int num_rules;
+	const char *previous;		/* Archive whose unchanged entries are copied over, or NULL */
+	int dedup;			/* Compress identical sources once and copy the result */
+	int deterministic;		/* Sort entries by name and date them all at timestamp */
+	time_t timestamp;		/* Taken as UTC; VPK_TIMESTAMP_DEFAULT unless overridden */
+} vpk_pack_options;
+
+/* Fills in the defaults: every CPU, VPK_LEVEL_DEFAULT, known formats stored,
+ * duplicates detected */
+void vpk_pack_options_init(vpk_pack_options *options);
+
+/* The zlib level options gives the entry named dst */
+int vpk_pack_level(const vpk_pack_options *options, const char *dst);
+
+/* Writes files to a ZIP archive at output.  Entries are compressed in
+ * parallel and written in the given order as they become ready, then the
+ * central directory follows; ZIP64 records are used once the archive needs
+ * them.  The archive is assembled next to output and renamed into place.
+ * An entry that options->previous holds with the same size, modification
+ * time and CRC as its source keeps its compressed data from there.
+ * With options->dedup, sources of equal size and level are hashed first and
+ * each distinct content is compressed only once; every entry still gets its
+ * own local header, as extractors insist that it match the central one.
+ * With options->deterministic the same sources and options always give the
+ * same bytes: the number of threads never affects the output, and neither
+ * do argument order, modification times or the time zone.
+ * Returns 1 on success; errors are printed. */
+int vpk_pack(const char *output, const vpk_file *files, int num_files, const vpk_pack_options *options);
+
+#endif